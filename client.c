@@ -20,6 +20,7 @@
 #include <unistd.h> /*getopt*/
 #endif
 #include <sys/types.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -127,10 +128,10 @@ loop_until_end(int sd)
 {
     int errcnd;
     char line[1000];
-    int length, to_read;
+    int length;
     char *pline, *lenstr, *resp;
     int got;
-    FILE *file;
+    int file, data;
 
     for (;;)
     {
@@ -209,20 +210,25 @@ loop_until_end(int sd)
             }
 
         }
-        if ((file = fopen(RCVD_FILENAME, "w")) == NULL)
+        if ((file = open(RCVD_FILENAME, O_WRONLY | O_CREAT | O_TRUNC,
+                         0666)) < 0 ||
+            (quiet_opt && (data = open("/dev/null", O_WRONLY)) < 0))
         {
             perror("file_to_write error");
             errcnd = 1;
             break;
         }
-        /* Retrieve the remote file and write it to a local file */
+        if (!quiet_opt)
+            data = file;
+
+        /* Retrieve the remote file and write it to a local file, straight
+         * from the mysocket layer's receive queue */
         while (length)
         {
-            to_read = MIN(length, (int) sizeof(line));
-
-            if ((got = myread(sd, line, to_read)) < 0)
+            if ((got = myrecvfile(sd, data, length,
+                                  MYRECVFILE_PREALLOC)) < 0)
             {
-                perror("myread");
+                perror("myrecvfile");
                 errcnd = 1;
                 break;
             }
@@ -232,37 +238,22 @@ loop_until_end(int sd)
                 break;
             }
 
-            if (got < to_read)
-            {
-                to_read = got;
-            }
-
-            if (!quiet_opt)
-            {
-                while (0 == fwrite(line, 1, to_read, file))
-                {
-                    if (errno != EINTR)
-                    {
-                        perror("fwrite");
-                        errcnd = 1;
-                        break;
-                    }
-                }
-            }
-            length -= to_read;
+            length -= got;
         }
 
+        if (data != file)
+            close(data);
         if (length)
         {
             fprintf(stderr,
                     "Exiting: read bad number of bytes (%d less than expected)...\n",
                     length);
-            fclose(file);
+            close(file);
             myclose(sd);
             exit(-1);
         }
 
-        fclose(file);
+        close(file);
         if (filename != NULL)
             break;
 
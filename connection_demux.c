@@ -61,23 +61,28 @@ typedef struct
 /* maintains queue of pending connections per listening socket.
  * there is one entry in listen_table per passive (listening) socket.
  */
+#define LISTEN_TABLE_SIZE 64
+
 HASH_TABLE_DECLARE(listen_table, mysocket_t, listen_queue_t *,
-                   MAX_NUM_CONNECTIONS);
+                   LISTEN_TABLE_SIZE);
 static pthread_rwlock_t listen_lock; /* XXX: see notes in network_io_vns.c */
 
 static listen_queue_t *_get_connection_queue(mysock_context_t *ctx);
 
 
 /* called by myaccept() to grab the first completed connection off the
- * given mysocket's connection queue, or block until one completes.
+ * given mysocket's connection queue, or block until one completes.  if
+ * wait is FALSE, this returns FALSE instead of blocking.
  */
-void _mysock_dequeue_connection(mysock_context_t  *accept_ctx,
-                                mysock_context_t **new_ctx)
+bool_t _mysock_dequeue_connection(mysock_context_t  *accept_ctx,
+                                  mysock_context_t **new_ctx,
+                                  bool_t             wait)
 {
     listen_queue_t *q;
     completed_connect_t *r;
 
     assert(accept_ctx && new_ctx);
+    *new_ctx = NULL;
     assert(accept_ctx->listening && accept_ctx->bound);
 
     DEBUG_LOG(("waiting for new connection...\n"));
@@ -86,12 +91,15 @@ void _mysock_dequeue_connection(mysock_context_t  *accept_ctx,
     assert(q);
 
     PTHREAD_CALL(pthread_mutex_lock(&q->connection_lock));
-    while (!q->completed_queue)
+    while (!q->completed_queue && wait)
     {
         PTHREAD_CALL(pthread_cond_wait(&q->connection_cond,
                                        &q->connection_lock));
     }
 
+    if (!q->completed_queue)
+        goto done;
+
     r = q->completed_queue;
     q->completed_queue = q->completed_queue->next;
 
@@ -112,9 +120,12 @@ void _mysock_dequeue_connection(mysock_context_t  *accept_ctx,
 
     assert(q->cur_len > 0);
     --q->cur_len;
+    __sync_sub_and_fetch(&accept_ctx->accept_ready, 1);
 
+done:
     PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
     PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+    return (*new_ctx != NULL);
 }
 
 static void _debug_print_connection(const char *msg, const char *reason,
@@ -220,6 +231,9 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
 
         new_ctx = _mysock_get_context(queue_entry->sd);
         new_ctx->listen_sd = ctx->my_sd;
+        new_ctx->opts = ctx->opts;
+        new_ctx->busy_poll_usec = ctx->busy_poll_usec;
+        new_ctx->nonblocking = ctx->nonblocking;
 
         new_ctx->network_state.peer_addr       = *peer_addr;
         new_ctx->network_state.peer_addr_len   = peer_addr_len;
@@ -238,11 +252,14 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
                                       &ctx->network_state,
                                       user_data, packet, packet_len);
 
-        _mysock_transport_init(queue_entry->sd, FALSE);
-
-        /* pass the SYN packet on to the main STCP code */
+        /* pass the SYN packet on to the main STCP code.  this is queued
+         * before the new mysocket starts receiving, as the network poller
+         * must be the only thread feeding its queue from then on.
+         */
         _mysock_enqueue_buffer(new_ctx, &new_ctx->network_recv_queue,
                                packet, packet_len);
+
+        _mysock_transport_init(queue_entry->sd, FALSE);
     }
     else
     {
@@ -259,13 +276,15 @@ done:
 
 void _mysock_passive_connection_complete(mysock_context_t *ctx)
 {
+    mysock_context_t *listen_ctx;
     listen_queue_t *q;
 
     assert(ctx);
 
     PTHREAD_CALL(pthread_rwlock_rdlock(&listen_lock));
     assert(ctx->listen_sd >= 0);
-    if ((q = _get_connection_queue(_mysock_get_context(ctx->listen_sd))))
+    listen_ctx = _mysock_get_context(ctx->listen_sd);
+    if ((q = _get_connection_queue(listen_ctx)))
     {
         completed_connect_t *tail, *new_entry;
         connect_request_t *connection_req = NULL;
@@ -296,9 +315,13 @@ void _mysock_passive_connection_complete(mysock_context_t *ctx)
             tail->next = new_entry;
         else
             q->completed_queue = new_entry;
+        __sync_add_and_fetch(&listen_ctx->accept_ready, 1);
 
         PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
         PTHREAD_CALL(pthread_cond_signal(&q->connection_cond));
+
+        /* the listening mysocket stays put while we hold listen_lock */
+        _mysock_poll_notify(listen_ctx);
     }
     PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
 }
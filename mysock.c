@@ -4,9 +4,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <limits.h>
 #include <assert.h>
 #include <netinet/in.h>
+#include <time.h>
 #include <pthread.h>
+#include <unistd.h>
 #include "mysock.h"
 #include "mysock_impl.h"
 #include "network_io.h"
@@ -22,209 +25,1480 @@
 #endif  /*NDEBUG*/
 
 
-/* helper functions to start transport layer and network receive threads */
+/* helper function to start the transport layer */
 static void *transport_thread_func(void *arg);
 
 static void verify_mysocket_descriptor(mysock_context_t *comp_ctx,
                                        mysocket_t        my_sd);
 static mysock_context_t *_mysock_allocate_context(void);
 static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq);
+static void _mysock_init_queue(packet_queue_t *pq,
+                               unsigned char producer, unsigned char consumer);
+static void _mysock_append_node(mysock_context_t    *ctx,
+                                packet_queue_t      *pq,
+                                packet_queue_node_t *node);
+static void _mysock_free_node(packet_queue_node_t *node);
+static void _mysock_zc_sent(mysock_context_t *ctx, zc_write_t *zc);
+static void _mysock_zc_abort(mysock_context_t *ctx, int error);
+static void _mysock_wake_writer(mysock_context_t *ctx);
+static void _mysock_reap_orphan(mysock_context_t *ctx);
+static void _mysock_linger_at_exit(void);
+static void _mysock_wait_for_orphans(void);
+static void _mysock_free_descriptor(mysock_context_t *ctx);
+
+
+/* mysocket descriptor table, one slot per STCP connection.  a descriptor
+ * is its slot's index plus a multiple of MAX_NUM_CONNECTIONS, the slot's
+ * generation, which moves on each time the slot is freed; a stale
+ * descriptor for a closed mysocket then doesn't find whichever mysocket
+ * took over its slot.
+ *
+ * the table grows a chunk of slots at a time, and chunks are never freed,
+ * so _mysock_get_context() needs no lock while other threads create and
+ * close mysockets.  free slots are kept on a FIFO list (under table_lock),
+ * so that allocation takes constant time, and a slot's generation only
+ * comes round again after many mysockets have used the others.
+ */
+#define SD_CHUNK_SLOTS 1024
+#define SD_NUM_CHUNKS  (MAX_NUM_CONNECTIONS / SD_CHUNK_SLOTS)
+#define SD_NO_SLOT     ((unsigned int) -1)
+
+#if MAX_NUM_CONNECTIONS % SD_CHUNK_SLOTS != 0
+    #error MAX_NUM_CONNECTIONS should be a multiple of SD_CHUNK_SLOTS
+#endif
+
+typedef struct
+{
+    mysock_context_t *volatile ctx;
+    volatile mysocket_t        sd;         /* for the slot's next user */
+    unsigned int               next_free;
+} sd_slot_t;
+
+static sd_slot_t *volatile sd_chunks[SD_NUM_CHUNKS];
+static unsigned int        sd_num_slots;
+static unsigned int        sd_free_head = SD_NO_SLOT;
+static unsigned int        sd_free_tail = SD_NO_SLOT;
+static pthread_mutex_t     table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* number of orphaned mysockets (see mysock_impl.h) still finishing their
+ * close handshake.  since the transport runs in this process rather than
+ * in a kernel, exit() waits up to MYSOCK_CLOSE_LINGER seconds for these
+ * before tearing everything down.
+ */
+#define MYSOCK_CLOSE_LINGER 10
+
+static unsigned int    num_orphans;
+static pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  orphan_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t  orphan_once = PTHREAD_ONCE_INIT;
+
+/* options new mysockets start with (see mysetsockopt()):  in order, send
+ * buffer, receive window, low-watermarks, no-delay, cork, MSS, congestion
+ * control, keepalive and transport profile
+ */
+static mysock_opts_t   default_opts =
+{
+    MYSOCK_DEFAULT_SNDBUF, 0, 1, 1, TRUE, FALSE, 0, MYCC_DEFAULT, 0,
+    MYPROFILE_DEFAULT
+};
+static pthread_mutex_t default_opts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* the table slot for the given index, or NULL if the table isn't that
+ * big yet
+ */
+static INLINE sd_slot_t *_mysock_sd_slot(unsigned int index)
+{
+    sd_slot_t *chunk;
+
+    assert(index < MAX_NUM_CONNECTIONS);
+    chunk = __atomic_load_n(&sd_chunks[index / SD_CHUNK_SLOTS],
+                            __ATOMIC_ACQUIRE);
+    return chunk ? &chunk[index % SD_CHUNK_SLOTS] : NULL;
+}
+
+/* create a new mysocket, and find space in our mysocket descriptor table */
+mysocket_t _mysock_new_mysocket()
+{
+    mysock_context_t *connection_context = _mysock_allocate_context();
+    sd_slot_t *slot = NULL;
+    unsigned int k;
+
+    if (!connection_context)
+        return -1;  /* e.g. out of file descriptors */
+
+    PTHREAD_CALL(pthread_mutex_lock(&table_lock));
+    if ((k = sd_free_head) == SD_NO_SLOT && sd_num_slots < MAX_NUM_CONNECTIONS)
+    {
+        /* no free slots; add another chunk of them */
+        sd_slot_t *chunk = (sd_slot_t *)
+            calloc(SD_CHUNK_SLOTS, sizeof(sd_slot_t));
+
+        if (chunk)
+        {
+            for (k = 0; k < SD_CHUNK_SLOTS; ++k)
+            {
+                chunk[k].sd = sd_num_slots + k;
+                chunk[k].next_free = (k + 1 < SD_CHUNK_SLOTS) ?
+                    sd_num_slots + k + 1 : SD_NO_SLOT;
+            }
+            __atomic_store_n(&sd_chunks[sd_num_slots / SD_CHUNK_SLOTS],
+                             chunk, __ATOMIC_RELEASE);
+
+            sd_free_head = sd_num_slots;
+            sd_free_tail = sd_num_slots + SD_CHUNK_SLOTS - 1;
+            sd_num_slots += SD_CHUNK_SLOTS;
+        }
+        k = sd_free_head;
+    }
+
+    if (k != SD_NO_SLOT)
+    {
+        slot = _mysock_sd_slot(k);
+        if ((sd_free_head = slot->next_free) == SD_NO_SLOT)
+            sd_free_tail = SD_NO_SLOT;
+
+        connection_context->my_sd = slot->sd;
+        __atomic_store_n(&slot->ctx, connection_context, __ATOMIC_RELEASE);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&table_lock));
+
+    if (!slot)
+    {
+        _mysock_free_context(connection_context);
+        errno = EMFILE;
+        return -1;
+    }
+
+    return connection_context->my_sd;
+}
+
+/* obtain a pointer to the connection context for the given mysocket
+ * descriptor, or NULL if it isn't open.  this takes no locks; as with
+ * close(), it's up to the application not to use a descriptor while it's
+ * being closed.
+ */
+mysock_context_t *_mysock_get_context(mysocket_t sd)
+{
+    mysock_context_t *ctx;
+    sd_slot_t *slot;
+
+    if (sd < 0)
+        return NULL;
+    if ((slot = _mysock_sd_slot(sd % MAX_NUM_CONNECTIONS)) == NULL)
+        return NULL;
+
+    /* the slot's descriptor moves on before it's reused, so check it after
+     * picking up the context
+     */
+    ctx = __atomic_load_n(&slot->ctx, __ATOMIC_ACQUIRE);
+    if (!ctx || __atomic_load_n(&slot->sd, __ATOMIC_ACQUIRE) != sd)
+        return NULL;
+
+    assert(ctx->my_sd == sd);
+    return ctx;
+}
+
+/* give ctx's descriptor back to the table */
+static void _mysock_free_descriptor(mysock_context_t *ctx)
+{
+    sd_slot_t *slot;
+    unsigned int k;
+
+    if (ctx->my_sd < 0)
+        return;     /* never got one */
+
+    k = ctx->my_sd % MAX_NUM_CONNECTIONS;
+    slot = _mysock_sd_slot(k);
+    assert(slot && slot->ctx == ctx && slot->sd == ctx->my_sd);
+
+    PTHREAD_CALL(pthread_mutex_lock(&table_lock));
+    __atomic_store_n(&slot->ctx, (mysock_context_t *) NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->sd,
+                     (mysocket_t) (((unsigned int) ctx->my_sd +
+                                    MAX_NUM_CONNECTIONS) & INT_MAX),
+                     __ATOMIC_RELEASE);
+
+    slot->next_free = SD_NO_SLOT;
+    if (sd_free_tail != SD_NO_SLOT)
+        _mysock_sd_slot(sd_free_tail)->next_free = k;
+    else
+        sd_free_head = k;
+    sd_free_tail = k;
+    PTHREAD_CALL(pthread_mutex_unlock(&table_lock));
+}
+
+/* initiate a new STCP connection; called by myconnect() and myaccept() */
+void _mysock_transport_init(mysocket_t sd, bool_t is_active)
+{
+    mysock_context_t *connection_context = _mysock_get_context(sd);
+
+    assert(!connection_context->listening);
+    connection_context->is_active = is_active;
+
+    /* start receiving from the network; the network poller queues incoming
+     * data for the transport layer.  (network input is handled on separate
+     * threads so we can keep track of timeouts/when data arrives, in a
+     * portable manner independent of the underlying network I/O
+     * functionality).
+     */
+    if (_network_start_recv(connection_context) < 0)
+    {
+        assert(0);
+        abort();
+    }
+
+    if (_mysock_reactor_enabled())
+    {
+        /* run the transport on one of the reactor's worker threads */
+        _mysock_reactor_add(connection_context);
+        return;
+    }
+
+    if (_mysock_fibers_enabled())
+    {
+        /* run the transport in a fiber; it's recorded before it can run, so
+         * anyone waking it finds it
+         */
+        connection_context->transport_fiber =
+            _mysock_fiber_create(transport_thread_func, connection_context);
+        _mysock_fiber_run(connection_context->transport_fiber);
+        return;
+    }
+
+    /* start a new transport layer thread */
+    connection_context->transport_thread = _mysock_create_thread(
+        transport_thread_func,
+        connection_context,
+        FALSE);
+    connection_context->transport_thread_started = TRUE;
+}
+
+/* block until we either connect to the peer, or hit an error (in which
+ * case ctx->stcp_errno says which).  if wait is FALSE, this just returns
+ * FALSE if neither has happened yet.
+ */
+bool_t _mysock_wait_for_connection(mysock_context_t *ctx, bool_t wait)
+{
+    bool_t done;
+
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
+    while (ctx->blocking && wait)
+    {
+        PTHREAD_CALL(pthread_cond_wait(&ctx->blocking_cond,
+                                       &ctx->blocking_lock));
+    }
+    done = !ctx->blocking;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
+
+    return done;
+}
+
+
+/* packet queues.  each of a connection's three queues is a bounded ring
+ * with a single producer and a single consumer (see packet_queue_t), so
+ * neither end takes a lock to queue or dequeue a node.  the ends only meet
+ * when one has to sleep:  a sleeper announces itself with a flag, and the
+ * other end checks the flag after each update, waking just that thread.
+ */
+
+/* number of nodes queued.  the consumer's view may lag the producer's, but
+ * never includes a node that isn't fully queued.
+ */
+static INLINE unsigned int _mysock_queue_count(const packet_queue_t *pq)
+{
+    unsigned int head = __atomic_load_n(&pq->head, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&pq->tail, __ATOMIC_ACQUIRE) - head;
+}
+
+bool_t _mysock_queue_empty(const packet_queue_t *pq)
+{
+    assert(pq);
+    return _mysock_queue_count(pq) == 0;
+}
+
+/* TRUE if a data node (or, if marker is set, a zero-length marker) can be
+ * queued without waiting.  the last PACKET_QUEUE_RESERVED slots are kept
+ * for markers.
+ */
+bool_t _mysock_queue_has_room(const packet_queue_t *pq, bool_t marker)
+{
+    assert(pq);
+    return PACKET_QUEUE_SLOTS - _mysock_queue_count(pq) >
+        (marker ? 0 : PACKET_QUEUE_RESERVED);
+}
+
+/* bytes of data queued.  'enqueued' is published after 'tail', so reading
+ * it first gives the consumer a count that's never ahead of the nodes it
+ * can see.
+ */
+size_t _mysock_queue_bytes(const packet_queue_t *pq)
+{
+    size_t enqueued;
+
+    assert(pq);
+    enqueued = __atomic_load_n(&pq->enqueued, __ATOMIC_ACQUIRE);
+    return enqueued - __atomic_load_n(&pq->dequeued, __ATOMIC_ACQUIRE);
+}
+
+/* bytes of data in a node, for the consumer.  the node at the tail of a
+ * stream queue may grow at any time, but never shrinks.
+ */
+static INLINE size_t _mysock_node_len(packet_queue_node_t *node)
+{
+    return __atomic_load_n(&node->data_len, __ATOMIC_ACQUIRE);
+}
+
+/* TRUE if the most recently queued node is a zero-length marker; for the
+ * consumer, which owns every node it can see
+ */
+static bool_t _mysock_queue_marker_at_tail(const packet_queue_t *pq)
+{
+    unsigned int tail = __atomic_load_n(&pq->tail, __ATOMIC_ACQUIRE);
+
+    return tail != pq->head &&
+        !_mysock_node_len(pq->slots[(tail - 1) % PACKET_QUEUE_SLOTS]);
+}
+
+/* TRUE if the producer won't queue any more data until some is read:
+ * there are no slots left for it, or the queue holds as much as its limit
+ */
+static bool_t _mysock_queue_full(const packet_queue_t *pq)
+{
+    size_t limit = pq->limit;
+
+    return !_mysock_queue_has_room(pq, FALSE) ||
+        (limit && _mysock_queue_bytes(pq) >= limit);
+}
+
+/* TRUE if a stream read wanting min_len bytes can go ahead:  that many
+ * are queued, the zero-length EOF marker has been queued, or the queue is
+ * full.  for the consumer.
+ */
+bool_t _mysock_stream_ready(const packet_queue_t *pq, size_t min_len)
+{
+    return _mysock_queue_bytes(pq) >= min_len ||
+        _mysock_queue_marker_at_tail(pq) || _mysock_queue_full(pq);
+}
+
+/* called by the producer when the queue has no room:  announce that it's
+ * waiting, so the consumer will wake it once it frees a slot.  returns
+ * FALSE if there turned out to be room after all, in which case no wakeup
+ * will come.  the network poller, which can't block, stops reading the
+ * socket instead (see _network_resume_recv()).
+ */
+bool_t _mysock_queue_wait_room(packet_queue_t *pq, bool_t marker)
+{
+    assert(pq);
+
+    pq->producer_waiting = TRUE;
+    __sync_synchronize();
+
+    if (!_mysock_queue_has_room(pq, marker) ||
+        !__sync_bool_compare_and_swap(&pq->producer_waiting, TRUE, FALSE))
+        return TRUE;    /* the consumer may have claimed the wakeup */
+    return FALSE;
+}
+
+/* put the transport to sleep on data_ready_cond until it's signalled, or
+ * abstime (if not NULL) passes; the caller holds data_ready_lock.  a
+ * transport running in a fiber yields its carrier thread instead.  returns
+ * FALSE if the time ran out.
+ */
+bool_t _mysock_transport_sleep(mysock_context_t      *ctx,
+                               const struct timespec *abstime)
+{
+    int rc;
+
+    assert(ctx);
+
+    if (ctx->transport_fiber)
+        return _mysock_fiber_wait(&ctx->data_ready_lock, abstime);
+
+    if (!abstime)
+    {
+        PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
+                                       &ctx->data_ready_lock));
+        return TRUE;
+    }
+
+    switch (rc = pthread_cond_timedwait(&ctx->data_ready_cond,
+                                        &ctx->data_ready_lock, abstime))
+    {
+    case 0: /* some data might be available */
+    case EINTR:
+        return TRUE;
+
+    case ETIMEDOUT: /* no data arrived in the specified time */
+        return FALSE;
+
+    default:
+        PTHREAD_CALL(rc);
+        assert(0);
+        return TRUE;
+    }
+}
+
+/* wake the transport from _mysock_transport_sleep(); the caller holds
+ * data_ready_lock
+ */
+void _mysock_transport_signal(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    if (ctx->transport_fiber)
+        _mysock_fiber_wake(ctx->transport_fiber);
+    else
+        PTHREAD_CALL(pthread_cond_signal(&ctx->data_ready_cond));
+}
+
+/* wake the transport, which waits on data_ready_cond for either of the
+ * queues it consumes (or a close request)
+ */
+void _mysock_wake_transport(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    __sync_synchronize();
+    if (ctx->reactor)
+    {
+        /* the transport is run by a reactor worker, not a waiting thread */
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        _mysock_reactor_notify(ctx);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    }
+    else if (ctx->transport_sleeping)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        _mysock_transport_signal(ctx);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    }
+}
+
+/* the consumer freed up room; wake the producer if it's waiting for it */
+static void _mysock_queue_wake_producer(mysock_context_t *ctx,
+                                        packet_queue_t   *pq)
+{
+    __sync_synchronize();
+    if (pq->producer == QUEUE_END_APP)
+        _mysock_poll_notify(ctx);
+
+    if (!pq->producer_waiting ||
+        !__sync_bool_compare_and_swap(&pq->producer_waiting, TRUE, FALSE))
+        return;
+
+    switch (pq->producer)
+    {
+    case QUEUE_END_NETWORK:
+        _network_resume_recv(ctx);
+        break;
+
+    case QUEUE_END_TRANSPORT:
+        /* it may be holding off network data until myread() catches up */
+        _mysock_wake_transport(ctx);
+        /* fall through */
+
+    case QUEUE_END_APP:
+    default:
+        PTHREAD_CALL(pthread_mutex_lock(&pq->wait_lock));
+        if (pq->producer == QUEUE_END_TRANSPORT && ctx->transport_fiber)
+            _mysock_fiber_wake(ctx->transport_fiber);
+        PTHREAD_CALL(pthread_cond_broadcast(&pq->wait_cond));
+        PTHREAD_CALL(pthread_mutex_unlock(&pq->wait_lock));
+        break;
+    }
+}
+
+/* the producer queued len more bytes, or a zero-length marker if len is
+ * zero; wake the consumer if it's waiting for them
+ */
+static void _mysock_queue_wake_consumer(mysock_context_t *ctx,
+                                        packet_queue_t   *pq,
+                                        size_t            len)
+{
+    size_t need;
+
+    if (pq->consumer == QUEUE_END_TRANSPORT)
+    {
+        _mysock_wake_transport(ctx);
+        return;
+    }
+
+    /* only myread() consumes the remaining queue; wake it once there's
+     * enough data to satisfy it, the (zero-length) EOF marker arrives, or
+     * the queue can't take any more.
+     */
+    assert(pq->consumer == QUEUE_END_APP);
+    __sync_synchronize();
+    _mysock_poll_notify(ctx);
+
+    if ((need = pq->consumer_need) != 0 &&
+        (_mysock_queue_bytes(pq) >= need || !len || _mysock_queue_full(pq)))
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&pq->wait_lock));
+        PTHREAD_CALL(pthread_cond_signal(&pq->wait_cond));
+        PTHREAD_CALL(pthread_mutex_unlock(&pq->wait_lock));
+    }
+}
+
+/* add an incoming buffer (packet) to a queue for this connection; it will be
+ * dequeued by stcp_network_recv() or myread() when the transport layer or
+ * application is ready to use it, depending on the queue to which
+ * the buffer (or packet) is added.  if the queue is full, this waits for
+ * room (zero-length markers never wait).
+ *
+ * this copies the specified buffer, into a pooled node for anything up to
+ * MAX_IP_PAYLOAD_LEN, so the calling code can do whatever it wants with
+ * the packet afterwards.  the node is recycled once it's dequeued.
+ */
+void _mysock_enqueue_buffer(mysock_context_t *ctx,
+                            packet_queue_t   *pq,
+                            const void       *packet,
+                            size_t            packet_len)
+{
+    struct iovec iov;
+
+    assert(packet || !packet_len);
+
+    iov.iov_base = (void *) packet;
+    iov.iov_len  = packet_len;
+    _mysock_enqueue_iovec(ctx, pq, &iov, 1, 0, packet_len);
+}
+
+/* copy the len bytes found offset bytes into the iovcnt buffers in iov
+ * to dst
+ */
+static void _mysock_gather(char               *dst,
+                           const struct iovec *iov,
+                           int                 iovcnt,
+                           size_t              offset,
+                           size_t              len)
+{
+    size_t n;
+
+    for (; iovcnt > 0 && len > 0; ++iov, --iovcnt)
+    {
+        if (offset >= iov->iov_len)
+        {
+            offset -= iov->iov_len;
+            continue;
+        }
+
+        n = MIN(iov->iov_len - offset, len);
+        memcpy(dst, (const char *) iov->iov_base + offset, n);
+        dst    += n;
+        len    -= n;
+        offset  = 0;
+    }
+    assert(len == 0);
+}
+
+/* for the producer of a stream queue:  add as much of the len bytes at
+ * offset into iov as will fit to the end of the open node at the tail,
+ * if there is one, instead of queueing another node.  returns the number
+ * of bytes added, which may be none.
+ */
+static size_t _mysock_queue_extend(mysock_context_t   *ctx,
+                                   packet_queue_t     *pq,
+                                   const struct iovec *iov,
+                                   int                 iovcnt,
+                                   size_t              offset,
+                                   size_t              len)
+{
+    size_t n = MIN(len, pq->fill_room);
+
+    if (!pq->fill_node || !n)
+        return 0;
+
+    /* the consumer can't pop the node while it's busy */
+    if (!__sync_bool_compare_and_swap(&pq->fill_state, FILL_OPEN, FILL_BUSY))
+    {
+        /* the consumer has closed it */
+        pq->fill_node = NULL;
+        return 0;
+    }
+
+    _mysock_gather(pq->fill_end, iov, iovcnt, offset, n);
+    pq->fill_end  += n;
+    pq->fill_room -= n;
+
+    __atomic_add_fetch(&pq->fill_node->data_len, n, __ATOMIC_RELEASE);
+    __atomic_store_n(&pq->enqueued, pq->enqueued + n, __ATOMIC_RELEASE);
+    __atomic_store_n(&pq->fill_state, FILL_OPEN, __ATOMIC_RELEASE);
+
+    _mysock_queue_wake_consumer(ctx, pq, n);
+    return n;
+}
+
+/* as _mysock_enqueue_buffer(), but the packet is the len bytes found
+ * offset bytes into the iovcnt buffers in iov, gathered into a single
+ * node.  for mywrite() and mywritev(), which may queue their data a piece
+ * at a time.  on a stream queue, the data goes at the end of the node at
+ * the tail as far as there's room for it.
+ */
+void _mysock_enqueue_iovec(mysock_context_t   *ctx,
+                           packet_queue_t     *pq,
+                           const struct iovec *iov,
+                           int                 iovcnt,
+                           size_t              offset,
+                           size_t              len)
+{
+    packet_queue_node_t *node;
+    size_t n;
+
+    assert(ctx && pq && iov && iovcnt > 0);
+
+    if (pq->stream && len > 0)
+    {
+        n       = _mysock_queue_extend(ctx, pq, iov, iovcnt, offset, len);
+        offset += n;
+        if (!(len -= n))
+            return;
+    }
+
+    node = _mysock_pool_alloc_node(len);
+    assert(node && node->data);
+
+    _mysock_gather(node->data, iov, iovcnt, offset, len);
+    node->data_len = len;
+
+    _mysock_append_node(ctx, pq, node);
+}
+
+/* as _mysock_enqueue_iovec(), but the data is read from fd at the given
+ * offset straight into the new node, for mysendfile().  returns the number
+ * of bytes queued, 0 at end of file (nothing is queued), or -1 if the read
+ * fails.
+ */
+ssize_t _mysock_enqueue_file(mysock_context_t *ctx,
+                             packet_queue_t   *pq,
+                             int               fd,
+                             off_t             offset,
+                             size_t            len)
+{
+    packet_queue_node_t *node;
+    ssize_t rc;
+
+    assert(ctx && pq && fd >= 0 && len > 0);
+
+    node = _mysock_pool_alloc_node(len);
+    assert(node && node->data);
+
+    while ((rc = pread(fd, node->data, len, offset)) < 0 && errno == EINTR)
+        ;
+    if (rc <= 0)
+    {
+        _mysock_pool_free_node(node);
+        return rc;
+    }
+
+    node->data_len = rc;
+    _mysock_append_node(ctx, pq, node);
+    return rc;
+}
+
+/* add a shared buffer to a queue for this connection.  rather than being
+ * copied, the buffer is referenced by the queue until it's dequeued.
+ */
+void _mysock_enqueue_shared(mysock_context_t *ctx,
+                            packet_queue_t   *pq,
+                            mybuf_t          *buf)
+{
+    packet_queue_node_t *node;
+
+    assert(ctx && pq && buf);
+
+    node = _mysock_pool_alloc_node(0);
+    assert(node);
+
+    _mysock_buf_hold(buf);
+    node->shared   = buf;
+    node->data     = buf->data;
+    node->data_len = buf->length;
+
+    _mysock_append_node(ctx, pq, node);
+}
+
+/* add an application buffer to a queue for this connection, without
+ * copying it, for mywrite_zerocopy().  the application gets it back once
+ * the peer has acknowledged all of it (see _mysock_data_acked()).
+ */
+void _mysock_enqueue_zerocopy(mysock_context_t *ctx,
+                              packet_queue_t   *pq,
+                              zc_write_t       *zc)
+{
+    packet_queue_node_t *node;
+
+    assert(ctx && pq && zc && zc->buffer && zc->length > 0);
+
+    node = _mysock_pool_alloc_node(0);
+    assert(node);
+
+    zc->end        = pq->enqueued + zc->length;
+    node->zc       = zc;
+    node->data     = (char *) zc->buffer;
+    node->data_len = zc->length;
+
+    _mysock_append_node(ctx, pq, node);
+}
+
+/* add a node the caller has filled in to a queue, handing it over as it
+ * is.  the node comes from _mysock_pool_alloc_node(), with data_len set to
+ * the length of its data; it belongs to the queue from here on.
+ */
+void _mysock_enqueue_node(mysock_context_t    *ctx,
+                          packet_queue_t      *pq,
+                          packet_queue_node_t *node)
+{
+    assert(ctx && pq && node && node->data);
+    assert(!node->shared && !node->zc);
+
+    _mysock_append_node(ctx, pq, node);
+}
+
+/* put a new node at the tail of the given queue, and wake the consumer if
+ * it's waiting for it.  only the queue's producer may call this.  on a
+ * stream queue, the node becomes the open one if it has room to spare.
+ */
+static void _mysock_append_node(mysock_context_t    *ctx,
+                                packet_queue_t      *pq,
+                                packet_queue_node_t *node)
+{
+    size_t len = node->data_len;
+    bool_t marker = (len == 0);
+    unsigned int tail = pq->tail;
+
+    if (!_mysock_queue_has_room(pq, marker))
+    {
+        /* markers always fit in the reserved slots */
+        assert(!marker);
+        assert(pq->producer != QUEUE_END_NETWORK);
+
+        PTHREAD_CALL(pthread_mutex_lock(&pq->wait_lock));
+        while (_mysock_queue_wait_room(pq, marker))
+        {
+            /* a transport fiber yields to its carrier thread instead */
+            if (pq->producer == QUEUE_END_TRANSPORT && ctx->transport_fiber)
+                (void) _mysock_fiber_wait(&pq->wait_lock, NULL);
+            else
+                PTHREAD_CALL(pthread_cond_wait(&pq->wait_cond,
+                                               &pq->wait_lock));
+            if (_mysock_queue_has_room(pq, marker))
+                break;
+        }
+        pq->producer_waiting = FALSE;
+        PTHREAD_CALL(pthread_mutex_unlock(&pq->wait_lock));
+    }
+
+    if (pq->stream)
+    {
+        /* nothing more can go in the previous node once this one follows
+         * it.  (the producer is never busy here, so this can't clash with
+         * the consumer closing it.)  the new node is opened before it's
+         * visible, so the consumer can't pop it without closing it first.
+         */
+        __atomic_store_n(&pq->fill_state, FILL_NONE, __ATOMIC_RELEASE);
+        pq->fill_node = NULL;
+
+        if (!marker && (pq->fill_room = _mysock_pool_node_room(node)) > 0)
+        {
+            pq->fill_node = node;
+            pq->fill_end  = node->data + len;
+            pq->fill_slot = tail;
+            __atomic_store_n(&pq->fill_state, FILL_OPEN, __ATOMIC_RELEASE);
+        }
+    }
+
+    pq->slots[tail % PACKET_QUEUE_SLOTS] = node;
+    __atomic_store_n(&pq->tail, tail + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&pq->enqueued, pq->enqueued + len, __ATOMIC_RELEASE);
+
+    _mysock_queue_wake_consumer(ctx, pq, len);
+}
+
+/* unlink the node at the head of the queue; for the consumer */
+static void _mysock_queue_pop(mysock_context_t *ctx, packet_queue_t *pq)
+{
+    assert(pq->head != pq->tail);
+    __atomic_store_n(&pq->head, pq->head + 1, __ATOMIC_RELEASE);
+    _mysock_queue_wake_producer(ctx, pq);
+}
+
+/* account for len bytes taken from the queue by the consumer */
+static INLINE void _mysock_queue_consumed(packet_queue_t *pq, size_t len)
+{
+    __atomic_store_n(&pq->dequeued, pq->dequeued + len, __ATOMIC_RELEASE);
+}
+
+/* for the consumer of a stream queue:  if the node at the head is the open
+ * one, close it, so the producer won't add any more to it
+ */
+static void _mysock_queue_close_head(packet_queue_t *pq)
+{
+    int state;
+
+    while ((state = __atomic_load_n(&pq->fill_state, __ATOMIC_ACQUIRE)) !=
+           FILL_NONE && pq->fill_slot == pq->head)
+    {
+        if (state == FILL_OPEN &&
+            __sync_bool_compare_and_swap(&pq->fill_state, FILL_OPEN,
+                                         FILL_NONE))
+            break;
+
+        /* the producer is adding to it, which won't take long */
+        BUSY_POLL_RELAX();
+    }
+}
+
+/* the consumer has taken len bytes from the front of the node at the head
+ * of the queue; move its read cursor past them.  returns TRUE if that
+ * emptied it for good, so it can be popped, or FALSE if there's more data
+ * in it (or was added to it meanwhile).
+ */
+static bool_t _mysock_node_consume(mysock_context_t    *ctx,
+                                   packet_queue_t      *pq,
+                                   packet_queue_node_t *node,
+                                   size_t               len)
+{
+    node->data += len;
+    if (__atomic_sub_fetch(&node->data_len, len, __ATOMIC_ACQ_REL) == 0)
+    {
+        _mysock_queue_close_head(pq);
+        if (_mysock_node_len(node) == 0)
+            return TRUE;
+    }
+
+    /* no slot is freed, but the transport may be waiting for myread() to
+     * catch up (see stcp_app_window_lowat())
+     */
+    if (pq->consumer == QUEUE_END_APP && len > 0)
+        _mysock_queue_wake_producer(ctx, pq);
+    return FALSE;
+}
+
+/* block the transport until the given queue is non-empty */
+static void _mysock_wait_nonempty(mysock_context_t *ctx, packet_queue_t *pq)
+{
+    if (ctx->busy_poll_usec && _mysock_queue_empty(pq))
+    {
+        busy_poll_t bp;
+
+        _mysock_busy_poll_start(&bp, ctx->busy_poll_usec, NULL);
+        while (_mysock_queue_empty(pq) && _mysock_busy_poll_continue(&bp))
+            ;
+    }
+
+    if (_mysock_queue_empty(pq))
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        for (;;)
+        {
+            ctx->transport_sleeping = TRUE;
+            __sync_synchronize();
+            if (!_mysock_queue_empty(pq))
+                break;
+
+            (void) _mysock_transport_sleep(ctx, NULL);
+        }
+        ctx->transport_sleeping = FALSE;
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    }
+}
+
+/* remove one packet from the head of the waiting packet queue, copying the
+ * packet's payload into the specified buffer.  returns the number of bytes
+ * copied.
+ *
+ * if gather is true, the queue is instead treated as a byte stream:  dst
+ * is filled from as many of the queued packets as it takes, so data from
+ * several mywrite()s can go out in one segment, and whatever doesn't fit
+ * remains at the queue's head for a subsequent call to dequeue_buffer().
+ * only the transport consumes queues this way.
+ */
+size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
+                              packet_queue_t   *pq,
+                              void             *dst,
+                              size_t            max_len,
+                              bool_t            gather)
+{
+    packet_queue_node_t *node;
+    size_t               packet_len, len;
+
+    assert(ctx && pq && dst);
+    assert(pq->consumer == QUEUE_END_TRANSPORT);
+
+    /* block until queue is non-empty */
+    _mysock_wait_nonempty(ctx, pq);
+
+    node = pq->slots[pq->head % PACKET_QUEUE_SLOTS];
+    assert(node && node->data);
+
+    if (!gather)
+    {
+        /* dequeue the entire packet at the head of the queue */
+        memcpy(dst, node->data, MIN(max_len, node->data_len));
+        packet_len = node->data_len;
+
+        _mysock_queue_consumed(pq, packet_len);
+        _mysock_queue_pop(ctx, pq);
+        _mysock_free_node(node);
+        return packet_len;
+    }
+
+    for (packet_len = 0; packet_len < max_len; )
+    {
+        len = MIN(_mysock_node_len(node), max_len - packet_len);
+        memcpy((char *) dst + packet_len, node->data, len);
+        packet_len += len;
+        _mysock_queue_consumed(pq, len);
+
+        /* anything left is for the next call to dequeue_buffer() */
+        if (!_mysock_node_consume(ctx, pq, node, len))
+            continue;
+
+        if (node->zc)
+            _mysock_zc_sent(ctx, node->zc);
+        _mysock_queue_pop(ctx, pq);
+        _mysock_free_node(node);
+
+        if (pq->head == __atomic_load_n(&pq->tail, __ATOMIC_ACQUIRE))
+            break;
+        node = pq->slots[pq->head % PACKET_QUEUE_SLOTS];
+    }
+
+    return packet_len;
+}
+
+/* as _mysock_dequeue_buffer(), but the packet at the head of the queue
+ * is unlinked and returned as it is, rather than being copied out.  the
+ * caller reads it in place, and gives it back with _mysock_release_node().
+ */
+packet_queue_node_t *_mysock_dequeue_node(mysock_context_t *ctx,
+                                          packet_queue_t   *pq)
+{
+    packet_queue_node_t *node;
 
+    assert(ctx && pq);
+    assert(pq->consumer == QUEUE_END_TRANSPORT);
 
-/* mysocket descriptor table, one entry per STCP connection */
-static mysock_context_t *global_ctx[MAX_NUM_CONNECTIONS];
+    _mysock_wait_nonempty(ctx, pq);
 
+    node = pq->slots[pq->head % PACKET_QUEUE_SLOTS];
+    assert(node && node->data && !node->zc);
 
-/* create a new mysocket, and find space in our mysocket descriptor table */
-mysocket_t _mysock_new_mysocket()
+    _mysock_queue_consumed(pq, node->data_len);
+    _mysock_queue_pop(ctx, pq);
+    return node;
+}
+
+void _mysock_release_node(packet_queue_node_t *node)
 {
-    mysock_context_t *connection_context = _mysock_allocate_context();
-    int k;
+    _mysock_free_node(node);
+}
 
-    if (!connection_context)
+/* copy len bytes from src into the buffers in *iov, starting *off bytes
+ * into the first of them, and advance *iov and *off past the bytes copied.
+ * the caller ensures there's room for them all.
+ */
+static void _mysock_scatter(const struct iovec **iov, size_t *off,
+                            const char *src, size_t len)
+{
+    size_t n;
+
+    while (len > 0)
     {
-        assert(0);
-        return -1;
+        if (*off == (*iov)->iov_len)
+        {
+            ++*iov;
+            *off = 0;
+            continue;
+        }
+
+        n = MIN(len, (*iov)->iov_len - *off);
+        memcpy((char *) (*iov)->iov_base + *off, src, n);
+        src  += n;
+        len  -= n;
+        *off += n;
+    }
+}
+
+/* wait until a stream read wanting min_len bytes can go ahead (see
+ * _mysock_stream_ready()), spinning first if the mysocket busy-polls.  if
+ * iov isn't NULL, the read's buffers (max_len bytes from *off into *iov)
+ * are posted while it sleeps, for the producer to fill in directly (see
+ * _mysock_place_direct()); *iov and *off are then moved past whatever it
+ * placed there, and the number of bytes placed is returned.
+ */
+static size_t _mysock_stream_wait(mysock_context_t    *ctx,
+                                  packet_queue_t      *pq,
+                                  size_t               min_len,
+                                  const struct iovec **iov,
+                                  size_t              *off,
+                                  size_t               max_len)
+{
+    size_t placed = 0;
+
+#define STREAM_READY() _mysock_stream_ready(pq, min_len - placed)
+
+    if (ctx->busy_poll_usec && !STREAM_READY())
+    {
+        busy_poll_t bp;
+
+        _mysock_busy_poll_start(&bp, ctx->busy_poll_usec, NULL);
+        while (!STREAM_READY() && _mysock_busy_poll_continue(&bp))
+            ;
     }
 
-    /* search for a free mysocket descriptor */
-    for (k = 0; k < MAX_NUM_CONNECTIONS; ++k)
+    if (!STREAM_READY())
     {
-        if (!global_ctx[k])
+        PTHREAD_CALL(pthread_mutex_lock(&pq->wait_lock));
+        if (iov)
+        {
+            pq->posted_iov  = *iov;
+            pq->posted_off  = *off;
+            pq->posted_room = max_len;
+            pq->placed      = 0;
+        }
+
+        for (;;)
+        {
+            if ((placed = pq->placed) >= min_len)
+                break;
+
+            pq->consumer_need = min_len - placed;
+            __sync_synchronize();
+            if (STREAM_READY())
+                break;
+
+            PTHREAD_CALL(pthread_cond_wait(&pq->wait_cond, &pq->wait_lock));
+        }
+        pq->consumer_need = 0;
+
+        if (iov)
         {
-            global_ctx[k] = connection_context;
-            connection_context->my_sd = k;
-            return k;
+            *iov = pq->posted_iov;
+            *off = pq->posted_off;
+            pq->posted_iov = NULL;
+            pq->placed     = 0;
         }
+        PTHREAD_CALL(pthread_mutex_unlock(&pq->wait_lock));
     }
+#undef STREAM_READY
 
-    _mysock_free_context(connection_context);
-    errno = EMFILE;
-    return -1;
+    return placed;
 }
 
-/* obtain a pointer to the connection context for the given mysocket
- * descriptor.
+/* for the producer of an application-consumed queue:  copy up to len bytes
+ * of data straight into the buffers of a stream read sleeping on it,
+ * rather than queueing them, saving a copy.  this is only done while the
+ * queue is empty, so the data can't overtake anything queued before it.
+ * returns the number of bytes placed, which may be none; the caller queues
+ * the rest.
  */
-mysock_context_t *_mysock_get_context(mysocket_t sd)
+size_t _mysock_place_direct(mysock_context_t *ctx,
+                            packet_queue_t   *pq,
+                            const void       *data,
+                            size_t            len)
 {
-    ASSERT_VALID_MYSOCKET_DESCRIPTOR(NULL, sd);
-    return (sd >= 0 && sd < (int)ARRAY_DIM(global_ctx))
-        ? global_ctx[sd] : NULL;
-}
+    const struct iovec *iov;
+    size_t off, n = 0;
 
-/* initiate a new STCP connection; called by myconnect() and myaccept() */
-void _mysock_transport_init(mysocket_t sd, bool_t is_active)
-{
-    mysock_context_t *connection_context = _mysock_get_context(sd);
+    assert(ctx && pq && data);
+    assert(pq->consumer == QUEUE_END_APP);
 
-    assert(!connection_context->listening);
-    connection_context->is_active = is_active;
+    if (!pq->posted_iov)
+        return 0;
 
-    /* start a new network thread; this handles incoming data, passing it
-     * up to the transport layer.  (the network input is threaded so we can
-     * keep track of timeouts/when data arrives, in a portable manner
-     * independent of the underlying network I/O functionality).
-     */
-    if (_network_start_recv_thread(connection_context) < 0)
+    PTHREAD_CALL(pthread_mutex_lock(&pq->wait_lock));
+    if (pq->posted_iov && pq->placed < pq->posted_room &&
+        _mysock_queue_empty(pq))
     {
-        assert(0);
-        abort();
+        n   = MIN(len, pq->posted_room - pq->placed);
+        iov = pq->posted_iov;
+        off = pq->posted_off;
+        _mysock_scatter(&iov, &off, (const char *) data, n);
+        pq->posted_iov = iov;
+        pq->posted_off = off;
+        pq->placed    += n;
+
+        /* wake the reader once it has all it asked for */
+        if (n >= pq->consumer_need)
+        {
+            pq->consumer_need = 0;
+            PTHREAD_CALL(pthread_cond_signal(&pq->wait_cond));
+        }
+        else
+            pq->consumer_need -= n;
     }
+    PTHREAD_CALL(pthread_mutex_unlock(&pq->wait_lock));
 
-    /* start a new transport layer thread */
-    connection_context->transport_thread = _mysock_create_thread(
-        transport_thread_func,
-        connection_context,
-        FALSE);
-    connection_context->transport_thread_started = TRUE;
+    return n;
 }
 
-int _mysock_wait_for_connection(mysock_context_t *ctx)
+/* stream-oriented dequeue, for myread() and myreadv().  blocks until at
+ * least min_len bytes are queued, the zero-length EOF marker has been
+ * queued, or the queue is full, then fills the iovcnt buffers in iov as
+ * far as it can, gathering across as many nodes as needed.  the EOF marker
+ * itself is consumed (and 0 returned) only once all data ahead of it has
+ * been read.
+ */
+size_t _mysock_dequeue_stream(mysock_context_t   *ctx,
+                              packet_queue_t     *pq,
+                              const struct iovec *iov,
+                              int                 iovcnt,
+                              size_t              min_len)
 {
-    assert(ctx);
+    packet_queue_node_t *node;
+    size_t               max_len = 0, copied = 0, off = 0, len;
+    int                  k;
 
-    /* block until we either connect to the peer, or hit an error */
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
-    while (ctx->blocking)
+    assert(ctx && pq && iov && iovcnt > 0);
+    assert(pq->consumer == QUEUE_END_APP);
+
+    for (k = 0; k < iovcnt; ++k)
+        max_len += iov[k].iov_len;
+    assert(min_len > 0 && min_len <= max_len);
+
+    copied = _mysock_stream_wait(ctx, pq, min_len, &iov, &off, max_len);
+
+    while (pq->head != __atomic_load_n(&pq->tail, __ATOMIC_ACQUIRE) &&
+           copied < max_len)
     {
-        PTHREAD_CALL(pthread_cond_wait(&ctx->blocking_cond,
-                                       &ctx->blocking_lock));
+        node = pq->slots[pq->head % PACKET_QUEUE_SLOTS];
+        if (!(len = _mysock_node_len(node)))
+        {
+            /* EOF marker; leave it be if there's data to return first */
+            if (copied)
+                break;
+
+            _mysock_queue_pop(ctx, pq);
+            _mysock_free_node(node);
+            break;
+        }
+
+        len = MIN(len, max_len - copied);
+        _mysock_scatter(&iov, &off, node->data, len);
+        copied += len;
+        _mysock_queue_consumed(pq, len);
+
+        if (!_mysock_node_consume(ctx, pq, node, len))
+            continue;
+
+        _mysock_queue_pop(ctx, pq);
+        _mysock_free_node(node);
     }
-    PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
 
-    return (errno = ctx->stcp_errno) ? -1 : 0;
+    return copied;
 }
 
-
-/* add an incoming buffer (packet) to a queue for this connection; it will be
- * dequeued by stcp_network_recv() or myread() when the transport layer or
- * application is ready to use it, depending on the queue to which
- * the buffer (or packet) is added.
- *
- * in the interest of simplicity (and since we aren't writing a high
- * performance TCP stack), this just copies the specified buffer for its own
- * use, so the calling code can do whatever it wants with the packet
- * afterwards.  the copied buffer is freed later by dequeue_buffer().
+/* as _mysock_dequeue_stream(), but the data is written to fd with a single
+ * writev() straight from the queued nodes, up to max_len bytes of it.  if
+ * more than min_len bytes are queued, the write is cut back to min_len
+ * plus a multiple of align bytes, so a caller that lines min_len up with a
+ * block boundary in the file keeps its writes aligned.  only the bytes fd
+ * accepts are consumed; returns their number, 0 on EOF, or -1 if the
+ * write fails.
  */
-void _mysock_enqueue_buffer(mysock_context_t *ctx,
-                            packet_queue_t   *pq,
-                            const void       *packet,
-                            size_t            packet_len)
+ssize_t _mysock_dequeue_file(mysock_context_t *ctx,
+                             packet_queue_t   *pq,
+                             int               fd,
+                             size_t            min_len,
+                             size_t            max_len,
+                             size_t            align)
 {
+    struct iovec iov[MYSOCK_FILE_IOV];
     packet_queue_node_t *node;
+    unsigned int head, tail;
+    size_t len = 0, n;
+    ssize_t written;
+    int iovcnt = 0;
 
-    assert(ctx && pq && (packet || !packet_len));
+    assert(ctx && pq && fd >= 0 && align > 0);
+    assert(pq->consumer == QUEUE_END_APP);
+    assert(min_len > 0 && min_len <= max_len);
 
-    node = (packet_queue_node_t *) calloc(1, sizeof(packet_queue_node_t));
-    assert(node);
+    (void) _mysock_stream_wait(ctx, pq, min_len, NULL, NULL, 0);
 
-    node->data = (char *) malloc(packet_len * sizeof(char));
-    assert(node->data);
+    tail = __atomic_load_n(&pq->tail, __ATOMIC_ACQUIRE);
+    for (head = pq->head;
+         head != tail && iovcnt < MYSOCK_FILE_IOV && len < max_len; ++head)
+    {
+        node = pq->slots[head % PACKET_QUEUE_SLOTS];
+        if (!(n = _mysock_node_len(node)))
+            break;
 
-    if (packet_len > 0)
-        memcpy(node->data, packet, packet_len);
-    node->data_len = packet_len;
+        iov[iovcnt].iov_base = node->data;
+        iov[iovcnt].iov_len  = MIN(n, max_len - len);
+        len += iov[iovcnt++].iov_len;
+    }
 
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    if (!pq->head)
+    if (!len)
     {
-        assert(!pq->tail);
-        pq->head = pq->tail = node;
+        /* EOF marker */
+        node = pq->slots[pq->head % PACKET_QUEUE_SLOTS];
+        _mysock_queue_pop(ctx, pq);
+        _mysock_free_node(node);
+        return 0;
     }
-    else
+
+    if (len > min_len)
     {
-        assert(pq->tail);
-        assert(!pq->tail->next);
-        assert(!node->next);
-        pq->tail->next = node;
-        pq->tail = node;
+        /* end the write on an alignment boundary */
+        n = (len - min_len) % align;
+        while (n >= iov[iovcnt - 1].iov_len)
+            n -= iov[--iovcnt].iov_len;
+        iov[iovcnt - 1].iov_len -= n;
     }
-    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+
+    while ((written = writev(fd, iov, iovcnt)) < 0 && errno == EINTR)
+        ;
+    if (written < 0)
+        return -1;
+
+    /* consume what was written.  only the last node written from can have
+     * grown since, so the bytes written are the first ones of each.
+     */
+    for (len = written; len > 0; )
+    {
+        node = pq->slots[pq->head % PACKET_QUEUE_SLOTS];
+        n = MIN(_mysock_node_len(node), len);
+        _mysock_queue_consumed(pq, n);
+        len -= n;
+
+        if (!_mysock_node_consume(ctx, pq, node, n))
+            continue;
+
+        _mysock_queue_pop(ctx, pq);
+        _mysock_free_node(node);
+    }
+
+    return written;
 }
 
-/* remove one packet from the head of the waiting packet queue, copying the
- * packet's payload into the specified buffer.  returns the number of bytes
- * copied.  if remove_partial is true, and there is insufficient room in the
- * destination buffer for the packet at the head of the queue, it is only
- * partially dequeued, and the remaining contents remain at the queue's head
- * for a subsequent call to dequeue_buffer().
+/* move up to max_len bytes from the head of in_pq, an application-consumed
+ * queue, to the tail of out_pq, which the application produces, for
+ * mysplice().  waits as _mysock_dequeue_stream() does for min_len bytes;
+ * whole nodes are then relinked rather than copied, so only a node split
+ * by max_len has any of its data copied.  stops early rather than wait for
+ * room in out_pq once something has been moved.  returns the number of
+ * bytes moved, or 0 on EOF.
  */
-size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
-                              packet_queue_t   *pq,
-                              void             *dst,
-                              size_t            max_len,
-                              bool_t            remove_partial)
+size_t _mysock_splice_stream(mysock_context_t *in_ctx,
+                             packet_queue_t   *in_pq,
+                             mysock_context_t *out_ctx,
+                             packet_queue_t   *out_pq,
+                             size_t            min_len,
+                             size_t            max_len)
 {
     packet_queue_node_t *node;
-    size_t               packet_len;
+    size_t moved = 0, len;
 
-    assert(ctx && pq && dst);
+    assert(in_ctx && in_pq && out_ctx && out_pq && in_ctx != out_ctx);
+    assert(in_pq->consumer == QUEUE_END_APP);
+    assert(out_pq->producer == QUEUE_END_APP);
+    assert(min_len > 0 && min_len <= max_len);
 
-    /* block until queue is non-empty */
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    while (!pq->head)
+    (void) _mysock_stream_wait(in_ctx, in_pq, min_len, NULL, NULL, 0);
+
+    while (in_pq->head != __atomic_load_n(&in_pq->tail, __ATOMIC_ACQUIRE) &&
+           moved < max_len)
     {
-        PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
-                                       &ctx->data_ready_lock));
-    }
+        if (moved && !_mysock_queue_has_room(out_pq, FALSE))
+            break;
 
-    node = pq->head;
-    assert(node && node->data);
+        /* the node may be moved, so nothing more can be added to it */
+        _mysock_queue_close_head(in_pq);
 
-    if (node->data_len > max_len && remove_partial)
-    {
-        /* remove only a portion of the packet at the head of the queue,
-         * leaving the rest around for the next call to dequeue_buffer().
-         */
-        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        node = in_pq->slots[in_pq->head % PACKET_QUEUE_SLOTS];
+        if (!node->data_len)
+        {
+            /* EOF marker; leave it be if there's data to return first */
+            if (moved)
+                break;
+
+            _mysock_queue_pop(in_ctx, in_pq);
+            _mysock_free_node(node);
+            break;
+        }
 
-        memcpy(dst, node->data, max_len);
-        memmove(node->data, node->data + max_len, node->data_len - max_len);
-        node->data_len -= max_len;
-        packet_len = max_len;
+        len = MIN(node->data_len, max_len - moved);
+        _mysock_queue_consumed(in_pq, len);
+        moved += len;
+
+        if (len < node->data_len)
+        {
+            _mysock_enqueue_buffer(out_ctx, out_pq, node->data, len);
+            (void) _mysock_node_consume(in_ctx, in_pq, node, len);
+            break;
+        }
+
+        assert(!node->shared && !node->zc);
+        _mysock_queue_pop(in_ctx, in_pq);
+        _mysock_append_node(out_ctx, out_pq, node);
     }
+
+    return moved;
+}
+
+/* hand a zero-copy write back to the application */
+static void _mysock_zc_complete(mysock_context_t *ctx, zc_write_t *zc,
+                                int error)
+{
+    int saved_errno = errno;
+
+    assert(ctx && zc && zc->done);
+    zc->done(ctx->my_sd, zc->buffer, zc->length, error, zc->arg);
+    free(zc);
+
+    errno = saved_errno;
+}
+
+/* the transport has taken the last of a zero-copy write's data; hold on
+ * to it until the peer acknowledges that
+ */
+static void _mysock_zc_sent(mysock_context_t *ctx, zc_write_t *zc)
+{
+    assert(ctx && zc);
+
+    zc->next = NULL;
+    if (ctx->zc_unacked_tail)
+        ctx->zc_unacked_tail->next = zc;
     else
+        ctx->zc_unacked = zc;
+    ctx->zc_unacked_tail = zc;
+}
+
+/* the peer has acknowledged len more bytes of application data; complete
+ * any zero-copy writes that are now covered, and wake a mywrite() waiting
+ * for the send buffer space this frees.  called by the transport.
+ */
+void _mysock_data_acked(mysock_context_t *ctx, size_t len)
+{
+    zc_write_t *zc;
+
+    assert(ctx);
+
+    __atomic_store_n(&ctx->data_acked, ctx->data_acked + len,
+                     __ATOMIC_RELEASE);
+    while ((zc = ctx->zc_unacked) != NULL && zc->end <= ctx->data_acked)
     {
-        /* dequeue the entire packet at the head of the queue */
-        if (!(pq->head = pq->head->next))
+        if ((ctx->zc_unacked = zc->next) == NULL)
+            ctx->zc_unacked_tail = NULL;
+        _mysock_zc_complete(ctx, zc, 0);
+    }
+
+    __sync_synchronize();
+    _mysock_poll_notify(ctx);
+    if (ctx->snd_need && _mysock_send_space(ctx) >= ctx->snd_need)
+        _mysock_wake_writer(ctx);
+}
+
+/* bytes free in the send buffer:  everything written that the peer hasn't
+ * acknowledged yet counts against it
+ */
+size_t _mysock_send_space(const mysock_context_t *ctx)
+{
+    size_t used;
+
+    assert(ctx);
+    used = __atomic_load_n(&ctx->app_recv_queue.enqueued, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&ctx->data_acked, __ATOMIC_ACQUIRE);
+    return (ctx->opts.snd_buf > used) ? ctx->opts.snd_buf - used : 0;
+}
+
+/* wait until at least need bytes of send buffer are free, for mywrite().
+ * returns 0 once they are, or -1 (with errno set to EPIPE) if the
+ * connection is over and they never will be.
+ */
+int _mysock_wait_send_space(mysock_context_t *ctx, size_t need)
+{
+    packet_queue_t *pq;
+
+    assert(ctx && need > 0);
+    pq = &ctx->app_recv_queue;
+
+#define SPACE_READY() \
+    (_mysock_send_space(ctx) >= need || ctx->transport_done)
+
+    if (!SPACE_READY())
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&pq->wait_lock));
+        for (;;)
         {
-            assert(pq->tail == node);
-            pq->tail = NULL;
+            ctx->snd_need = need;
+            __sync_synchronize();
+            if (SPACE_READY())
+                break;
+
+            PTHREAD_CALL(pthread_cond_wait(&pq->wait_cond, &pq->wait_lock));
         }
-        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        ctx->snd_need = 0;
+        PTHREAD_CALL(pthread_mutex_unlock(&pq->wait_lock));
+    }
+#undef SPACE_READY
 
-        memcpy(dst, node->data, MIN(max_len, node->data_len));
-        packet_len = node->data_len;
+    if (_mysock_send_space(ctx) < need)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    return 0;
+}
+
+/* wake a mywrite() waiting for send buffer space */
+static void _mysock_wake_writer(mysock_context_t *ctx)
+{
+    packet_queue_t *pq = &ctx->app_recv_queue;
+
+    PTHREAD_CALL(pthread_mutex_lock(&pq->wait_lock));
+    PTHREAD_CALL(pthread_cond_signal(&pq->wait_cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&pq->wait_lock));
+}
+
+/* fail any zero-copy writes still waiting for acknowledgement */
+static void _mysock_zc_abort(mysock_context_t *ctx, int error)
+{
+    zc_write_t *zc;
 
-        free(node->data);
+    assert(ctx && error);
 
-        memset(node, 0, sizeof(*node));
-        free(node);
+    while ((zc = ctx->zc_unacked) != NULL)
+    {
+        ctx->zc_unacked = zc->next;
+        _mysock_zc_complete(ctx, zc, error);
     }
+    ctx->zc_unacked_tail = NULL;
+}
 
-    return packet_len;
+/* release a dequeued node and the data it owns or references */
+static void _mysock_free_node(packet_queue_node_t *node)
+{
+    assert(node);
+
+    if (node->shared)
+        _mysock_buf_release(node->shared);
+
+    _mysock_pool_free_node(node);
+}
+
+void _mysock_buf_hold(mybuf_t *buf)
+{
+    assert(buf && buf->refcnt > 0);
+    __sync_add_and_fetch(&buf->refcnt, 1);
+}
+
+/* drop a reference to a shared buffer, freeing it with the last one */
+void _mysock_buf_release(mybuf_t *buf)
+{
+    assert(buf && buf->refcnt > 0);
+    if (__sync_sub_and_fetch(&buf->refcnt, 1) == 0)
+    {
+        free(buf->data);
+        memset(buf, 0, sizeof(*buf));
+        free(buf);
+    }
 }
 
 /* free any last buffers in the specified queue, discarding the contents.
@@ -234,27 +1508,39 @@ size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
  */
 static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq)
 {
-    packet_queue_node_t *node;
     bool_t result = FALSE;
 
     assert(ctx && pq);
-    result = (pq->head != NULL);
-    for (node = pq->head; node; )
+    for (; pq->head != pq->tail; ++pq->head)
     {
-        packet_queue_node_t *next = node->next;
+        packet_queue_node_t *node = pq->slots[pq->head % PACKET_QUEUE_SLOTS];
 
         if (node->data_len > 0)
             result = TRUE;
 
-        free(node->data);
-        free(node);
-        node = next;
+        if (node->zc)
+            _mysock_zc_complete(ctx, node->zc, ECONNRESET);
+        _mysock_free_node(node);
     }
 
-    pq->head = pq->tail = NULL;
+    PTHREAD_CALL(pthread_cond_destroy(&pq->wait_cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&pq->wait_lock));
     return result;
 }
 
+/* set up one of a connection's queues, noting who's at either end */
+static void _mysock_init_queue(packet_queue_t *pq,
+                               unsigned char producer, unsigned char consumer)
+{
+    assert(pq);
+
+    pq->producer = producer;
+    pq->consumer = consumer;
+    pq->stream   = (producer == QUEUE_END_APP || consumer == QUEUE_END_APP);
+    PTHREAD_CALL(pthread_mutex_init(&pq->wait_lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&pq->wait_cond, NULL));
+}
+
 /* allocate a new connection context.  this keeps track of the working state
  * between the transport and network layers for a particular connection.  the
  * context is subsequently freed on the network layer's exit.
@@ -268,6 +1554,7 @@ static mysock_context_t *_mysock_allocate_context(void)
 
     /* by default, sockets are active */
     ctx->listen_sd = -1;
+    ctx->my_sd = -1;    /* until _mysock_new_mysocket() finds it a slot */
 
     /* initialise connection condition variable.  this is signaled when the
      * connection is established, i.e. myconnect() or myaccept() should
@@ -282,6 +1569,17 @@ static mysock_context_t *_mysock_allocate_context(void)
     PTHREAD_CALL(pthread_cond_init(&ctx->data_ready_cond, NULL));
     PTHREAD_CALL(pthread_mutex_init(&ctx->data_ready_lock, NULL));
 
+    _mysock_init_queue(&ctx->network_recv_queue,
+                       QUEUE_END_NETWORK, QUEUE_END_TRANSPORT);
+    _mysock_init_queue(&ctx->app_recv_queue,
+                       QUEUE_END_APP, QUEUE_END_TRANSPORT);
+    _mysock_init_queue(&ctx->app_send_queue,
+                       QUEUE_END_TRANSPORT, QUEUE_END_APP);
+    ctx->app_send_queue.limit = APP_SEND_QUEUE_LIMIT;
+    ctx->opts = *_mysock_lock_default_opts();
+    _mysock_unlock_default_opts();
+    ctx->app_data_lowat = 1;
+
     ctx->blocking = TRUE;   /* we unblock once we're connected */
 
 
@@ -291,7 +1589,10 @@ static mysock_context_t *_mysock_allocate_context(void)
      */
     if (_network_init(ctx, &ctx->network_state) < 0)
     {
+        int saved_errno = errno;
+
         _mysock_free_context(ctx);
+        errno = saved_errno;
         return NULL;
     }
 
@@ -304,8 +1605,6 @@ static mysock_context_t *_mysock_allocate_context(void)
  */
 void _mysock_free_context(mysock_context_t *ctx)
 {
-    int sd;
-
     assert(ctx);
 
     PTHREAD_CALL(pthread_cond_destroy(&ctx->blocking_cond));
@@ -322,13 +1621,13 @@ void _mysock_free_context(mysock_context_t *ctx)
     (void) _mysock_free_queue(ctx, &ctx->network_recv_queue);
     (void) _mysock_free_queue(ctx, &ctx->app_recv_queue);
     (void) _mysock_free_queue(ctx, &ctx->app_send_queue);
+    _mysock_zc_abort(ctx, ECONNRESET);
 
     _network_close(&ctx->network_state);
+    _mysock_reactor_free(ctx);
 
     /* clear mysocket descriptor table entry */
-    sd = ctx->my_sd;
-    if (global_ctx[sd] == ctx)
-        global_ctx[sd] = 0;
+    _mysock_free_descriptor(ctx);
 
     memset(ctx, 0, sizeof(*ctx));
     free(ctx);
@@ -340,7 +1639,6 @@ void _mysock_free_context(mysock_context_t *ctx)
 static void *transport_thread_func(void *arg_ptr)
 {
     mysock_context_t *ctx = (mysock_context_t *) arg_ptr;
-    char eof_packet;
 
     assert(ctx);
     ASSERT_VALID_MYSOCKET_DESCRIPTOR(ctx, ctx->my_sd);
@@ -358,9 +1656,27 @@ static void *transport_thread_func(void *arg_ptr)
     /* transport_init() has returned; both sides have closed the connection,
      * do some final cleanup here...
      */
+    _mysock_transport_finished(ctx);
+    return NULL;
+}
+
+/* final cleanup once the transport for ctx has finished, with errno set by
+ * the transport.  called from the transport thread, or the reactor worker
+ * running the connection; ctx may be freed on return.
+ */
+void _mysock_transport_finished(mysock_context_t *ctx)
+{
+    char eof_packet;
+    bool_t orphaned;
+
+    assert(ctx);
+
+    /* writes the peer never acknowledged won't be now */
+    if (ctx->zc_unacked)
+        _mysock_zc_abort(ctx, errno ? errno : ECONNRESET);
 
     PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
-    if (ctx->blocking)
+    if (ctx->blocking && !ctx->orphaned)
     {
         /* if we're still blocked, STCP must not have indicated the
          * connection completed.  pass the error up to the application.
@@ -386,7 +1702,105 @@ static void *transport_thread_func(void *arg_ptr)
      * by the transport layer already in response to the peer's FIN).
      */
     _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, &eof_packet, 0);
-    return NULL;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->transport_done = TRUE;
+    orphaned = ctx->orphaned;
+
+    /* a mywrite() waiting for send buffer space would wait forever, and
+     * anyone polling should see the hangup.  this is done before the lock
+     * is dropped:  once it is, a myclose() that sees transport_done may
+     * free the context straight away, as nothing needs joining in reactor
+     * mode.
+     */
+    if (!orphaned)
+    {
+        if (ctx->snd_need)
+            _mysock_wake_writer(ctx);
+        _mysock_poll_notify(ctx);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    if (orphaned)
+    {
+        /* myclose() has already returned to the application */
+        _mysock_reap_orphan(ctx);
+    }
+}
+
+/* called by myclose() once the close request has been posted.  if the
+ * transport thread is still running, the mysocket is orphaned:  the
+ * thread is detached, and cleans up after itself once the close handshake
+ * with the peer completes.  returns TRUE in that case, or FALSE if the
+ * caller should tear the connection down itself.
+ */
+bool_t _mysock_orphan_context(mysock_context_t *ctx)
+{
+    bool_t orphaned = FALSE;
+
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    if ((ctx->transport_thread_started || ctx->reactor ||
+         ctx->transport_fiber) && !ctx->transport_done)
+    {
+        PTHREAD_CALL(pthread_once(&orphan_once, _mysock_linger_at_exit));
+
+        PTHREAD_CALL(pthread_mutex_lock(&orphan_lock));
+        ++num_orphans;
+        PTHREAD_CALL(pthread_mutex_unlock(&orphan_lock));
+
+        if (ctx->transport_thread_started)
+        {
+            PTHREAD_CALL(pthread_detach(ctx->transport_thread));
+            ctx->transport_thread_started = FALSE;
+        }
+        else if (ctx->transport_fiber)
+        {
+            /* still needed by the fiber, which frees itself */
+            _mysock_fiber_detach(ctx->transport_fiber);
+        }
+        ctx->orphaned = orphaned = TRUE;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    return orphaned;
+}
+
+/* final cleanup of an orphaned mysocket, from its own transport thread */
+static void _mysock_reap_orphan(mysock_context_t *ctx)
+{
+    assert(ctx && ctx->orphaned);
+
+    _network_stop_recv(ctx);
+    _mysock_free_context(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&orphan_lock));
+    assert(num_orphans > 0);
+    --num_orphans;
+    PTHREAD_CALL(pthread_mutex_unlock(&orphan_lock));
+    PTHREAD_CALL(pthread_cond_broadcast(&orphan_cond));
+}
+
+static void _mysock_linger_at_exit(void)
+{
+    atexit(_mysock_wait_for_orphans);
+}
+
+/* atexit() handler:  give orphaned connections a chance to finish */
+static void _mysock_wait_for_orphans(void)
+{
+    struct timespec deadline;
+
+    deadline.tv_sec  = time(NULL) + MYSOCK_CLOSE_LINGER;
+    deadline.tv_nsec = 0;
+
+    PTHREAD_CALL(pthread_mutex_lock(&orphan_lock));
+    while (num_orphans > 0 &&
+           pthread_cond_timedwait(&orphan_cond, &orphan_lock,
+                                  &deadline) != ETIMEDOUT)
+        ;
+    PTHREAD_CALL(pthread_mutex_unlock(&orphan_lock));
 }
 
 
@@ -398,9 +1812,12 @@ static void verify_mysocket_descriptor(mysock_context_t *comp_ctx,
                                        mysocket_t        my_sd)
 {
     mysock_context_t *ctx;
+    sd_slot_t *slot;
 
-    assert(my_sd >= 0 && my_sd < (int)ARRAY_DIM(global_ctx));
-    ctx = global_ctx[my_sd];
+    assert(my_sd >= 0);
+    slot = _mysock_sd_slot(my_sd % MAX_NUM_CONNECTIONS);
+    assert(slot);
+    ctx = slot->ctx;
 
     assert(ctx);
     assert(ctx->my_sd == my_sd);
@@ -432,6 +1849,20 @@ int _mysock_bind_ephemeral(mysock_context_t *ctx)
     return 0;
 }
 
+/* the process-wide option defaults, locked until
+ * _mysock_unlock_default_opts()
+ */
+mysock_opts_t *_mysock_lock_default_opts(void)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&default_opts_lock));
+    return &default_opts;
+}
+
+void _mysock_unlock_default_opts(void)
+{
+    PTHREAD_CALL(pthread_mutex_unlock(&default_opts_lock));
+}
+
 /* create a detached thread */
 pthread_t _mysock_create_thread(void *(*start)(void *args), void *args,
                                 bool_t create_detached)
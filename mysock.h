@@ -13,6 +13,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 
 #ifndef FALSE
@@ -26,9 +27,16 @@
 typedef int bool_t;
 typedef int mysocket_t;     /* mysocket descriptor */
 
+/* reference-counted buffer that can be queued on many mysockets at once
+ * without being copied (see mywrite_fanout())
+ */
+typedef struct mybuf mybuf_t;
+
 
-/* maximum number of mysockets per process */
-#define MAX_NUM_CONNECTIONS 64
+/* maximum number of mysockets per process.  descriptors aren't reused
+ * straight away:  each is a table slot's index plus a multiple of this.
+ */
+#define MAX_NUM_CONNECTIONS (1 << 18)
 
 #if (MAX_NUM_CONNECTIONS & (MAX_NUM_CONNECTIONS - 1)) != 0
     #error MAX_NUM_CONNECTIONS should be a power of two
@@ -48,6 +56,315 @@ extern int mygetsockname(mysocket_t sd, struct sockaddr *addr,
 extern int mygetpeername(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
 
+/* scatter/gather I/O.  mywritev() queues the iovcnt buffers in iov as a
+ * single unit, as if they'd been copied into one buffer and passed to
+ * mywrite(), so e.g. a header and a body can go out in the same segment.
+ * myreadv() fills the buffers in turn, otherwise behaving like myread()
+ * on their total length.  iovcnt must be between 1 and IOV_MAX.
+ */
+extern int myreadv(mysocket_t sd, const struct iovec *iov, int iovcnt);
+extern int mywritev(mysocket_t sd, const struct iovec *iov, int iovcnt);
+
+/* reactor mode.  by default, every connection runs its transport on a
+ * thread of its own.  after myreactor(), connections set up from then on
+ * are instead shared out among a fixed pool of num_workers threads (one
+ * per online CPU if num_workers is zero), so the number of threads no
+ * longer grows with the number of connections.  the pool lasts for the
+ * life of the process; calling myreactor() again with a different size
+ * fails with EBUSY.
+ */
+extern int myreactor(unsigned int num_workers);
+
+/* fiber mode.  after myfibers(), each new connection's transport runs in a
+ * fiber with a small stack of its own rather than on a thread, and the
+ * fibers are shared out among num_threads carrier threads (one per online
+ * CPU if num_threads is zero).  the transport's code is unchanged:  where
+ * it would wait for data or for the application, its fiber yields to the
+ * next one instead.  the carriers last for the life of the process;
+ * calling myfibers() again with a different number fails with EBUSY.
+ * reactor mode takes precedence if both are on.
+ */
+extern int myfibers(unsigned int num_threads);
+
+/* io_uring network I/O (Linux 6.0 or later).  after myuring(), connections
+ * set up from then on exchange packets with their peers through io_uring:
+ * receives stay posted, and packets sent while an earlier send is still in
+ * flight go out together with the next one, so a busy connection makes
+ * few system calls per packet.  fails, leaving things as they were, if the
+ * kernel can't support it.  like myreactor(), this lasts for the life of
+ * the process.
+ */
+extern int myuring(void);
+
+/* low-watermarks.  myread() blocks until at least rcvlowat bytes are
+ * available (or as many as were asked for, if fewer), or the peer has
+ * closed the connection.  a mywrite() blocked on a full send buffer
+ * resumes only when sndlowat bytes of it (or as many as remain to be
+ * written, if fewer) are free.  both default to 1, and mysockets returned
+ * by myaccept() inherit the listening mysocket's values.
+ */
+extern int mysetrcvlowat(mysocket_t sd, size_t bytes);
+extern int mysetsndlowat(mysocket_t sd, size_t bytes);
+
+/* send buffer.  data written to a mysocket counts against its send buffer
+ * until the peer has acknowledged it.  once the buffer is full, mywrite()
+ * and mywritev() wait for room, queueing the data piecemeal as the peer
+ * catches up, and fail with EPIPE if the connection goes away first.
+ * zero-copy and fan-out writes don't copy the data, so they never wait,
+ * though their bytes count against the buffer too.  mysockets returned by
+ * myaccept() inherit the listening mysocket's size.
+ */
+#define MYSOCK_DEFAULT_SNDBUF (256 * 1024)
+
+extern int mysetsndbuf(mysocket_t sd, size_t bytes);
+
+/* socket options, for tuning without recompiling.  like setsockopt() and
+ * getsockopt(), these take and return an int, with optlen sizeof(int).
+ * given MYSOCK_DEFAULTS instead of a mysocket, they set or get the process-
+ * wide defaults that mysockets created from then on start with; mysockets
+ * returned by myaccept() inherit the listening mysocket's options instead.
+ *   MYSO_SNDBUF      send buffer size in bytes (see mysetsndbuf())
+ *   MYSO_RCVBUF      receive window advertised to the peer, in bytes (at
+ *                    most 65535)
+ *   MYSO_RCVLOWAT,
+ *   MYSO_SNDLOWAT    low-watermarks (see mysetrcvlowat())
+ *   MYSO_NODELAY     send a partial segment straight away, even while
+ *                    earlier data is unacknowledged.  on by default; with
+ *                    it off, a partial segment waits for the earlier data
+ *                    to be acknowledged (Nagle's algorithm).
+ *   MYSO_CORK        send only full segments, holding back a partial one
+ *                    until the option is cleared, the mysocket is closed,
+ *                    or MYSO_CORK_MSEC pass.  off by default.
+ *   MYSO_MAXSEG      most data bytes per segment (at most MYSO_MAX_MAXSEG)
+ *   MYSO_CONGESTION  congestion control algorithm (MYCC_*).  a connection
+ *                    using slow start (MYCC_SLOW_START, or the bulk
+ *                    profile's default) to a host it reached within the
+ *                    last hour starts from the congestion window and RTT
+ *                    estimate the earlier connection ended with
+ *   MYSO_KEEPALIVE   seconds of idleness before the network layer starts
+ *                    probing the peer, giving up on the connection if it
+ *                    stays silent; zero (the default) disables probing
+ *   MYSO_PROFILE     transport profile (MYPROFILE_*):  the window, MSS,
+ *                    ACK strategy, congestion control and checksum
+ *                    handling the transport is compiled for
+ * zero for MYSO_RCVBUF or MYSO_MAXSEG, and MYCC_DEFAULT, leave the choice
+ * to the transport profile.  these four are read when the connection is
+ * set up, so must be set before myconnect() (or on the listening mysocket,
+ * before the peer connects); the others take effect straight away.
+ */
+#define MYSOCK_DEFAULTS     (-1)
+
+#define MYSO_SNDBUF         1
+#define MYSO_RCVBUF         2
+#define MYSO_RCVLOWAT       3
+#define MYSO_SNDLOWAT       4
+#define MYSO_NODELAY        5
+#define MYSO_CORK           6
+#define MYSO_MAXSEG         7
+#define MYSO_CONGESTION     8
+#define MYSO_KEEPALIVE      9
+#define MYSO_PROFILE        10
+
+#define MYSO_CORK_MSEC      200
+#define MYSO_MAX_MAXSEG     1480
+#define MYSO_MAX_KEEPALIVE  32767
+
+#define MYCC_DEFAULT        0   /* as the transport profile has it */
+#define MYCC_NONE           1   /* only the peer's window applies */
+#define MYCC_SLOW_START     2   /* slow start, then congestion avoidance */
+
+#define MYPROFILE_DEFAULT   0   /* 3072 byte window, 536 byte MSS, immediate
+                                 * ACKs, no congestion control */
+#define MYPROFILE_BULK      1   /* 48K window, 1460 byte MSS, delayed ACKs,
+                                 * slow start */
+#define MYPROFILE_CHECKED   2   /* as the default, but verifies checksums */
+
+extern int mysetsockopt(mysocket_t sd, int optname, const void *optval,
+                        socklen_t optlen);
+extern int mygetsockopt(mysocket_t sd, int optname, void *optval,
+                        socklen_t *optlen);
+
+/* non-blocking mode.  rather than waiting for send buffer space, mywrite()
+ * and mywritev() then queue as much as fits right away, returning the
+ * number of bytes queued, or fail with EAGAIN if there isn't room for
+ * sndlowat bytes.  myread() and myreadv() return whatever has arrived,
+ * failing with EAGAIN if nothing has, and myaccept() fails with EAGAIN if
+ * no connection is waiting.  myconnect() fails with EINPROGRESS once it
+ * has started setting up the connection; calling it again reports the
+ * outcome (EALREADY while it's still under way).  mysockets are blocking
+ * by default, and those returned by myaccept() inherit the listening
+ * mysocket's mode.
+ */
+extern int mysetnonblock(mysocket_t sd, bool_t nonblock);
+
+/* readiness polling.  mypoll() waits until at least one of the nfds
+ * mysockets in fds is ready for one of the events asked for, or timeout
+ * milliseconds pass (forever if timeout is negative), and returns the
+ * number with events to report in revents.  a listening mysocket is
+ * readable once myaccept() has a connection waiting.  a connected one is
+ * readable when myread() wouldn't block, and writable when its send
+ * buffer has room for sndlowat bytes (or, after a non-blocking
+ * myconnect(), once that has finished).  MYPOLLERR (the connection
+ * couldn't be set up) and MYPOLLHUP (the connection is over) are always
+ * reported, and an invalid descriptor gets MYPOLLNVAL.  negative
+ * descriptors are ignored.
+ */
+#define MYPOLLIN    0x001
+#define MYPOLLOUT   0x004
+#define MYPOLLERR   0x008
+#define MYPOLLHUP   0x010
+#define MYPOLLNVAL  0x020
+
+struct mypollfd
+{
+    mysocket_t sd;
+    short      events;      /* requested events */
+    short      revents;     /* returned events */
+};
+
+extern int mypoll(struct mypollfd *fds, unsigned int nfds, int timeout);
+
+/* the myepoll_*() family does the same for a registered interest set.
+ * it's always edge-triggered:  myepoll_wait() reports a mysocket only once
+ * its state has changed since it was last reported, so the application
+ * should read, write or accept until EAGAIN before waiting again.
+ * myepoll_create() returns a descriptor for a new, empty set (up to
+ * MAX_NUM_EPOLLS per process), which myepoll_ctl() adds mysockets to,
+ * changes or removes them from, each with the events of interest and a
+ * value to report them with.  myclose() removes a mysocket from every set
+ * it's in.  myepoll_close() wakes any myepoll_wait() on the set, which
+ * then fails with EBADF.
+ */
+#define MAX_NUM_EPOLLS 16
+
+#define MYEPOLL_CTL_ADD 1
+#define MYEPOLL_CTL_DEL 2
+#define MYEPOLL_CTL_MOD 3
+
+typedef union
+{
+    void      *ptr;
+    mysocket_t sd;
+    uint32_t   u32;
+    uint64_t   u64;
+} myepoll_data_t;
+
+typedef struct
+{
+    uint32_t       events;  /* MYPOLL* */
+    myepoll_data_t data;
+} myepoll_event_t;
+
+extern int myepoll_create(void);
+extern int myepoll_ctl(int epfd, int op, mysocket_t sd,
+                       myepoll_event_t *event);
+extern int myepoll_wait(int epfd, myepoll_event_t *events, int max_events,
+                        int timeout);
+extern int myepoll_close(int epfd);
+
+/* busy-polling, for latency-sensitive connections.  with a non-zero
+ * budget, threads waiting on the mysocket (myread(), the transport, and
+ * the network poller watching it) spin for up to usec microseconds before
+ * going to sleep, trading CPU time for lower latency.  zero, the default,
+ * disables it.  set it before myconnect() or mylisten() for it to cover
+ * the network poller too; mysockets returned by myaccept() inherit the
+ * listening mysocket's budget.
+ */
+#define MYSOCK_MAX_BUSY_POLL_USEC 1000000
+
+extern int mysetbusypoll(mysocket_t sd, unsigned int usec);
+
+/* fan-out writes.  mybuf_alloc() returns a buffer of the given length for
+ * the application to fill in, holding one reference for the caller.
+ * mywrite_fanout() queues the entire buffer for sending on each of the
+ * num_sds mysockets in sds; every connection sends from the same copy,
+ * which is freed once the caller has called mybuf_release() and every
+ * connection is done with it.  the buffer must not be modified once it has
+ * been queued.  mywrite_fanout() returns the number of mysockets on which
+ * the buffer was queued, or -1 on error (in which case it is queued on
+ * none of them).
+ */
+extern mybuf_t *mybuf_alloc(size_t length);
+extern void *mybuf_data(mybuf_t *buf);
+extern size_t mybuf_length(const mybuf_t *buf);
+extern void mybuf_release(mybuf_t *buf);
+extern int mywrite_fanout(const mysocket_t *sds, int num_sds, mybuf_t *buf);
+
+/* zero-copy writes.  mywrite_zerocopy() queues length bytes (at least one)
+ * straight from the caller's buffer, which is sent from in place rather
+ * than being copied first.  the buffer belongs to the mysocket layer until
+ * done is called with it:  with error zero once the peer has acknowledged
+ * every byte, or with an errno value if the connection goes away first.
+ * done runs on one of the library's threads (or in myclose()), and must
+ * not block or call back into the mysocket layer for the same mysocket.
+ */
+typedef void (*mywrite_done_t)(mysocket_t sd, const void *buffer,
+                               size_t length, int error, void *arg);
+
+extern int mywrite_zerocopy(mysocket_t sd, const void *buffer, size_t length,
+                            mywrite_done_t done, void *arg);
+
+/* file transmission.  mysendfile() queues up to count bytes of the file
+ * open on fd, starting at offset, for sending; like sendfile(), it doesn't
+ * use or change the file offset, and returns the number of bytes queued
+ * (0 at end of file), which may be fewer than count, or -1 on error.  as
+ * with mywrite(), it queues as much as the send buffer allows at a time,
+ * and fails with EAGAIN on a non-blocking mysocket if there's no room.  a
+ * regular file is mapped a piece at a time while there's room for at least
+ * MYSENDFILE_MMAP_MIN bytes, and sent straight from the page cache as with
+ * mywrite_zerocopy(), so fd may be closed as soon as this returns, but the
+ * file shouldn't be truncated until the peer has acknowledged the data.
+ * anything else is read into the send queue with pread(), a buffer at a
+ * time.
+ */
+#define MYSENDFILE_MMAP_MIN (64 * 1024)
+
+extern int mysendfile(mysocket_t sd, int fd, off_t offset, size_t count);
+
+/* receiving into a file.  myrecvfile() writes the next count bytes
+ * received, or as many as arrive before the peer closes the connection, to
+ * fd (at its current offset) straight from the receive queue.  before each
+ * write it waits for enough data to take fd's offset to the next multiple
+ * of MYRECVFILE_CHUNK (or for the rest of count), then writes as much as
+ * is queued, up to a page boundary, so apart from its ends a transfer goes
+ * out in page-aligned writes of MYRECVFILE_CHUNK or more (the receive
+ * queue holds up to twice that).  returns the number of bytes written (0
+ * at EOF), which may be fewer than count, or -1 on error; data that
+ * couldn't be written stays queued.  with MYRECVFILE_PREALLOC, disk space
+ * for count bytes is reserved first, where the file system supports it.  a
+ * non-blocking mysocket writes out only what has already arrived.
+ */
+#define MYRECVFILE_PREALLOC 0x1
+#define MYRECVFILE_CHUNK    (64 * 1024)
+
+extern int myrecvfile(mysocket_t sd, int fd, size_t count, int flags);
+
+/* relaying.  mysplice() moves up to max_len bytes received on in_sd over
+ * to be sent on out_sd, handing the queued data across by reference
+ * rather than copying it through an application buffer.  it waits (unless
+ * the mysocket is non-blocking) for out_sd's send buffer to have room and
+ * then for data on in_sd, as mywrite() and myread() would, and moves no
+ * more than that room allows.  returns the number of bytes moved, 0 once
+ * in_sd reaches EOF (out_sd is left open), or -1 on error.
+ */
+extern int mysplice(mysocket_t in_sd, mysocket_t out_sd, size_t max_len);
+
+/* packet buffer pool statistics, for watching allocator pressure.  hits
+ * are queued packets whose buffer was recycled from the pool, misses those
+ * for which it had to allocate more memory, and oversized those too large
+ * for a pool buffer (which were also allocated separately for their data).
+ * depot_free is the number of free buffers held in the shared depot.
+ */
+typedef struct
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long oversized;
+    unsigned long depot_free;
+} mypool_stats_t;
+
+extern void mypoolstats(mypool_stats_t *stats);
+
 /* return IP address of interface on which packets to/from peer_addr are
  * delivered.  peer_addr is in network byte order.
  */
@@ -4,8 +4,12 @@
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "mysock.h"
@@ -20,6 +24,13 @@
 #define MYSOCK_ERROR_EXIT(rc) { errno = rc; return -1; }
 #define MYSOCK_CHECK(cond,rc)   { if (!(cond)) MYSOCK_ERROR_EXIT(rc); }
 
+static int _mysock_readv(mysock_context_t *, const struct iovec *, int,
+                         size_t);
+static int _mysock_writev(mysock_context_t *, const struct iovec *, int,
+                          size_t);
+static int _mysock_iov_length(const struct iovec *iov, int iovcnt);
+static int _mysock_connect_status(mysock_context_t *ctx, int in_progress);
+
 
 /* create a new mysocket; returns the corresponding mysocket descriptor */
 mysocket_t mysocket()
@@ -49,6 +60,11 @@ int myconnect(mysocket_t sd, struct sockaddr *name, int namelen)
     mysock_context_t *ctx = _mysock_get_context(sd);
 
     MYSOCK_CHECK(ctx != NULL, EINVAL);
+
+    /* a non-blocking myconnect() is already under way */
+    if (ctx->connect_pending)
+        return _mysock_connect_status(ctx, EALREADY);
+
     MYSOCK_CHECK((ctx->network_state.peer_addr_len == 0), EISCONN);
 
 #ifdef DEBUG
@@ -79,9 +95,25 @@ int myconnect(mysocket_t sd, struct sockaddr *name, int namelen)
 
     /* time for kick off */
     _mysock_transport_init(sd, TRUE);
+    ctx->connect_pending = TRUE;
 
     /* block until connection is established, or we hit an error */
-    return _mysock_wait_for_connection(ctx);
+    return _mysock_connect_status(ctx, EINPROGRESS);
+}
+
+/* the outcome of the connection attempt under way on ctx, waiting for it
+ * unless the mysocket is non-blocking; in_progress is the error to report
+ * in that case if it hasn't finished yet
+ */
+static int _mysock_connect_status(mysock_context_t *ctx, int in_progress)
+{
+    assert(ctx->connect_pending);
+
+    MYSOCK_CHECK(_mysock_wait_for_connection(ctx, !ctx->nonblocking),
+                 in_progress);
+    ctx->connect_pending = FALSE;
+
+    return (errno = ctx->stcp_errno) ? -1 : 0;
 }
 
 mysocket_t myaccept(mysocket_t sd, struct sockaddr *addr, int *addrlen)
@@ -102,7 +134,9 @@ mysocket_t myaccept(mysocket_t sd, struct sockaddr *addr, int *addrlen)
     /* the new socket is created on an incoming SYN.  block here until we
      * establish a connection, or STCP indicates an error condition.
      */
-    _mysock_dequeue_connection(accept_ctx, &ctx);
+    MYSOCK_CHECK(_mysock_dequeue_connection(accept_ctx, &ctx,
+                                            !accept_ctx->nonblocking),
+                 EAGAIN);
     assert(ctx);
 
     if (!ctx->stcp_errno)
@@ -144,7 +178,7 @@ int mylisten(mysocket_t sd, int backlog)
      * _mysock_transport_init() is never called for such sockets), we
      * begin receiving network packets here...
      */
-    if (_network_start_recv_thread(ctx) < 0)
+    if (_network_start_recv(ctx) < 0)
     {
         assert(0);
         return -1;
@@ -156,7 +190,9 @@ int mylisten(mysocket_t sd, int backlog)
 /* close the given mysocket.  note that the semantics of myclose() differ
  * slightly from a regular close(); STCP doesn't implement TIME_WAIT, so
  * myclose() simply discards all knowledge of the connection once the
- * connection is terminated.
+ * connection is terminated.  like close(), this doesn't wait for the
+ * peer:  any data still queued is sent and the close handshake completes
+ * in the background, after which the mysocket is freed.
  */
 int myclose(mysocket_t sd)
 {
@@ -165,13 +201,25 @@ int myclose(mysocket_t sd)
     DEBUG_LOG(("***myclose(%d)***\n", sd));
     MYSOCK_CHECK(ctx != NULL, EBADF);
 
+    /* drop it from any epoll interest sets before it goes away */
+    _mysock_poll_forget(ctx);
+
     /* stcp_wait_for_event() needs to wake up on a socket close request */
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
     ctx->close_requested = TRUE;
+    ctx->app_closed = TRUE;
+    _mysock_reactor_notify(ctx);
+    _mysock_transport_signal(ctx);
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
 
-    /* block until STCP thread exits */
+    /* let the transport thread finish the close handshake on its own */
+    if (_mysock_orphan_context(ctx))
+    {
+        DEBUG_LOG(("myclose(%d) returning, close in progress...\n", sd));
+        return 0;
+    }
+
+    /* otherwise the STCP thread has already exited, or is about to */
     if (ctx->transport_thread_started)
     {
         assert(!ctx->listening);
@@ -179,8 +227,13 @@ int myclose(mysocket_t sd)
         PTHREAD_CALL(pthread_join(ctx->transport_thread, NULL));
         ctx->transport_thread_started = FALSE;
     }
+    else if (ctx->transport_fiber)
+    {
+        _mysock_fiber_join(ctx->transport_fiber);
+        ctx->transport_fiber = NULL;
+    }
 
-    _network_stop_recv_thread(ctx);
+    _network_stop_recv(ctx);
 
     if (ctx->listening)
     {
@@ -198,32 +251,141 @@ int myclose(mysocket_t sd)
 int mywrite(mysocket_t sd, const void *buf, size_t buf_len)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
+    struct iovec iov;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(buf_len <= INT_MAX, EINVAL);
+
+    iov.iov_base = (void *) buf;
+    iov.iov_len  = buf_len;
+    return _mysock_writev(ctx, &iov, 1, buf_len);
+}
+
+/* gather the buffers into a single queued write (see mysock.h) */
+int mywritev(mysocket_t sd, const struct iovec *iov, int iovcnt)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    int len;
 
     MYSOCK_CHECK(ctx != NULL, EBADF);
     MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK((len = _mysock_iov_length(iov, iovcnt)) >= 0, EINVAL);
+
+    return _mysock_writev(ctx, iov, iovcnt, len);
+}
+
+/* wait for enough send buffer space to queue the next piece of a write
+ * with remaining bytes left (see mysetsndlowat()), returning the space
+ * free, or -1 (with errno set) if there's none and no more can be queued
+ * now
+ */
+static ssize_t _mysock_write_space(mysock_context_t *ctx, size_t remaining)
+{
+    size_t need  = MIN(ctx->opts.snd_lowat, remaining);
+    size_t space = _mysock_send_space(ctx);
+
+    if (ctx->nonblocking &&
+        (space < need ||
+         !_mysock_queue_has_room(&ctx->app_recv_queue, FALSE)))
+    {
+        /* no room will come if the connection is over */
+        errno = ctx->transport_done ? EPIPE : EAGAIN;
+        return -1;
+    }
+
+    if (space < need)
+    {
+        if (_mysock_wait_send_space(ctx, need) < 0)
+            return -1;
+        space = _mysock_send_space(ctx);
+    }
+    return (ssize_t) space;
+}
+
+/* common to mywrite() and mywritev(); length is the total size of the
+ * buffers.  the data is queued as send buffer space allows, so a write
+ * larger than the buffer goes out in pieces.
+ */
+static int _mysock_writev(mysock_context_t   *ctx,
+                          const struct iovec *iov,
+                          int                 iovcnt,
+                          size_t              length)
+{
+    size_t written = 0, len;
+    ssize_t space;
 
     assert(!ctx->close_requested);
-    _mysock_enqueue_buffer(ctx, &ctx->app_recv_queue, buf, buf_len);
 
-    /* XXX: all bytes are queued, irrespective of current sender window */
-    return buf_len;
+    while (written < length)
+    {
+        if ((space = _mysock_write_space(ctx, length - written)) < 0)
+            return (written > 0) ? (int) written : -1;
+
+        len = MIN((size_t) space, length - written);
+        _mysock_enqueue_iovec(ctx, &ctx->app_recv_queue, iov, iovcnt,
+                              written, len);
+        written += len;
+    }
+
+    return (int) written;
 }
 
 int myread(mysocket_t sd, void *buf, size_t buf_len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    struct iovec iov;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+
+    iov.iov_base = buf;
+    iov.iov_len  = buf_len;
+    return _mysock_readv(ctx, &iov, 1, buf_len);
+}
+
+/* scatter the next bytes received over the buffers (see mysock.h) */
+int myreadv(mysocket_t sd, const struct iovec *iov, int iovcnt)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
     int len;
 
     MYSOCK_CHECK(ctx != NULL, EBADF);
     MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK((len = _mysock_iov_length(iov, iovcnt)) >= 0, EINVAL);
+
+    return _mysock_readv(ctx, iov, iovcnt, len);
+}
+
+/* common to myread() and myreadv(); length is the total size of the
+ * buffers
+ */
+static int _mysock_readv(mysock_context_t   *ctx,
+                         const struct iovec *iov,
+                         int                 iovcnt,
+                         size_t              length)
+{
+    size_t min_len;
+    int len;
 
     assert(!ctx->close_requested);
 
-    if (ctx->eof)
+    if (ctx->eof || !length)
         return 0;
 
-    if ((len = _mysock_dequeue_buffer(ctx, &ctx->app_send_queue,
-                                      buf, buf_len, TRUE)) == 0)
+    /* wait for rcv_lowat bytes, or as many as will fit in the buffers if
+     * that's fewer, so bulk readers aren't woken for every segment that
+     * arrives.  a non-blocking read takes whatever is there.
+     */
+    min_len = MIN(ctx->opts.rcv_lowat, length);
+    if (ctx->nonblocking)
+    {
+        MYSOCK_CHECK(!_mysock_queue_empty(&ctx->app_send_queue), EAGAIN);
+        min_len = 1;
+    }
+
+    if ((len = _mysock_dequeue_stream(ctx, &ctx->app_send_queue, iov, iovcnt,
+                                      min_len)) == 0)
     {
         /* make sure repeated calls to myread() return 0 on EOF */
         ctx->eof = TRUE;
@@ -232,6 +394,591 @@ int myread(mysocket_t sd, void *buf, size_t buf_len)
     return len;
 }
 
+/* total length of an application's iovec array, or -1 if the array is
+ * invalid or the total would overflow the return value of myreadv() or
+ * mywritev()
+ */
+static int _mysock_iov_length(const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    int k;
+
+    if (!iov || iovcnt <= 0 || iovcnt > IOV_MAX)
+        return -1;
+
+    for (k = 0; k < iovcnt; ++k)
+    {
+        if ((!iov[k].iov_base && iov[k].iov_len > 0) ||
+            iov[k].iov_len > (size_t) INT_MAX - total)
+            return -1;
+        total += iov[k].iov_len;
+    }
+
+    return (int) total;
+}
+
+/* switch to reactor mode (see mysock.h and mysock_reactor.c) */
+int myreactor(unsigned int num_workers)
+{
+    return _mysock_reactor_start(num_workers);
+}
+
+/* run transports in fibers (see mysock.h and mysock_fiber.c) */
+int myfibers(unsigned int num_threads)
+{
+    return _mysock_fiber_start_carriers(num_threads);
+}
+
+/* switch the network layer to io_uring (see mysock.h and network_io_uring.c) */
+int myuring(void)
+{
+    return _network_enable_uring();
+}
+
+/* set the receive and send low-watermarks (see mysock.h) */
+int mysetrcvlowat(mysocket_t sd, size_t bytes)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(bytes > 0, EINVAL);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->opts.rcv_lowat = bytes;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    return 0;
+}
+
+int mysetsndlowat(mysocket_t sd, size_t bytes)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(bytes > 0, EINVAL);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->opts.snd_lowat = bytes;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    return 0;
+}
+
+/* set the send buffer size (see mysock.h) */
+int mysetsndbuf(mysocket_t sd, size_t bytes)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(bytes > 0, EINVAL);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->opts.snd_buf = bytes;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    return 0;
+}
+
+int mysetnonblock(mysocket_t sd, bool_t nonblock)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+
+    ctx->nonblocking = (nonblock != 0);
+    return 0;
+}
+
+int mysetbusypoll(mysocket_t sd, unsigned int usec)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(usec <= MYSOCK_MAX_BUSY_POLL_USEC, EINVAL);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->busy_poll_usec = usec;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    return 0;
+}
+
+/* store option optname in opts, returning an errno value if value is out
+ * of range
+ */
+static int _mysock_set_opt(mysock_opts_t *opts, int optname, int value)
+{
+    switch (optname)
+    {
+    case MYSO_SNDBUF:
+        if (value <= 0)
+            return EINVAL;
+        opts->snd_buf = value;
+        break;
+
+    case MYSO_RCVBUF:
+        if (value < 0 || value > 0xffff)
+            return EINVAL;
+        opts->rcv_buf = value;
+        break;
+
+    case MYSO_RCVLOWAT:
+    case MYSO_SNDLOWAT:
+        if (value <= 0)
+            return EINVAL;
+        if (optname == MYSO_RCVLOWAT)
+            opts->rcv_lowat = value;
+        else
+            opts->snd_lowat = value;
+        break;
+
+    case MYSO_NODELAY:
+        opts->nodelay = (value != 0);
+        break;
+
+    case MYSO_CORK:
+        opts->cork = (value != 0);
+        break;
+
+    case MYSO_MAXSEG:
+        if (value < 0 || value > MYSO_MAX_MAXSEG)
+            return EINVAL;
+        opts->maxseg = value;
+        break;
+
+    case MYSO_CONGESTION:
+        if (value != MYCC_DEFAULT && value != MYCC_NONE &&
+            value != MYCC_SLOW_START)
+            return EINVAL;
+        opts->congestion = value;
+        break;
+
+    case MYSO_KEEPALIVE:
+        if (value < 0 || value > MYSO_MAX_KEEPALIVE)
+            return EINVAL;
+        opts->keepalive = value;
+        break;
+
+    case MYSO_PROFILE:
+        if (value != MYPROFILE_DEFAULT && value != MYPROFILE_BULK &&
+            value != MYPROFILE_CHECKED)
+            return EINVAL;
+        opts->profile = value;
+        break;
+
+    default:
+        return ENOPROTOOPT;
+    }
+    return 0;
+}
+
+static int _mysock_get_opt(const mysock_opts_t *opts, int optname)
+{
+    switch (optname)
+    {
+    case MYSO_SNDBUF:
+        return (int) MIN(opts->snd_buf, (size_t) INT_MAX);
+    case MYSO_RCVBUF:
+        return opts->rcv_buf;
+    case MYSO_RCVLOWAT:
+        return (int) MIN(opts->rcv_lowat, (size_t) INT_MAX);
+    case MYSO_SNDLOWAT:
+        return (int) MIN(opts->snd_lowat, (size_t) INT_MAX);
+    case MYSO_NODELAY:
+        return opts->nodelay;
+    case MYSO_CORK:
+        return opts->cork;
+    case MYSO_MAXSEG:
+        return opts->maxseg;
+    case MYSO_CONGESTION:
+        return opts->congestion;
+    case MYSO_KEEPALIVE:
+        return opts->keepalive;
+    case MYSO_PROFILE:
+        return opts->profile;
+    default:
+        assert(0);
+        return 0;
+    }
+}
+
+/* set a socket option, or its default for new mysockets (see mysock.h) */
+int mysetsockopt(mysocket_t sd, int optname, const void *optval,
+                 socklen_t optlen)
+{
+    mysock_context_t *ctx;
+    int value, error;
+
+    MYSOCK_CHECK(optval != NULL && optlen == sizeof(int), EINVAL);
+    value = *(const int *) optval;
+
+    if (sd == MYSOCK_DEFAULTS)
+    {
+        error = _mysock_set_opt(_mysock_lock_default_opts(), optname, value);
+        _mysock_unlock_default_opts();
+        MYSOCK_CHECK(!error, error);
+        return 0;
+    }
+
+    ctx = _mysock_get_context(sd);
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    error = _mysock_set_opt(&ctx->opts, optname, value);
+    if (!error && (optname == MYSO_NODELAY || optname == MYSO_CORK))
+    {
+        /* have the transport look again at any partial segment it's
+         * holding back
+         */
+        ctx->app_data_lowat = 1;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    MYSOCK_CHECK(!error, error);
+
+    if (optname == MYSO_NODELAY || optname == MYSO_CORK)
+        _mysock_wake_transport(ctx);
+    if (optname == MYSO_NODELAY || optname == MYSO_KEEPALIVE)
+        return _network_apply_opts(ctx);
+    return 0;
+}
+
+int mygetsockopt(mysocket_t sd, int optname, void *optval, socklen_t *optlen)
+{
+    mysock_context_t *ctx;
+
+    MYSOCK_CHECK(optval != NULL && optlen != NULL &&
+                 *optlen >= (socklen_t) sizeof(int), EINVAL);
+    MYSOCK_CHECK(optname >= MYSO_SNDBUF && optname <= MYSO_PROFILE,
+                 ENOPROTOOPT);
+
+    if (sd == MYSOCK_DEFAULTS)
+    {
+        *(int *) optval = _mysock_get_opt(_mysock_lock_default_opts(),
+                                          optname);
+        _mysock_unlock_default_opts();
+    }
+    else
+    {
+        ctx = _mysock_get_context(sd);
+        MYSOCK_CHECK(ctx != NULL, EBADF);
+
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        *(int *) optval = _mysock_get_opt(&ctx->opts, optname);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    }
+
+    *optlen = sizeof(int);
+    return 0;
+}
+
+/* allocate a shared buffer for mywrite_fanout().  the caller holds the
+ * only reference until the buffer is queued.
+ */
+mybuf_t *mybuf_alloc(size_t length)
+{
+    mybuf_t *buf = (mybuf_t *) calloc(1, sizeof(mybuf_t));
+
+    if (!buf)
+        return NULL;
+
+    if (!(buf->data = (char *) malloc(MAX(length, 1))))
+    {
+        free(buf);
+        return NULL;
+    }
+
+    buf->length = length;
+    buf->refcnt = 1;
+    return buf;
+}
+
+void *mybuf_data(mybuf_t *buf)
+{
+    assert(buf);
+    return buf->data;
+}
+
+size_t mybuf_length(const mybuf_t *buf)
+{
+    assert(buf);
+    return buf->length;
+}
+
+void mybuf_release(mybuf_t *buf)
+{
+    if (buf)
+        _mysock_buf_release(buf);
+}
+
+/* queue one shared buffer for sending on each of the given mysockets.
+ * the descriptors are all checked before anything is queued, so that the
+ * write happens either everywhere or nowhere.
+ */
+int mywrite_fanout(const mysocket_t *sds, int num_sds, mybuf_t *buf)
+{
+    int k;
+
+    MYSOCK_CHECK(sds != NULL && buf != NULL && num_sds >= 0, EFAULT);
+
+    for (k = 0; k < num_sds; ++k)
+    {
+        mysock_context_t *ctx = _mysock_get_context(sds[k]);
+
+        MYSOCK_CHECK(ctx != NULL, EBADF);
+        MYSOCK_CHECK(!ctx->listening, EINVAL);
+        assert(!ctx->close_requested);
+    }
+
+    if (buf->length == 0)
+        return num_sds;     /* nothing to send */
+
+    for (k = 0; k < num_sds; ++k)
+    {
+        mysock_context_t *ctx = _mysock_get_context(sds[k]);
+        _mysock_enqueue_shared(ctx, &ctx->app_recv_queue, buf);
+    }
+
+    return num_sds;
+}
+
+/* queue the caller's buffer for sending without copying it; done is
+ * called once the peer has acknowledged all of it (see mysock.h)
+ */
+int mywrite_zerocopy(mysocket_t sd, const void *buf, size_t buf_len,
+                     mywrite_done_t done, void *arg)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    zc_write_t *zc;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(buf != NULL && done != NULL, EFAULT);
+    MYSOCK_CHECK(buf_len > 0 && buf_len <= INT_MAX, EINVAL);
+    MYSOCK_CHECK((zc = (zc_write_t *) calloc(1, sizeof(*zc))) != NULL,
+                 ENOMEM);
+
+    assert(!ctx->close_requested);
+
+    zc->buffer = buf;
+    zc->length = buf_len;
+    zc->done   = done;
+    zc->arg    = arg;
+    _mysock_enqueue_zerocopy(ctx, &ctx->app_recv_queue, zc);
+
+    return buf_len;
+}
+
+/* munmap() a file region sent by mysendfile() once the peer has it all;
+ * arg is the distance from the (page-aligned) start of the mapping to the
+ * data that was sent
+ */
+static void _mysock_sendfile_done(mysocket_t sd, const void *buf,
+                                  size_t buf_len, int error, void *arg)
+{
+    size_t skip = (size_t) arg;
+
+    (void) munmap((char *) buf - skip, buf_len + skip);
+}
+
+/* queue len bytes of a regular file at offset as a zero-copy write of a
+ * mapping of them.  returns FALSE, queueing nothing, if it can't be mapped.
+ */
+static bool_t _mysock_sendfile_map(mysock_context_t *ctx,
+                                   int fd, off_t offset, size_t len)
+{
+    size_t skip = (size_t) (offset % sysconf(_SC_PAGESIZE));
+    zc_write_t *zc;
+    char *map;
+
+    map = (char *) mmap(NULL, skip + len, PROT_READ, MAP_SHARED,
+                        fd, offset - skip);
+    if (map == MAP_FAILED)
+        return FALSE;
+    (void) madvise(map, skip + len, MADV_SEQUENTIAL);
+
+    if (!(zc = (zc_write_t *) calloc(1, sizeof(*zc))))
+    {
+        (void) munmap(map, skip + len);
+        return FALSE;
+    }
+
+    zc->buffer = map + skip;
+    zc->length = len;
+    zc->done   = _mysock_sendfile_done;
+    zc->arg    = (void *) skip;
+    _mysock_enqueue_zerocopy(ctx, &ctx->app_recv_queue, zc);
+    return TRUE;
+}
+
+/* queue count bytes of the file as send buffer space allows, like
+ * mywrite().  while there's room for at least MYSENDFILE_MMAP_MIN bytes of
+ * a regular file, each piece is mapped (see _mysock_sendfile_map());
+ * anything else is read straight into the queued node.
+ */
+static int _mysock_sendfile_queue(mysock_context_t *ctx, int fd, bool_t map,
+                                  off_t offset, size_t count)
+{
+    size_t written = 0, len;
+    ssize_t space, rc;
+
+    assert(!ctx->close_requested);
+
+    while (written < count)
+    {
+        if ((space = _mysock_write_space(ctx, count - written)) < 0)
+            return (written > 0) ? (int) written : -1;
+
+        len = MIN((size_t) space, count - written);
+        if (map && len >= MYSENDFILE_MMAP_MIN &&
+            _mysock_sendfile_map(ctx, fd, offset + written, len))
+        {
+            written += len;
+            continue;
+        }
+
+        /* otherwise fall back to reading it */
+        rc = _mysock_enqueue_file(ctx, &ctx->app_recv_queue, fd,
+                                  offset + written, len);
+        if (rc < 0)
+            return (written > 0) ? (int) written : -1;
+        if (rc == 0)
+            break;      /* end of file */
+        written += rc;
+    }
+
+    return (int) written;
+}
+
+/* queue part of a file for sending (see mysock.h).  a large regular file
+ * is mapped and handed to the transport as zero-copy writes, so its pages
+ * go from the page cache into each segment as that's built; each mapping
+ * is dropped once the peer has acknowledged it.
+ */
+int mysendfile(mysocket_t sd, int fd, off_t offset, size_t count)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    struct stat st;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(offset >= 0, EINVAL);
+
+    if (fstat(fd, &st) < 0)
+        return -1;
+
+    count = MIN(count, (size_t) INT_MAX);
+    if (S_ISREG(st.st_mode))
+    {
+        if (offset >= st.st_size)
+            return 0;
+        count = (size_t) MIN((off_t) count, st.st_size - offset);
+    }
+    if (count == 0)
+        return 0;
+
+    return _mysock_sendfile_queue(ctx, fd, S_ISREG(st.st_mode),
+                                  offset, count);
+}
+
+/* write received data to a file (see mysock.h).  each write but the last
+ * ends on a MYRECVFILE_CHUNK boundary in the file, or at least a page one,
+ * so the file system never has to merge partial blocks.
+ */
+int myrecvfile(mysocket_t sd, int fd, size_t count, int flags)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    size_t written = 0, want, align;
+    off_t pos;
+    ssize_t rc;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(fd >= 0, EBADF);
+
+    assert(!ctx->close_requested);
+
+    count = MIN(count, (size_t) INT_MAX);
+    if (ctx->eof || !count)
+        return 0;
+
+    if (ctx->nonblocking)
+        MYSOCK_CHECK(!_mysock_queue_empty(&ctx->app_send_queue), EAGAIN);
+
+    /* a pipe or socket has no offset, but then alignment doesn't matter */
+    if ((pos = lseek(fd, 0, SEEK_CUR)) < 0)
+        pos = 0;
+#ifdef FALLOC_FL_KEEP_SIZE
+    else if (flags & MYRECVFILE_PREALLOC)
+        (void) fallocate(fd, FALLOC_FL_KEEP_SIZE, pos, count);
+#endif
+
+    align = (size_t) sysconf(_SC_PAGESIZE);
+    while (written < count)
+    {
+        want = MYRECVFILE_CHUNK - (size_t) (pos % MYRECVFILE_CHUNK);
+        want = MIN(want, count - written);
+
+        if (ctx->nonblocking)
+        {
+            if (_mysock_queue_empty(&ctx->app_send_queue))
+                break;
+            want  = 1;
+            align = 1;
+        }
+
+        rc = _mysock_dequeue_file(ctx, &ctx->app_send_queue, fd, want,
+                                  count - written, align);
+        if (rc < 0)
+            return (written > 0) ? (int) written : -1;
+        if (rc == 0)
+        {
+            /* make sure repeated calls return 0 on EOF, as with myread() */
+            ctx->eof = TRUE;
+            break;
+        }
+
+        written += rc;
+        pos     += rc;
+    }
+
+    return (int) written;
+}
+
+/* relay data from one mysocket to another (see mysock.h) */
+int mysplice(mysocket_t in_sd, mysocket_t out_sd, size_t max_len)
+{
+    mysock_context_t *in_ctx  = _mysock_get_context(in_sd);
+    mysock_context_t *out_ctx = _mysock_get_context(out_sd);
+    size_t len, min_len, moved;
+    ssize_t space;
+
+    MYSOCK_CHECK(in_ctx != NULL && out_ctx != NULL, EBADF);
+    MYSOCK_CHECK(!in_ctx->listening && !out_ctx->listening, EINVAL);
+    MYSOCK_CHECK(in_ctx != out_ctx, EINVAL);
+
+    assert(!in_ctx->close_requested && !out_ctx->close_requested);
+
+    max_len = MIN(max_len, (size_t) INT_MAX);
+    if (in_ctx->eof || !max_len)
+        return 0;
+
+    if (in_ctx->nonblocking)
+        MYSOCK_CHECK(!_mysock_queue_empty(&in_ctx->app_send_queue), EAGAIN);
+
+    /* make sure whatever's taken from in_sd can be queued on out_sd */
+    if ((space = _mysock_write_space(out_ctx, max_len)) < 0)
+        return -1;
+
+    len     = MIN((size_t) space, max_len);
+    min_len = in_ctx->nonblocking ? 1 : MIN(in_ctx->opts.rcv_lowat, len);
+
+    if ((moved = _mysock_splice_stream(in_ctx, &in_ctx->app_send_queue,
+                                       out_ctx, &out_ctx->app_recv_queue,
+                                       min_len, len)) == 0)
+    {
+        /* make sure repeated calls return 0 on EOF, as with myread() */
+        in_ctx->eof = TRUE;
+    }
+
+    return (int) moved;
+}
+
 /* fills in addr with current port associated with the mysocket descriptor.
  * like the regular getsockname(), this does not fill in the local IP
  * address unless it's known.
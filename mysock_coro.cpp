@@ -0,0 +1,226 @@
+/* mysock_coro.cpp--C++20 coroutine interface to mysockets (see
+ * mysock_coro.h).
+ *
+ * each scheduler keeps a myepoll set with every mysocket one of its
+ * coroutines has waited on, registered (edge-triggered) for both reading
+ * and writing.  an operation always tries the non-blocking call first, and
+ * only waits once that fails with EAGAIN; since registering a mysocket
+ * reports its state at the time, and every later change is reported too,
+ * a coroutine can't miss the event it's waiting for.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include "mysock.h"
+#include "mysock_coro.h"
+
+
+namespace mysock
+{
+
+/* events collected per myepoll_wait() */
+#define SCHED_MAX_EVENTS 64
+
+thread_local scheduler *scheduler::current_ = nullptr;
+
+
+scheduler::scheduler() : num_tasks_(0)
+{
+    if ((epfd_ = myepoll_create()) < 0)
+    {
+        perror("myepoll_create");
+        assert(0);
+        abort();
+    }
+}
+
+scheduler::~scheduler()
+{
+    assert(!num_tasks_ && ready_.empty());
+
+    for (auto &entry : waiters_)
+        delete entry.second;
+    myepoll_close(epfd_);
+}
+
+void scheduler::spawn(task<void> t)
+{
+    task<void>::handle_type h = t.release();
+
+    assert(h);
+    h.promise().owner_ = this;
+    ++num_tasks_;
+    ready_.push_back(h);
+}
+
+void scheduler::run()
+{
+    myepoll_event_t events[SCHED_MAX_EVENTS];
+    scheduler *prev = current_;
+    int k, n;
+
+    current_ = this;
+    while (num_tasks_ > 0)
+    {
+        while (!ready_.empty())
+        {
+            std::coroutine_handle<> h = ready_.front();
+
+            ready_.pop_front();
+            h.resume();
+        }
+
+        if (!num_tasks_)
+            break;
+
+        /* everything left is waiting on a mysocket.  the waiters are all
+         * queued before any is resumed, since resuming one may close (and
+         * forget) a mysocket reported later in the batch.
+         */
+        if ((n = myepoll_wait(epfd_, events, SCHED_MAX_EVENTS, -1)) < 0)
+        {
+            perror("myepoll_wait");
+            assert(0);
+            abort();
+        }
+
+        for (k = 0; k < n; ++k)
+        {
+            waiter *w = (waiter *) events[k].data.ptr;
+            unsigned int ev = events[k].events;
+
+            if (w->reader && (ev & (MYPOLLIN | MYPOLLERR | MYPOLLHUP)))
+                ready_.push_back(std::exchange(w->reader, {}));
+            if (w->writer && (ev & (MYPOLLOUT | MYPOLLERR | MYPOLLHUP)))
+                ready_.push_back(std::exchange(w->writer, {}));
+        }
+    }
+    current_ = prev;
+}
+
+void scheduler::wait_for(mysocket_t sd, unsigned int events,
+                         std::coroutine_handle<> h)
+{
+    auto it = waiters_.find(sd);
+    waiter *w;
+
+    if (it != waiters_.end())
+    {
+        w = it->second;
+    }
+    else
+    {
+        myepoll_event_t ev;
+
+        w = new waiter();
+        ev.events   = MYPOLLIN | MYPOLLOUT;
+        ev.data.ptr = w;
+        if (myepoll_ctl(epfd_, MYEPOLL_CTL_ADD, sd, &ev) < 0)
+        {
+            perror("myepoll_ctl");
+            assert(0);
+            abort();
+        }
+        waiters_[sd] = w;
+    }
+
+    /* one reader and one writer at a time, as with myread()/mywrite() */
+    if (events & MYPOLLIN)
+    {
+        assert(!w->reader);
+        w->reader = h;
+    }
+    else
+    {
+        assert((events & MYPOLLOUT) && !w->writer);
+        w->writer = h;
+    }
+}
+
+void scheduler::forget(mysocket_t sd)
+{
+    auto it = waiters_.find(sd);
+
+    if (it == waiters_.end())
+        return;
+
+    assert(!it->second->reader && !it->second->writer);
+    myepoll_ctl(epfd_, MYEPOLL_CTL_DEL, sd, NULL);
+    delete it->second;
+    waiters_.erase(it);
+}
+
+
+task<int> async_read(mysocket_t sd, void *buffer, size_t length)
+{
+    int rc;
+
+    if (mysetnonblock(sd, TRUE) < 0)
+        co_return -1;
+
+    while ((rc = myread(sd, buffer, length)) < 0 && errno == EAGAIN)
+        co_await wait_ready(sd, MYPOLLIN);
+    co_return rc;
+}
+
+task<int> async_write(mysocket_t sd, const void *buffer, size_t length)
+{
+    size_t written = 0;
+    int rc;
+
+    if (mysetnonblock(sd, TRUE) < 0)
+        co_return -1;
+
+    while (written < length)
+    {
+        if ((rc = mywrite(sd, (const char *) buffer + written,
+                          length - written)) < 0)
+        {
+            if (errno != EAGAIN)
+                co_return (written > 0) ? (int) written : -1;
+
+            co_await wait_ready(sd, MYPOLLOUT);
+            continue;
+        }
+        written += rc;
+    }
+    co_return (int) written;
+}
+
+task<mysocket_t> async_accept(mysocket_t sd, struct sockaddr *addr,
+                              int *addrlen)
+{
+    mysocket_t new_sd;
+
+    if (mysetnonblock(sd, TRUE) < 0)
+        co_return -1;
+
+    while ((new_sd = myaccept(sd, addr, addrlen)) < 0 && errno == EAGAIN)
+        co_await wait_ready(sd, MYPOLLIN);
+    co_return new_sd;
+}
+
+task<int> async_connect(mysocket_t sd, struct sockaddr *name, int namelen)
+{
+    int rc;
+
+    if (mysetnonblock(sd, TRUE) < 0)
+        co_return -1;
+
+    /* the first call starts connecting, and later ones report how it went */
+    while ((rc = myconnect(sd, name, namelen)) < 0 &&
+           (errno == EINPROGRESS || errno == EALREADY))
+        co_await wait_ready(sd, MYPOLLOUT);
+    co_return rc;
+}
+
+int close(mysocket_t sd)
+{
+    if (scheduler::current())
+        scheduler::current()->forget(sd);
+    return myclose(sd);
+}
+
+}   /* namespace mysock */
@@ -0,0 +1,281 @@
+/* mysock_coro.h--C++20 coroutine interface to mysockets.
+ *
+ * lets one thread serve many connections with straight-line code, e.g.
+ *
+ *     mysock::task<void> echo(mysocket_t sd)
+ *     {
+ *         char buf[512];
+ *         int n;
+ *
+ *         while ((n = co_await mysock::async_read(sd, buf, sizeof(buf))) > 0)
+ *         {
+ *             if (co_await mysock::async_write(sd, buf, n) < 0)
+ *                 break;
+ *         }
+ *         mysock::close(sd);
+ *     }
+ *
+ *     mysock::task<void> serve(mysocket_t listen_sd)
+ *     {
+ *         mysocket_t sd;
+ *
+ *         while ((sd = co_await mysock::async_accept(listen_sd,
+ *                                                    NULL, NULL)) >= 0)
+ *             mysock::scheduler::current()->spawn(echo(sd));
+ *     }
+ *
+ *     mysock::scheduler sched;
+ *     sched.spawn(serve(listen_sd));
+ *     sched.run();
+ *
+ * the async_*() operations return the same values as their my*()
+ * counterparts, setting errno in the same way, but suspend the calling
+ * coroutine rather than blocking the thread.  they switch the mysockets
+ * they're used on to non-blocking mode.  a suspended coroutine is resumed
+ * by its scheduler once myepoll reports the mysocket ready (see
+ * mysock_poll.c).
+ *
+ * a scheduler, and the coroutines spawned on it, belong to the thread
+ * calling run(); the async_*() operations must only be awaited from
+ * coroutines running there.  an exception escaping a coroutine terminates
+ * the process.
+ *
+ * this is the only part of the mysocket layer that needs C++20.
+ */
+
+#ifndef __MYSOCK_CORO_H__
+#define __MYSOCK_CORO_H__
+
+#include <assert.h>
+#include <exception>
+#include <coroutine>
+#include <deque>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include "mysock.h"
+
+
+namespace mysock
+{
+
+class scheduler;
+
+template <typename T> class task;
+
+
+/* state shared by every task's promise.  a task runs when it's first
+ * awaited, and when it finishes, resumes the coroutine awaiting it.  a
+ * spawned task has no one awaiting it, and frees itself instead.
+ */
+class task_promise_base
+{
+public:
+    struct final_awaiter
+    {
+        bool await_ready() noexcept { return false; }
+
+        template <typename Promise>
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<Promise> h) noexcept
+        {
+            task_promise_base &p = h.promise();
+            std::coroutine_handle<> next = p.continuation_;
+
+            if (p.owner_)
+            {
+                p.task_done();
+                h.destroy();
+            }
+            return next ? next : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept { }
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() noexcept { std::terminate(); }
+
+    std::coroutine_handle<> continuation_;
+    scheduler              *owner_ = nullptr;   /* set if spawned */
+
+private:
+    void task_done();
+};
+
+template <typename T>
+class task_promise : public task_promise_base
+{
+public:
+    task<T> get_return_object() noexcept;
+    void return_value(T value) noexcept { value_ = std::move(value); }
+
+    T value_;
+};
+
+template <>
+class task_promise<void> : public task_promise_base
+{
+public:
+    task<void> get_return_object() noexcept;
+    void return_void() noexcept { }
+};
+
+
+/* a coroutine returning T, which starts when it's co_await-ed (or
+ * spawned)
+ */
+template <typename T = void>
+class task
+{
+public:
+    typedef task_promise<T> promise_type;
+    typedef std::coroutine_handle<promise_type> handle_type;
+
+    explicit task(handle_type h) noexcept : handle_(h) { }
+    task(task &&other) noexcept : handle_(std::exchange(other.handle_, {})) { }
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+
+    ~task()
+    {
+        if (handle_)
+            handle_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        handle_.promise().continuation_ = awaiting;
+        return handle_;
+    }
+
+    T await_resume() noexcept
+    {
+        if constexpr (!std::is_void_v<T>)
+            return std::move(handle_.promise().value_);
+    }
+
+    /* give up ownership of the coroutine (for scheduler::spawn()) */
+    handle_type release() noexcept { return std::exchange(handle_, {}); }
+
+private:
+    handle_type handle_;
+};
+
+template <typename T>
+inline task<T> task_promise<T>::get_return_object() noexcept
+{
+    return task<T>(task<T>::handle_type::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object() noexcept
+{
+    return task<void>(task<void>::handle_type::from_promise(*this));
+}
+
+
+/* runs spawned tasks, resuming coroutines as their mysockets become
+ * ready.  every mysocket a coroutine waits on is registered with the
+ * scheduler's epoll set until it's closed with mysock::close().
+ */
+class scheduler
+{
+public:
+    scheduler();
+    ~scheduler();
+
+    scheduler(const scheduler &) = delete;
+    scheduler &operator=(const scheduler &) = delete;
+
+    /* start t (once run() gets to it), and let it run to completion on
+     * its own
+     */
+    void spawn(task<void> t);
+
+    /* run until every spawned task has finished */
+    void run();
+
+    /* the scheduler whose run() the calling thread is in, if any */
+    static scheduler *current() noexcept { return current_; }
+
+    /* suspend h until sd is ready for events (MYPOLLIN or MYPOLLOUT), or
+     * has an error or hangup to report.  used by the async_*() operations.
+     */
+    void wait_for(mysocket_t sd, unsigned int events,
+                  std::coroutine_handle<> h);
+
+    /* sd is about to be closed; stop watching it */
+    void forget(mysocket_t sd);
+
+private:
+    friend class task_promise_base;
+
+    /* the coroutines waiting on one mysocket */
+    struct waiter
+    {
+        std::coroutine_handle<> reader, writer;
+    };
+
+    int                                      epfd_;
+    unsigned int                             num_tasks_;
+    std::deque<std::coroutine_handle<> >     ready_;
+    std::unordered_map<mysocket_t, waiter *> waiters_;
+
+    static thread_local scheduler *current_;
+};
+
+inline void task_promise_base::task_done()
+{
+    assert(owner_ && owner_->num_tasks_ > 0);
+    --owner_->num_tasks_;
+}
+
+
+/* awaitable for a mysocket's readiness, for building other operations */
+struct readiness
+{
+    mysocket_t   sd;
+    unsigned int events;
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        assert(scheduler::current());
+        scheduler::current()->wait_for(sd, events, h);
+    }
+
+    void await_resume() const noexcept { }
+};
+
+inline readiness wait_ready(mysocket_t sd, unsigned int events)
+{
+    return readiness{sd, events};
+}
+
+
+/* like myread(), returning whatever has arrived (at least one byte),
+ * or 0 at EOF
+ */
+task<int> async_read(mysocket_t sd, void *buffer, size_t length);
+
+/* like mywrite(), returning once all of buffer has been queued (or the
+ * connection has gone away, in which case this returns the number of
+ * bytes queued, or -1 if there were none)
+ */
+task<int> async_write(mysocket_t sd, const void *buffer, size_t length);
+
+task<mysocket_t> async_accept(mysocket_t sd, struct sockaddr *addr,
+                              int *addrlen);
+task<int> async_connect(mysocket_t sd, struct sockaddr *name, int namelen);
+
+/* myclose(), first removing sd from the current scheduler */
+int close(mysocket_t sd);
+
+}   /* namespace mysock */
+
+#endif  /* __MYSOCK_CORO_H__ */
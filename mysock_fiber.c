@@ -0,0 +1,486 @@
+/* mysock_fiber.c--run transport 'threads' as fibers on a few OS threads.
+ *
+ * by default, each connection's transport runs on a thread of its own,
+ * blocked in stcp_wait_for_event() inside transport_init() most of the
+ * time.  the reactor (mysock_reactor.c) avoids that by driving the
+ * transport as a state machine; fibers keep the blocking style instead.
+ * after myfibers(), each new transport runs in a fiber (a ucontext with a
+ * small stack of its own), and the fibers are shared out among a fixed
+ * pool of carrier threads.
+ *
+ * a fiber stays on the carrier it was given for its whole life, so
+ * thread-local state (errno, the packet pool's cache) is never seen to
+ * change underneath it.  when the transport would wait on data_ready_cond,
+ * or for room in the application's queue, its fiber yields to the carrier
+ * instead (_mysock_fiber_wait()), and is put back on the carrier's run
+ * queue by whoever would have signalled the condition
+ * (_mysock_fiber_wake()), or when its deadline passes.  anything else the
+ * transport blocks in--a mutex, or a network write--holds up the carrier,
+ * just as it would hold up a thread.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+
+
+#define FIBER_MAX_CARRIERS 64
+
+/* each fiber's stack, not counting the guard page below it */
+#define FIBER_STACK_SIZE   (64 * 1024)
+
+enum { FIBER_NEW, FIBER_RUNNABLE, FIBER_RUNNING, FIBER_WAITING, FIBER_DONE };
+
+struct carrier;
+
+typedef struct fiber
+{
+    ucontext_t       uctx;
+    char            *stack;         /* mmap()ed, guard page included */
+    size_t           stack_len;
+    void          *(*start)(void *);
+    void            *arg;
+    struct carrier  *carrier;
+
+    /* protected by the carrier's lock */
+    int              state;         /* FIBER_* */
+    bool_t           timed_out;     /* woken by its deadline passing */
+    struct timespec  deadline;
+    int              timer_index;   /* in the carrier's timer heap, or -1 */
+    struct fiber    *next;          /* carrier's run queue */
+    bool_t           finished;      /* the carrier is done with it */
+    bool_t           detached;
+} fiber_t;
+
+typedef struct carrier
+{
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;          /* a fiber became runnable */
+    pthread_cond_t   done_cond;     /* a fiber finished */
+    fiber_t         *run_head, *run_tail;
+
+    /* waiting fibers with deadlines, as a binary min-heap */
+    fiber_t        **timers;
+    unsigned int     num_timers, max_timers;
+
+    ucontext_t       uctx;          /* the carrier's own context */
+} carrier_t;
+
+
+static carrier_t      *carriers;
+static unsigned int    num_carriers;    /* zero unless fibers are on */
+static unsigned int    next_carrier;    /* updated atomically */
+static pthread_mutex_t fiber_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread fiber_t *current_fiber;
+
+
+static void *_fiber_carrier_func(void *arg);
+
+
+/* start the carriers.  num_threads of zero picks one per online CPU.
+ * fails with EBUSY if they're already running with a different number.
+ */
+int _mysock_fiber_start_carriers(unsigned int count)
+{
+    unsigned int k;
+    int rc = 0;
+
+    if (count == 0)
+    {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        count = (ncpu > 0) ? (unsigned int) ncpu : 1;
+    }
+    count = MIN(count, FIBER_MAX_CARRIERS);
+
+    PTHREAD_CALL(pthread_mutex_lock(&fiber_lock));
+    if (num_carriers)
+    {
+        if (num_carriers != count)
+        {
+            errno = EBUSY;
+            rc = -1;
+        }
+        goto done;
+    }
+
+    carriers = (carrier_t *) calloc(count, sizeof(carrier_t));
+    assert(carriers);
+
+    for (k = 0; k < count; ++k)
+    {
+        PTHREAD_CALL(pthread_mutex_init(&carriers[k].lock, NULL));
+        PTHREAD_CALL(pthread_cond_init(&carriers[k].cond, NULL));
+        PTHREAD_CALL(pthread_cond_init(&carriers[k].done_cond, NULL));
+        (void) _mysock_create_thread(_fiber_carrier_func, &carriers[k], TRUE);
+    }
+
+    /* published last; connections only look at the carriers once it's set */
+    num_carriers = count;
+
+done:
+    PTHREAD_CALL(pthread_mutex_unlock(&fiber_lock));
+    return rc;
+}
+
+bool_t _mysock_fibers_enabled(void)
+{
+    return num_carriers != 0;
+}
+
+
+/* timer heap, ordered by deadline.  the caller holds the carrier's lock. */
+static bool_t _fiber_before(const fiber_t *a, const fiber_t *b)
+{
+    return (a->deadline.tv_sec < b->deadline.tv_sec ||
+            (a->deadline.tv_sec == b->deadline.tv_sec &&
+             a->deadline.tv_nsec < b->deadline.tv_nsec));
+}
+
+static void _fiber_timer_set(carrier_t *c, unsigned int k, fiber_t *f)
+{
+    c->timers[k] = f;
+    f->timer_index = (int) k;
+}
+
+static void _fiber_timer_sift(carrier_t *c, unsigned int k)
+{
+    fiber_t *f = c->timers[k];
+    unsigned int child;
+
+    /* up... */
+    while (k > 0 && _fiber_before(f, c->timers[(k - 1) / 2]))
+    {
+        _fiber_timer_set(c, k, c->timers[(k - 1) / 2]);
+        k = (k - 1) / 2;
+    }
+
+    /* ...or down */
+    while ((child = 2 * k + 1) < c->num_timers)
+    {
+        if (child + 1 < c->num_timers &&
+            _fiber_before(c->timers[child + 1], c->timers[child]))
+            ++child;
+        if (!_fiber_before(c->timers[child], f))
+            break;
+        _fiber_timer_set(c, k, c->timers[child]);
+        k = child;
+    }
+    _fiber_timer_set(c, k, f);
+}
+
+static void _fiber_timer_add(carrier_t *c, fiber_t *f)
+{
+    if (c->num_timers == c->max_timers)
+    {
+        c->max_timers = MAX(2 * c->max_timers, 16);
+        c->timers = (fiber_t **)
+            realloc(c->timers, c->max_timers * sizeof(fiber_t *));
+        assert(c->timers);
+    }
+
+    c->timers[c->num_timers] = f;
+    _fiber_timer_sift(c, c->num_timers++);
+}
+
+static void _fiber_timer_remove(carrier_t *c, fiber_t *f)
+{
+    unsigned int k = (unsigned int) f->timer_index;
+
+    if (f->timer_index < 0)
+        return;
+
+    f->timer_index = -1;
+    if (k != --c->num_timers)
+    {
+        c->timers[k] = c->timers[c->num_timers];
+        _fiber_timer_sift(c, k);
+    }
+}
+
+/* the caller holds the carrier's lock */
+static void _fiber_make_runnable(carrier_t *c, fiber_t *f)
+{
+    assert(f->state == FIBER_WAITING || f->state == FIBER_NEW);
+
+    _fiber_timer_remove(c, f);
+    f->state = FIBER_RUNNABLE;
+    f->next  = NULL;
+    if (c->run_tail)
+        c->run_tail->next = f;
+    else
+        c->run_head = f;
+    c->run_tail = f;
+
+    PTHREAD_CALL(pthread_cond_signal(&c->cond));
+}
+
+/* wake the fibers whose deadlines have passed; the caller holds the
+ * carrier's lock
+ */
+static void _fiber_expire_timers(carrier_t *c)
+{
+    struct timeval now;
+    fiber_t *f;
+
+    if (!c->num_timers)
+        return;
+
+    gettimeofday(&now, NULL);
+    while (c->num_timers > 0 &&
+           ((f = c->timers[0])->deadline.tv_sec < now.tv_sec ||
+            (f->deadline.tv_sec == now.tv_sec &&
+             f->deadline.tv_nsec <= (long) now.tv_usec * 1000)))
+    {
+        f->timed_out = TRUE;
+        _fiber_make_runnable(c, f);
+    }
+}
+
+
+static void _fiber_free(fiber_t *f)
+{
+    assert(f && f->finished);
+    munmap(f->stack, f->stack_len);
+    free(f);
+}
+
+/* f has returned from its start function, and its carrier has switched
+ * back to its own stack
+ */
+static void _fiber_finished(carrier_t *c, fiber_t *f)
+{
+    bool_t detached;
+
+    PTHREAD_CALL(pthread_mutex_lock(&c->lock));
+    f->finished = TRUE;
+    if (!(detached = f->detached))
+        PTHREAD_CALL(pthread_cond_broadcast(&c->done_cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&c->lock));
+
+    if (detached)
+        _fiber_free(f);
+}
+
+static void *_fiber_carrier_func(void *arg)
+{
+    carrier_t *c = (carrier_t *) arg;
+    fiber_t *f;
+    int rc;
+
+    assert(c);
+
+    for (;;)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&c->lock));
+        for (;;)
+        {
+            _fiber_expire_timers(c);
+            if (c->run_head)
+                break;
+
+            if (c->num_timers > 0)
+            {
+                rc = pthread_cond_timedwait(&c->cond, &c->lock,
+                                            &c->timers[0]->deadline);
+                if (rc != ETIMEDOUT)
+                    PTHREAD_CALL(rc);
+            }
+            else
+            {
+                PTHREAD_CALL(pthread_cond_wait(&c->cond, &c->lock));
+            }
+        }
+
+        f = c->run_head;
+        if ((c->run_head = f->next) == NULL)
+            c->run_tail = NULL;
+        f->state = FIBER_RUNNING;
+        PTHREAD_CALL(pthread_mutex_unlock(&c->lock));
+
+        /* run it until it waits or finishes */
+        current_fiber = f;
+        if (swapcontext(&c->uctx, &f->uctx) < 0)
+        {
+            assert(0);
+            abort();
+        }
+        current_fiber = NULL;
+
+        if (f->state == FIBER_DONE)
+            _fiber_finished(c, f);
+    }
+
+    /*NOTREACHED*/
+    return NULL;
+}
+
+/* entry point of every fiber; returning switches back to the carrier
+ * (through uc_link)
+ */
+static void _fiber_main(void)
+{
+    fiber_t *f = current_fiber;
+
+    assert(f);
+    (void) f->start(f->arg);
+
+    PTHREAD_CALL(pthread_mutex_lock(&f->carrier->lock));
+    f->state = FIBER_DONE;
+    PTHREAD_CALL(pthread_mutex_unlock(&f->carrier->lock));
+}
+
+/* create a fiber to run start(arg) on one of the carriers.  it doesn't
+ * run until _mysock_fiber_run() is called, so the caller can record it
+ * first.
+ */
+fiber_t *_mysock_fiber_create(void *(*start)(void *), void *arg)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    fiber_t *f;
+    carrier_t *c;
+
+    assert(start && num_carriers);
+
+    f = (fiber_t *) calloc(1, sizeof(fiber_t));
+    assert(f);
+
+    /* round-robin, as connections come and go in no particular order */
+    c = &carriers[__sync_fetch_and_add(&next_carrier, 1) % num_carriers];
+
+    f->stack_len = FIBER_STACK_SIZE + page;
+    f->stack = (char *) mmap(NULL, f->stack_len, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(f->stack != MAP_FAILED);
+
+    /* catch overflow rather than scribbling over a neighbour */
+    if (mprotect(f->stack, page, PROT_NONE) < 0)
+        assert(0);
+
+    if (getcontext(&f->uctx) < 0)
+    {
+        assert(0);
+        abort();
+    }
+    f->uctx.uc_stack.ss_sp   = f->stack + page;
+    f->uctx.uc_stack.ss_size = FIBER_STACK_SIZE;
+    f->uctx.uc_link          = &c->uctx;
+    makecontext(&f->uctx, _fiber_main, 0);
+
+    f->start       = start;
+    f->arg         = arg;
+    f->carrier     = c;
+    f->state       = FIBER_NEW;     /* wakeups are ignored until it runs */
+    f->timer_index = -1;
+
+    return f;
+}
+
+void _mysock_fiber_run(fiber_t *f)
+{
+    assert(f);
+
+    PTHREAD_CALL(pthread_mutex_lock(&f->carrier->lock));
+    assert(f->state == FIBER_NEW);
+    _fiber_make_runnable(f->carrier, f);
+    PTHREAD_CALL(pthread_mutex_unlock(&f->carrier->lock));
+}
+
+/* the fiber the calling thread is running, if any */
+fiber_t *_mysock_fiber_self(void)
+{
+    return current_fiber;
+}
+
+/* yield the current fiber until _mysock_fiber_wake() is called for it, or
+ * abstime (if not NULL) passes.  like pthread_cond_timedwait(), lock is
+ * held on entry and on return, and released meanwhile.  returns FALSE if
+ * the time ran out.
+ */
+bool_t _mysock_fiber_wait(pthread_mutex_t *lock, const struct timespec *abstime)
+{
+    fiber_t *f = current_fiber;
+    carrier_t *c;
+
+    assert(f && lock);
+    c = f->carrier;
+
+    /* anyone waking us needs lock, so can't miss this */
+    PTHREAD_CALL(pthread_mutex_lock(&c->lock));
+    f->state     = FIBER_WAITING;
+    f->timed_out = FALSE;
+    if (abstime)
+    {
+        f->deadline = *abstime;
+        _fiber_timer_add(c, f);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&c->lock));
+
+    PTHREAD_CALL(pthread_mutex_unlock(lock));
+    if (swapcontext(&f->uctx, &c->uctx) < 0)
+    {
+        assert(0);
+        abort();
+    }
+    PTHREAD_CALL(pthread_mutex_lock(lock));
+
+    return !f->timed_out;
+}
+
+/* make f runnable if it's waiting in _mysock_fiber_wait().  the caller
+ * holds the lock f waits with.
+ */
+void _mysock_fiber_wake(fiber_t *f)
+{
+    carrier_t *c;
+
+    assert(f);
+    c = f->carrier;
+
+    PTHREAD_CALL(pthread_mutex_lock(&c->lock));
+    if (f->state == FIBER_WAITING)
+        _fiber_make_runnable(c, f);
+    PTHREAD_CALL(pthread_mutex_unlock(&c->lock));
+}
+
+/* wait for f to finish, then free it, as with pthread_join() */
+void _mysock_fiber_join(fiber_t *f)
+{
+    carrier_t *c;
+
+    assert(f && f != current_fiber && !f->detached);
+    c = f->carrier;
+
+    PTHREAD_CALL(pthread_mutex_lock(&c->lock));
+    while (!f->finished)
+        PTHREAD_CALL(pthread_cond_wait(&c->done_cond, &c->lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&c->lock));
+
+    _fiber_free(f);
+}
+
+/* let f free itself when it finishes, as with pthread_detach() */
+void _mysock_fiber_detach(fiber_t *f)
+{
+    carrier_t *c;
+    bool_t finished;
+
+    assert(f && !f->detached);
+    c = f->carrier;
+
+    PTHREAD_CALL(pthread_mutex_lock(&c->lock));
+    if (!(finished = f->finished))
+        f->detached = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&c->lock));
+
+    if (finished)
+        _fiber_free(f);
+}
@@ -12,6 +12,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sys/time.h>
 #include "mysock.h"
 #include "network_io.h"
 
@@ -40,6 +41,78 @@ static INLINE void _pthread_call(int pthread_retval)
     #define MIN(a,b)    ((a) < (b) ? (a) : (b))
 #endif
 
+#ifndef MAX
+    #define MAX(a,b)    ((a) > (b) ? (a) : (b))
+#endif
+
+/* busy-polling (see mysetbusypoll()).  a waiter spins, without holding any
+ * locks, until the condition it's waiting for looks true or its budget runs
+ * out, then rechecks and blocks under the lock as usual:
+ *
+ *     _mysock_busy_poll_start(&bp, usec, abstime);
+ *     while (_mysock_queue_empty(pq) && _mysock_busy_poll_continue(&bp))
+ *         ;
+ */
+typedef struct
+{
+    struct timeval deadline;
+    unsigned int   spins;
+} busy_poll_t;
+
+/* spins between checks of the clock */
+#define BUSY_POLL_CLOCK_INTERVAL 64
+
+#define BUSY_POLL_READ(x) (*(volatile __typeof__(x) *) &(x))
+
+#if defined(__i386__) || defined(__x86_64__)
+    #define BUSY_POLL_RELAX() __asm__ __volatile__("pause" ::: "memory")
+#else
+    #define BUSY_POLL_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/* begin spinning for up to usec microseconds, or until abstime (if not
+ * NULL), whichever is sooner
+ */
+static INLINE void _mysock_busy_poll_start(busy_poll_t *bp,
+                                           unsigned int usec,
+                                           const struct timespec *abstime)
+{
+    gettimeofday(&bp->deadline, NULL);
+    bp->deadline.tv_sec  += usec / 1000000;
+    bp->deadline.tv_usec += usec % 1000000;
+    if (bp->deadline.tv_usec >= 1000000)
+    {
+        ++bp->deadline.tv_sec;
+        bp->deadline.tv_usec -= 1000000;
+    }
+
+    if (abstime &&
+        (abstime->tv_sec < bp->deadline.tv_sec ||
+         (abstime->tv_sec == bp->deadline.tv_sec &&
+          abstime->tv_nsec / 1000 < bp->deadline.tv_usec)))
+    {
+        bp->deadline.tv_sec  = abstime->tv_sec;
+        bp->deadline.tv_usec = abstime->tv_nsec / 1000;
+    }
+    bp->spins = 0;
+}
+
+/* returns FALSE once the budget is spent */
+static INLINE bool_t _mysock_busy_poll_continue(busy_poll_t *bp)
+{
+    struct timeval now;
+
+    BUSY_POLL_RELAX();
+    if (bp->spins++ % BUSY_POLL_CLOCK_INTERVAL)
+        return TRUE;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec < bp->deadline.tv_sec ||
+            (now.tv_sec == bp->deadline.tv_sec &&
+             now.tv_usec < bp->deadline.tv_usec));
+}
+
+
 #ifdef DEBUG
     /* usage:  DEBUG_LOG((fmt string, args, ...)) */
     #define DEBUG_LOG(args) { printf args; fflush(stdout); }
@@ -48,20 +121,149 @@ static INLINE void _pthread_call(int pthread_retval)
 #endif
 
 
-/* packet/buffer queue */
+/* shared, reference-counted buffer (mybuf_t in mysock.h) */
+struct mybuf
+{
+    char                *data;
+    size_t               length;
+    volatile unsigned int refcnt;   /* updated atomically */
+};
+
+#define CACHE_LINE_SIZE 64
+#define CACHE_ALIGNED   __attribute__((aligned(CACHE_LINE_SIZE)))
+
+/* a zero-copy write (see mywrite_zerocopy()).  it rides in its queue node
+ * until the transport has taken all of its data, and then waits on the
+ * context's zc_unacked list for the peer's acknowledgement.
+ */
+typedef struct zc_write
+{
+    const void      *buffer;
+    size_t           length;
+    size_t           end;       /* stream offset just past its last byte */
+    mywrite_done_t   done;
+    void            *arg;
+    struct zc_write *next;
+} zc_write_t;
+
+/* packet/buffer queue node.  a node either owns a private copy of its
+ * data, refers to part of a shared buffer (if shared is set), holding a
+ * reference to it, or refers to the application's own buffer (if zc is
+ * set).  nodes come from the packet buffer pool (see mysock_pool.c), with
+ * room for MAX_IP_PAYLOAD_LEN bytes of data; larger data is kept in
+ * heap_data instead.
+ *
+ * data is the consumer's read cursor:  a partial dequeue just moves it on.
+ * on the application-facing queues, the producer may add more data past
+ * the end of the node at the tail while it's open (see packet_queue_t),
+ * so there data_len is only updated atomically.
+ */
 typedef struct packet_queue_node
 {
     char                     *data;
     size_t                    data_len;
-    struct packet_queue_node *next;
+    mybuf_t                  *shared;
+    zc_write_t               *zc;
+    char                     *heap_data;
 } packet_queue_node_t;
 
+/* packet queues are bounded rings, each with exactly one producing and one
+ * consuming thread (see mysock.c).  the last PACKET_QUEUE_RESERVED slots
+ * are only used by zero-length (EOF) markers, so those never wait for room.
+ */
+#define PACKET_QUEUE_SLOTS    256
+#define PACKET_QUEUE_RESERVED 4
+
+#if (PACKET_QUEUE_SLOTS & (PACKET_QUEUE_SLOTS - 1)) != 0
+    #error PACKET_QUEUE_SLOTS should be a power of two
+#endif
+
+/* the most received data app_send_queue holds for the application.  the
+ * transport advertises no more receive window than is left of this, but
+ * it's larger than any window, so a myrecvfile() can collect a whole
+ * MYRECVFILE_CHUNK before writing it out.
+ */
+#define APP_SEND_QUEUE_LIMIT  (2 * MYRECVFILE_CHUNK)
+
+/* _mysock_dequeue_file() can write out a whole queue at once */
+#define MYSOCK_FILE_IOV PACKET_QUEUE_SLOTS
+
+/* the thread at either end of a queue */
+enum { QUEUE_END_APP, QUEUE_END_TRANSPORT, QUEUE_END_NETWORK };
+
+/* packet_queue_t fill_state */
+enum { FILL_NONE, FILL_OPEN, FILL_BUSY };
+
 typedef struct
 {
-    packet_queue_node_t *head;
-    packet_queue_node_t *tail;
+    /* written only by the producer */
+    volatile unsigned int tail CACHE_ALIGNED;
+    volatile size_t       enqueued;     /* total bytes ever queued */
+
+    /* the application-facing queues are byte streams:  small pieces of
+     * data are added to the end of the pooled node at the tail (fill_node,
+     * queued in slot fill_slot), while it has room, rather than each
+     * taking a node of its own.  fill_state says whether that node is
+     * still open; the consumer closes it before it pops it, and the
+     * producer marks it busy while adding to it.
+     */
+    volatile int          fill_state;   /* FILL_* */
+    volatile unsigned int fill_slot;
+    packet_queue_node_t  *fill_node;
+    char                 *fill_end;
+    size_t                fill_room;
+    bool_t                stream;
+
+    /* the most unread data the producer lets build up (0 if it's only
+     * limited by the slots); a queue holding that much counts as full.
+     * app_send_queue's is APP_SEND_QUEUE_LIMIT.
+     */
+    volatile size_t       limit;
+
+    /* written only by the consumer */
+    volatile unsigned int head CACHE_ALIGNED;
+    volatile size_t       dequeued;     /* total bytes ever dequeued */
+
+    /* an application thread blocked on the queue (myread() waiting for
+     * consumer_need bytes, or mywrite() waiting for room) sleeps on
+     * wait_cond.  the transport sleeps on the context's data_ready_cond
+     * instead, and the network poller stops watching its socket.
+     * producer_waiting is set while the producer waits for room.
+     */
+    volatile size_t       consumer_need CACHE_ALIGNED;
+    volatile bool_t       producer_waiting;
+    pthread_mutex_t       wait_lock;
+    pthread_cond_t        wait_cond;
+
+    /* the buffers of a blocked myread(), posted under wait_lock for the
+     * producer to place data in directly (see _mysock_place_direct()).
+     * placed bytes have been put there, from posted_off bytes into
+     * posted_iov, of the posted_room the read has in all.
+     */
+    const struct iovec * volatile posted_iov;
+    size_t                posted_off;
+    size_t                posted_room;
+    size_t                placed;
+    unsigned char         producer, consumer;   /* QUEUE_END_* */
+
+    packet_queue_node_t  *slots[PACKET_QUEUE_SLOTS];
 } packet_queue_t;
 
+/* per-mysocket tuning options (MYSO_* in mysock.h) */
+typedef struct
+{
+    size_t          snd_buf;
+    unsigned int    rcv_buf;        /* 0:  the transport profile's window */
+    size_t          rcv_lowat;
+    size_t          snd_lowat;
+    bool_t          nodelay;
+    bool_t          cork;
+    unsigned int    maxseg;         /* 0:  the transport profile's MSS */
+    int             congestion;     /* MYCC_* */
+    unsigned int    keepalive;      /* idle seconds, or 0 */
+    int             profile;        /* MYPROFILE_* */
+} mysock_opts_t;
+
 /* mysocket context (and the arguments provided to the transport layer
  * thread).  most of this is mysock/network layer working state, with STCP
  * working state maintained separately by the student.  there is one instance
@@ -98,20 +300,100 @@ typedef struct mysock_context
     pthread_t       transport_thread;
     bool_t          transport_thread_started;
 
-    /* is data ready from either network or the app? */
+    /* in reactor mode, the connection is run by a reactor worker instead
+     * (see mysock_reactor.c).  this is set before the transport starts,
+     * and lives as long as the context.
+     */
+    struct reactor_conn *reactor;
+
+    /* with fibers on, the transport runs in a fiber instead of a thread
+     * (see mysock_fiber.c).  it's joined or detached just as the thread
+     * would be.
+     */
+    struct fiber   *transport_fiber;
+
+    /* asynchronous close.  once myclose() has been called on a connection
+     * whose transport thread is still running, the mysocket is 'orphaned':
+     * myclose() returns straight away, and the transport thread frees the
+     * context when the close handshake completes.  both flags are protected
+     * by data_ready_lock.
+     */
+    bool_t          transport_done;     /* transport_init() has returned */
+    bool_t          orphaned;
+
+    /* is data ready from either network or the app?  the transport sets
+     * transport_sleeping (under data_ready_lock) while it waits on
+     * data_ready_cond, so producers only signal it when needed.
+     */
     pthread_cond_t  data_ready_cond;
     pthread_mutex_t data_ready_lock;
+    volatile bool_t transport_sleeping;
     bool_t          close_requested;    /* myclose() called by app? */
+    bool_t          app_closed;         /* ...and it's no longer reading */
     bool_t          eof;                /* true once peer finishes writing */
 
+    /* socket options (see mysetsockopt()), protected by data_ready_lock */
+    mysock_opts_t   opts;
+
+    /* the transport holding back a partial segment asks to hear about
+     * application data only once this much is queued (see
+     * stcp_app_data_lowat()).  protected by data_ready_lock.
+     */
+    size_t          app_data_lowat;
+
+    /* the transport waiting to reopen its receive window asks to hear once
+     * the application has no more than this much data left unread (see
+     * stcp_app_window_lowat()).  protected by data_ready_lock.
+     */
+    size_t          app_window_unread;
+
+    /* a mywrite() waiting for send buffer space sets snd_need to the
+     * number of bytes it wants (under app_recv_queue's wait_lock), and
+     * sleeps on that queue's wait_cond.
+     */
+    volatile size_t snd_need;
+    bool_t          nonblocking;        /* see mysetnonblock() */
+
+    /* busy-poll budget in microseconds, or zero to block straight away (see
+     * mysetbusypoll()).  read without the lock by waiters.
+     */
+    unsigned int    busy_poll_usec;
+
     /* data sent to peer is sent immediately, so no queue is needed for that
      * case.  we keep a queue for the other three cases:  data coming from
      * peer, data sent to the app for consumption with myread(), and data
-     * coming from the app via mywrite().
+     * coming from the app via mywrite().  the network poller produces the
+     * first, the transport the second and consumes the other two, and the
+     * application is at the remaining ends; concurrent mywrite() (or
+     * myread()) calls on one mysocket aren't supported.
      */
     packet_queue_t  network_recv_queue; /* data coming from peer */
     packet_queue_t  app_send_queue; /* data to be passed up to app */
     packet_queue_t  app_recv_queue; /* data coming from app */
+
+    /* zero-copy writes sent but not yet acknowledged, oldest first, and
+     * the number of bytes of application data the peer has acknowledged.
+     * these belong to the transport, though mywrite() reads data_acked to
+     * see how full the send buffer is.
+     */
+    zc_write_t     *zc_unacked, *zc_unacked_tail;
+    volatile size_t data_acked;
+
+    /* set by a non-blocking myconnect() until it has reported the outcome */
+    bool_t          connect_pending;
+
+    /* for listening mysockets, the number of connections myaccept() can
+     * take without waiting.  updated atomically.
+     */
+    volatile unsigned int accept_ready;
+
+    /* readiness polling (see mysock_poll.c).  poll_watchers counts the
+     * mypoll() callers and epoll registrations watching the mysocket, so
+     * state changes nobody is watching cost a single load.  epoll_items
+     * is protected by the poll lock.
+     */
+    volatile unsigned int poll_watchers;
+    struct epoll_item    *epoll_items;
 } mysock_context_t;
 
 
@@ -122,23 +404,155 @@ mysock_context_t *_mysock_get_context(mysocket_t sd);
 
 void _mysock_transport_init(mysocket_t sd, bool_t is_active);
 
-int _mysock_wait_for_connection(mysock_context_t *ctx);
+bool_t _mysock_wait_for_connection(mysock_context_t *ctx, bool_t wait);
 
 void _mysock_free_context(mysock_context_t *ctx);
 
+bool_t _mysock_orphan_context(mysock_context_t *ctx);
+
+bool_t _mysock_queue_empty(const packet_queue_t *pq);
+bool_t _mysock_queue_has_room(const packet_queue_t *pq, bool_t marker);
+size_t _mysock_queue_bytes(const packet_queue_t *pq);
+bool_t _mysock_stream_ready(const packet_queue_t *pq, size_t min_len);
+bool_t _mysock_queue_wait_room(packet_queue_t *pq, bool_t marker);
+
+void _mysock_wake_transport(mysock_context_t *ctx);
+bool_t _mysock_transport_sleep(mysock_context_t      *ctx,
+                               const struct timespec *abstime);
+void _mysock_transport_signal(mysock_context_t *ctx);
+
 void _mysock_enqueue_buffer(mysock_context_t *ctx,
                             packet_queue_t   *pq,
                             const void       *packet,
                             size_t            packet_len);
 
+void _mysock_enqueue_iovec(mysock_context_t   *ctx,
+                           packet_queue_t     *pq,
+                           const struct iovec *iov,
+                           int                 iovcnt,
+                           size_t              offset,
+                           size_t              len);
+
+ssize_t _mysock_enqueue_file(mysock_context_t *ctx,
+                             packet_queue_t   *pq,
+                             int               fd,
+                             off_t             offset,
+                             size_t            len);
+
+void _mysock_enqueue_shared(mysock_context_t *ctx,
+                            packet_queue_t   *pq,
+                            mybuf_t          *buf);
+
+void _mysock_enqueue_zerocopy(mysock_context_t *ctx,
+                              packet_queue_t   *pq,
+                              zc_write_t       *zc);
+
+void _mysock_enqueue_node(mysock_context_t    *ctx,
+                          packet_queue_t      *pq,
+                          packet_queue_node_t *node);
+
+void _mysock_data_acked(mysock_context_t *ctx, size_t len);
+
+size_t _mysock_send_space(const mysock_context_t *ctx);
+int _mysock_wait_send_space(mysock_context_t *ctx, size_t need);
+
+void _mysock_buf_hold(mybuf_t *buf);
+void _mysock_buf_release(mybuf_t *buf);
+
+packet_queue_node_t *_mysock_dequeue_node(mysock_context_t *ctx,
+                                          packet_queue_t   *pq);
+void _mysock_release_node(packet_queue_node_t *node);
+
 size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
                               packet_queue_t   *pq,
                               void             *dst,
                               size_t            max_len,
-                              bool_t            remove_partial);
+                              bool_t            gather);
+
+size_t _mysock_place_direct(mysock_context_t *ctx,
+                            packet_queue_t   *pq,
+                            const void       *data,
+                            size_t            len);
+
+size_t _mysock_dequeue_stream(mysock_context_t   *ctx,
+                              packet_queue_t     *pq,
+                              const struct iovec *iov,
+                              int                 iovcnt,
+                              size_t              min_len);
+
+ssize_t _mysock_dequeue_file(mysock_context_t *ctx,
+                             packet_queue_t   *pq,
+                             int               fd,
+                             size_t            min_len,
+                             size_t            max_len,
+                             size_t            align);
+
+size_t _mysock_splice_stream(mysock_context_t *in_ctx,
+                             packet_queue_t   *in_pq,
+                             mysock_context_t *out_ctx,
+                             packet_queue_t   *out_pq,
+                             size_t            min_len,
+                             size_t            max_len);
 
 int _mysock_bind_ephemeral(mysock_context_t *ctx);
 
+mysock_opts_t *_mysock_lock_default_opts(void);
+void _mysock_unlock_default_opts(void);
+
+void _mysock_transport_finished(mysock_context_t *ctx);
+
+/* mysock_poll.c */
+unsigned int _mysock_poll_events(mysock_context_t *ctx);
+
+void _mysock_poll_wake(mysock_context_t *ctx);
+void _mysock_poll_forget(mysock_context_t *ctx);
+
+/* tell anyone polling ctx that its readiness may have changed.  the
+ * caller must have issued a full barrier since changing it.
+ */
+static INLINE void _mysock_poll_notify(mysock_context_t *ctx)
+{
+    if (ctx->poll_watchers)
+        _mysock_poll_wake(ctx);
+}
+
+/* mysock_pool.c */
+packet_queue_node_t *_mysock_pool_alloc_node(size_t data_len);
+
+void _mysock_pool_free_node(packet_queue_node_t *node);
+size_t _mysock_pool_node_room(const packet_queue_node_t *node);
+
+/* mysock_reactor.c */
+int _mysock_reactor_start(unsigned int num_workers);
+
+bool_t _mysock_reactor_enabled(void);
+
+void _mysock_reactor_add(mysock_context_t *ctx);
+
+void _mysock_reactor_notify(mysock_context_t *ctx);
+
+void _mysock_reactor_free(mysock_context_t *ctx);
+
+/* mysock_fiber.c */
+int _mysock_fiber_start_carriers(unsigned int num_threads);
+
+bool_t _mysock_fibers_enabled(void);
+
+struct fiber *_mysock_fiber_create(void *(*start)(void *), void *arg);
+
+void _mysock_fiber_run(struct fiber *f);
+
+struct fiber *_mysock_fiber_self(void);
+
+bool_t _mysock_fiber_wait(pthread_mutex_t *lock,
+                          const struct timespec *abstime);
+
+void _mysock_fiber_wake(struct fiber *f);
+
+void _mysock_fiber_join(struct fiber *f);
+
+void _mysock_fiber_detach(struct fiber *f);
+
 pthread_t _mysock_create_thread(void *(*start)(void *args), void *args,                                         bool_t create_detached);
 
 #endif  /* __MYSOCK_INTERNAL_H__ */
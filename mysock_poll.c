@@ -0,0 +1,513 @@
+/* mysock_poll.c--readiness polling (mypoll() and the myepoll_*() family).
+ *
+ * a mysocket's readiness isn't stored anywhere; it's worked out from its
+ * queues and context whenever it's asked for (_mysock_poll_events()).
+ * instead, whichever thread changes that state--the transport, mostly--
+ * calls _mysock_poll_notify() afterwards.  that's a single load unless
+ * the mysocket is being watched, in which case the mypoll() callers are
+ * woken, and the mysocket is put on the ready list of each epoll set it's
+ * registered with.  myepoll_wait() checks just the mysockets on its ready
+ * list, so its cost doesn't grow with the size of the interest set.
+ *
+ * the interest sets, ready lists and watcher registrations are all
+ * protected by poll_lock.  a waiter counts itself among a mysocket's
+ * watchers before it looks at the mysocket, and a notifier changes the
+ * state before looking for watchers, with a barrier on both sides, so one
+ * of them always sees the other.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+
+
+/* a mysocket's registration with an epoll set */
+typedef struct epoll_item
+{
+    struct epoll_set  *ep;
+    mysock_context_t  *ctx;
+    myepoll_event_t    event;           /* events of interest, user data */
+    bool_t             ready;           /* on ep's ready list */
+
+    struct epoll_item *prev, *next;     /* ep's interest set */
+    struct epoll_item *next_ready;      /* ep's ready list */
+    struct epoll_item *next_watch;      /* ctx's registrations */
+} epoll_item_t;
+
+typedef struct epoll_set
+{
+    epoll_item_t   *items;
+    epoll_item_t   *ready, *ready_tail;
+    pthread_cond_t  ready_cond;         /* myepoll_wait() callers */
+    unsigned int    num_waiters;        /* ...how many there are */
+    bool_t          closed;             /* freed by the last waiter */
+} epoll_set_t;
+
+
+static pthread_mutex_t poll_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  poll_cond = PTHREAD_COND_INITIALIZER;  /* mypoll() */
+static unsigned int    num_pollers;     /* threads waiting in mypoll() */
+static epoll_set_t    *epoll_table[MAX_NUM_EPOLLS];
+
+
+/* the events to report for ctx right now.  called by the application. */
+unsigned int _mysock_poll_events(mysock_context_t *ctx)
+{
+    unsigned int events = 0;
+
+    assert(ctx);
+
+    if (ctx->listening)
+        return ctx->accept_ready ? MYPOLLIN : 0;
+
+    if (ctx->blocking)
+        return 0;   /* not connected yet */
+    if (ctx->stcp_errno)
+        return MYPOLLERR | MYPOLLHUP;
+
+    if (ctx->eof || _mysock_stream_ready(&ctx->app_send_queue,
+                                         ctx->opts.rcv_lowat))
+        events |= MYPOLLIN;
+
+    if (_mysock_send_space(ctx) >= ctx->opts.snd_lowat &&
+        _mysock_queue_has_room(&ctx->app_recv_queue, FALSE))
+        events |= MYPOLLOUT;
+
+    if (ctx->transport_done)
+        events |= MYPOLLIN | MYPOLLHUP;
+
+    return events;
+}
+
+/* put item on its set's ready list; the caller holds poll_lock */
+static void _poll_make_ready(epoll_item_t *item)
+{
+    epoll_set_t *ep = item->ep;
+
+    if (item->ready)
+        return;
+
+    item->ready = TRUE;
+    item->next_ready = NULL;
+    if (ep->ready_tail)
+        ep->ready_tail->next_ready = item;
+    else
+        ep->ready = item;
+    ep->ready_tail = item;
+
+    PTHREAD_CALL(pthread_cond_signal(&ep->ready_cond));
+}
+
+/* the readiness of ctx may have changed, and somebody is watching it (see
+ * _mysock_poll_notify())
+ */
+void _mysock_poll_wake(mysock_context_t *ctx)
+{
+    epoll_item_t *item;
+
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_lock));
+    for (item = ctx->epoll_items; item; item = item->next_watch)
+        _poll_make_ready(item);
+    if (num_pollers)
+        PTHREAD_CALL(pthread_cond_broadcast(&poll_cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_lock));
+}
+
+/* take item off its set's ready list; the caller holds poll_lock */
+static void _poll_unready(epoll_item_t *item)
+{
+    epoll_set_t *ep = item->ep;
+    epoll_item_t **pp, *prev = NULL;
+
+    if (!item->ready)
+        return;
+
+    for (pp = &ep->ready; *pp != item; pp = &(*pp)->next_ready)
+        prev = *pp;
+    *pp = item->next_ready;
+    if (ep->ready_tail == item)
+        ep->ready_tail = prev;
+    item->ready = FALSE;
+}
+
+/* remove item from its set and its mysocket, and free it; the caller
+ * holds poll_lock
+ */
+static void _poll_remove_item(epoll_item_t *item)
+{
+    epoll_set_t *ep = item->ep;
+    epoll_item_t **pp;
+
+    _poll_unready(item);
+
+    if (item->prev)
+        item->prev->next = item->next;
+    else
+        ep->items = item->next;
+    if (item->next)
+        item->next->prev = item->prev;
+
+    for (pp = &item->ctx->epoll_items; *pp != item; pp = &(*pp)->next_watch)
+        ;
+    *pp = item->next_watch;
+    __sync_sub_and_fetch(&item->ctx->poll_watchers, 1);
+
+    free(item);
+}
+
+/* ctx is being closed; drop it from every epoll set */
+void _mysock_poll_forget(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    if (!ctx->epoll_items)
+        return;     /* only the application registers mysockets */
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_lock));
+    while (ctx->epoll_items)
+        _poll_remove_item(ctx->epoll_items);
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_lock));
+}
+
+/* absolute time timeout milliseconds from now, for pthread_cond_timedwait() */
+static void _poll_deadline(struct timespec *ts, int timeout)
+{
+    struct timeval now;
+
+    assert(timeout > 0);
+
+    gettimeofday(&now, NULL);
+    ts->tv_sec  = now.tv_sec + timeout / 1000;
+    ts->tv_nsec = (long) now.tv_usec * 1000 + (timeout % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L)
+    {
+        ++ts->tv_sec;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/* wait on cond (under poll_lock) for a notification, until deadline if
+ * timeout is positive.  returns FALSE once the time is up.
+ */
+static bool_t _poll_wait(pthread_cond_t *cond, int timeout,
+                         const struct timespec *deadline)
+{
+    int rc;
+
+    if (timeout == 0)
+        return FALSE;
+
+    if (timeout < 0)
+    {
+        PTHREAD_CALL(pthread_cond_wait(cond, &poll_lock));
+        return TRUE;
+    }
+
+    rc = pthread_cond_timedwait(cond, &poll_lock, deadline);
+    if (rc != ETIMEDOUT)
+        PTHREAD_CALL(rc);
+    return (rc == 0);
+}
+
+/* count the caller in (or, if delta is negative, back out of) the
+ * watchers of each valid mysocket in fds
+ */
+static void _poll_watch(struct mypollfd *fds, unsigned int nfds, int delta)
+{
+    mysock_context_t *ctx;
+    unsigned int k;
+
+    for (k = 0; k < nfds; ++k)
+    {
+        if (fds[k].sd >= 0 && (ctx = _mysock_get_context(fds[k].sd)) != NULL)
+            __sync_add_and_fetch(&ctx->poll_watchers, delta);
+    }
+}
+
+int mypoll(struct mypollfd *fds, unsigned int nfds, int timeout)
+{
+    struct timespec deadline;
+    mysock_context_t *ctx;
+    unsigned int k;
+    int num_ready;
+
+    if (!fds && nfds > 0)
+    {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (timeout > 0)
+        _poll_deadline(&deadline, timeout);
+
+    _poll_watch(fds, nfds, 1);
+    __sync_synchronize();
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_lock));
+    ++num_pollers;
+    for (;;)
+    {
+        num_ready = 0;
+        for (k = 0; k < nfds; ++k)
+        {
+            fds[k].revents = 0;
+            if (fds[k].sd < 0)
+                continue;
+
+            if ((ctx = _mysock_get_context(fds[k].sd)) == NULL)
+                fds[k].revents = MYPOLLNVAL;
+            else
+                fds[k].revents = _mysock_poll_events(ctx) &
+                    (fds[k].events | MYPOLLERR | MYPOLLHUP);
+
+            if (fds[k].revents)
+                ++num_ready;
+        }
+
+        if (num_ready > 0 || !_poll_wait(&poll_cond, timeout, &deadline))
+            break;
+    }
+    --num_pollers;
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_lock));
+
+    _poll_watch(fds, nfds, -1);
+    return num_ready;
+}
+
+int myepoll_create(void)
+{
+    epoll_set_t *ep;
+    int k;
+
+    if ((ep = (epoll_set_t *) calloc(1, sizeof(epoll_set_t))) == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    PTHREAD_CALL(pthread_cond_init(&ep->ready_cond, NULL));
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_lock));
+    for (k = 0; k < MAX_NUM_EPOLLS && epoll_table[k]; ++k)
+        ;
+    if (k < MAX_NUM_EPOLLS)
+        epoll_table[k] = ep;
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_lock));
+
+    if (k == MAX_NUM_EPOLLS)
+    {
+        PTHREAD_CALL(pthread_cond_destroy(&ep->ready_cond));
+        free(ep);
+        errno = EMFILE;
+        return -1;
+    }
+    return k;
+}
+
+/* the epoll set for epfd; the caller holds poll_lock */
+static epoll_set_t *_poll_get_set(int epfd)
+{
+    return (epfd >= 0 && epfd < MAX_NUM_EPOLLS) ? epoll_table[epfd] : NULL;
+}
+
+int myepoll_ctl(int epfd, int op, mysocket_t sd, myepoll_event_t *event)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    epoll_set_t *ep;
+    epoll_item_t *item;
+    int rc = 0;
+
+    if (!ctx)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if (!event && op != MYEPOLL_CTL_DEL)
+    {
+        errno = EFAULT;
+        return -1;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_lock));
+    if ((ep = _poll_get_set(epfd)) == NULL)
+    {
+        rc = EBADF;
+        goto done;
+    }
+
+    for (item = ctx->epoll_items; item && item->ep != ep;
+         item = item->next_watch)
+        ;
+
+    switch (op)
+    {
+    case MYEPOLL_CTL_ADD:
+        if (item)
+        {
+            rc = EEXIST;
+            break;
+        }
+        if ((item = (epoll_item_t *) calloc(1, sizeof(*item))) == NULL)
+        {
+            rc = ENOMEM;
+            break;
+        }
+
+        item->ep    = ep;
+        item->ctx   = ctx;
+        item->event = *event;
+        if ((item->next = ep->items) != NULL)
+            ep->items->prev = item;
+        ep->items = item;
+        item->next_watch = ctx->epoll_items;
+        ctx->epoll_items = item;
+        __sync_add_and_fetch(&ctx->poll_watchers, 1);
+
+        /* report whatever the mysocket is ready for already */
+        _poll_make_ready(item);
+        break;
+
+    case MYEPOLL_CTL_MOD:
+        if (!item)
+        {
+            rc = ENOENT;
+            break;
+        }
+        item->event = *event;
+        _poll_make_ready(item);
+        break;
+
+    case MYEPOLL_CTL_DEL:
+        if (!item)
+        {
+            rc = ENOENT;
+            break;
+        }
+        _poll_remove_item(item);
+        break;
+
+    default:
+        rc = EINVAL;
+        break;
+    }
+
+done:
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_lock));
+    if (rc)
+    {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
+
+int myepoll_wait(int epfd, myepoll_event_t *events, int max_events,
+                 int timeout)
+{
+    struct timespec deadline;
+    epoll_set_t *ep;
+    epoll_item_t *item;
+    unsigned int revents;
+    int num_ready = 0;
+
+    if (!events || max_events <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (timeout > 0)
+        _poll_deadline(&deadline, timeout);
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_lock));
+    if ((ep = _poll_get_set(epfd)) == NULL)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&poll_lock));
+        errno = EBADF;
+        return -1;
+    }
+    ++ep->num_waiters;
+
+    for (;;)
+    {
+        /* myepoll_close() was called while we waited */
+        if (ep->closed)
+        {
+            num_ready = -1;
+            break;
+        }
+
+        /* each item is reported (at most) once per notification */
+        while (num_ready < max_events && (item = ep->ready) != NULL)
+        {
+            if ((ep->ready = item->next_ready) == NULL)
+                ep->ready_tail = NULL;
+            item->ready = FALSE;
+
+            revents = _mysock_poll_events(item->ctx) &
+                (item->event.events | MYPOLLERR | MYPOLLHUP);
+            if (revents)
+            {
+                events[num_ready].events = revents;
+                events[num_ready].data   = item->event.data;
+                ++num_ready;
+            }
+        }
+
+        if (num_ready > 0 || !_poll_wait(&ep->ready_cond, timeout, &deadline))
+            break;
+    }
+    if (--ep->num_waiters > 0 || !ep->closed)
+        ep = NULL;
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_lock));
+
+    /* the set was closed, and we were the last to leave it */
+    if (ep)
+    {
+        PTHREAD_CALL(pthread_cond_destroy(&ep->ready_cond));
+        free(ep);
+    }
+
+    if (num_ready < 0)
+        errno = EBADF;
+    return num_ready;
+}
+
+int myepoll_close(int epfd)
+{
+    epoll_set_t *ep;
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_lock));
+    if ((ep = _poll_get_set(epfd)) == NULL)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&poll_lock));
+        errno = EBADF;
+        return -1;
+    }
+
+    while (ep->items)
+        _poll_remove_item(ep->items);
+    epoll_table[epfd] = NULL;
+
+    /* anyone still waiting on the set frees it on the way out */
+    ep->closed = TRUE;
+    if (ep->num_waiters > 0)
+    {
+        PTHREAD_CALL(pthread_cond_broadcast(&ep->ready_cond));
+        ep = NULL;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_lock));
+
+    if (ep)
+    {
+        PTHREAD_CALL(pthread_cond_destroy(&ep->ready_cond));
+        free(ep);
+    }
+    return 0;
+}
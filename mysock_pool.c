@@ -0,0 +1,278 @@
+/* mysock_pool.c--packet buffer pool.
+ *
+ * every packet queued on a connection used to cost a calloc() for its
+ * node and a malloc() for its data, and the matching free()s when it was
+ * dequeued--at every hop along the way.  instead, nodes are carved out of
+ * fixed-size, cache-aligned blocks that carry MAX_IP_PAYLOAD_LEN bytes of
+ * payload inline, so an ordinary packet needs a single block.
+ *
+ * free blocks are kept in a small cache per thread, so allocating and
+ * freeing normally takes no lock.  since packets are mostly freed by a
+ * different thread from the one that queued them, a thread with too many
+ * free blocks passes a batch of them to a shared depot, from which a
+ * thread that has run out takes a batch in turn.  only when the depot is
+ * empty too are new blocks allocated from the system.  (data too large
+ * for a block is malloc()ed separately; see _mysock_pool_alloc_node().)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+
+
+/* free blocks kept by each thread, and the number moved between a thread
+ * and the depot at once
+ */
+#define POOL_CACHE_MAX   64
+#define POOL_BATCH       32
+
+/* free blocks kept in the depot; beyond this, they're returned to the
+ * system
+ */
+#define POOL_DEPOT_MAX   4096
+
+typedef struct pool_block
+{
+    packet_queue_node_t node;
+    struct pool_block  *next_free;
+    char                payload[MAX_IP_PAYLOAD_LEN] CACHE_ALIGNED;
+} pool_block_t;
+
+/* per-thread cache.  the counters are only written by the owning thread,
+ * and are read racily by mypoolstats().
+ */
+typedef struct pool_cache
+{
+    pool_block_t      *free_list;
+    unsigned int       num_free;
+
+    mypool_stats_t     stats;
+    struct pool_cache *prev, *next;     /* all live caches */
+} pool_cache_t;
+
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_block_t   *depot;           /* protected by pool_lock */
+static unsigned int    depot_len;
+static pool_cache_t   *caches;          /* protected by pool_lock */
+static mypool_stats_t  exited_stats;    /* from threads that have exited */
+
+static pthread_key_t   cache_key;
+static pthread_once_t  cache_key_once = PTHREAD_ONCE_INIT;
+static __thread pool_cache_t *thread_cache;
+
+
+static void _pool_thread_exit(void *arg);
+
+
+/* keep pool_lock usable in a child forked while another thread held it */
+static void _pool_prefork(void)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&pool_lock));
+}
+
+static void _pool_postfork(void)
+{
+    PTHREAD_CALL(pthread_mutex_unlock(&pool_lock));
+}
+
+static void _pool_create_key(void)
+{
+    PTHREAD_CALL(pthread_key_create(&cache_key, _pool_thread_exit));
+    PTHREAD_CALL(pthread_atfork(_pool_prefork,
+                                _pool_postfork, _pool_postfork));
+}
+
+static pool_cache_t *_pool_get_cache(void)
+{
+    pool_cache_t *cache;
+
+    if ((cache = thread_cache) != NULL)
+        return cache;
+
+    PTHREAD_CALL(pthread_once(&cache_key_once, _pool_create_key));
+
+    cache = (pool_cache_t *) calloc(1, sizeof(pool_cache_t));
+    assert(cache);
+    PTHREAD_CALL(pthread_setspecific(cache_key, cache));
+
+    PTHREAD_CALL(pthread_mutex_lock(&pool_lock));
+    if ((cache->next = caches) != NULL)
+        caches->prev = cache;
+    caches = cache;
+    PTHREAD_CALL(pthread_mutex_unlock(&pool_lock));
+
+    return (thread_cache = cache);
+}
+
+static void _pool_add_stats(mypool_stats_t *total, const mypool_stats_t *s)
+{
+    total->hits      += s->hits;
+    total->misses    += s->misses;
+    total->oversized += s->oversized;
+}
+
+/* give count blocks from the head of the cache's free list to the depot,
+ * returning any the depot has no room for to the system
+ */
+static void _pool_drain(pool_cache_t *cache, unsigned int count)
+{
+    pool_block_t *block;
+
+    PTHREAD_CALL(pthread_mutex_lock(&pool_lock));
+    while (count-- > 0 && (block = cache->free_list) != NULL)
+    {
+        cache->free_list = block->next_free;
+        --cache->num_free;
+
+        if (depot_len < POOL_DEPOT_MAX)
+        {
+            block->next_free = depot;
+            depot = block;
+            ++depot_len;
+        }
+        else
+        {
+            free(block);
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&pool_lock));
+}
+
+/* a thread is exiting; hand its free blocks and statistics back */
+static void _pool_thread_exit(void *arg)
+{
+    pool_cache_t *cache = (pool_cache_t *) arg;
+
+    assert(cache);
+    _pool_drain(cache, cache->num_free);
+
+    PTHREAD_CALL(pthread_mutex_lock(&pool_lock));
+    _pool_add_stats(&exited_stats, &cache->stats);
+    if (cache->prev)
+        cache->prev->next = cache->next;
+    else
+        caches = cache->next;
+    if (cache->next)
+        cache->next->prev = cache->prev;
+    PTHREAD_CALL(pthread_mutex_unlock(&pool_lock));
+
+    thread_cache = NULL;
+    free(cache);
+}
+
+/* allocate a queue node with room for data_len bytes of data, which
+ * node->data points to.  data_len of zero is fine (e.g. for a node that
+ * will refer to a shared buffer).
+ */
+packet_queue_node_t *_mysock_pool_alloc_node(size_t data_len)
+{
+    pool_cache_t *cache = _pool_get_cache();
+    pool_block_t *block;
+
+    if ((block = cache->free_list) == NULL)
+    {
+        /* refill from the depot */
+        PTHREAD_CALL(pthread_mutex_lock(&pool_lock));
+        while (cache->num_free < POOL_BATCH && (block = depot) != NULL)
+        {
+            depot = block->next_free;
+            --depot_len;
+
+            block->next_free = cache->free_list;
+            cache->free_list = block;
+            ++cache->num_free;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&pool_lock));
+    }
+
+    if ((block = cache->free_list) != NULL)
+    {
+        cache->free_list = block->next_free;
+        --cache->num_free;
+        ++cache->stats.hits;
+    }
+    else
+    {
+        void *mem;
+
+        if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(pool_block_t)) != 0)
+            mem = NULL;
+        assert(mem);
+
+        block = (pool_block_t *) mem;
+        ++cache->stats.misses;
+    }
+
+    memset(&block->node, 0, sizeof(block->node));
+    if (data_len <= sizeof(block->payload))
+    {
+        block->node.data = block->payload;
+    }
+    else
+    {
+        /* too big for the block; the node itself still comes from it */
+        block->node.data = block->node.heap_data = (char *) malloc(data_len);
+        assert(block->node.data);
+        ++cache->stats.oversized;
+    }
+
+    return &block->node;
+}
+
+/* return a node to the calling thread's cache.  any shared buffer it
+ * refers to is the caller's business.
+ */
+void _mysock_pool_free_node(packet_queue_node_t *node)
+{
+    pool_cache_t *cache = _pool_get_cache();
+    pool_block_t *block = (pool_block_t *) node;
+
+    assert(node && (void *) node == (void *) &block->node);
+
+    free(node->heap_data);
+    node->heap_data = NULL;
+
+    block->next_free = cache->free_list;
+    cache->free_list = block;
+
+    if (++cache->num_free > POOL_CACHE_MAX)
+        _pool_drain(cache, POOL_BATCH);
+}
+
+/* bytes of the node's inline payload free past the end of its data, which
+ * more data may be added to; none if its data isn't kept inline
+ */
+size_t _mysock_pool_node_room(const packet_queue_node_t *node)
+{
+    const pool_block_t *block = (const pool_block_t *) node;
+    const char *end;
+
+    assert(node);
+
+    if (node->heap_data || node->shared || node->zc)
+        return 0;
+
+    end = node->data + node->data_len;
+    assert(end >= block->payload &&
+           end <= block->payload + sizeof(block->payload));
+    return block->payload + sizeof(block->payload) - end;
+}
+
+/* report pool statistics, summed over all threads */
+void mypoolstats(mypool_stats_t *stats)
+{
+    pool_cache_t *cache;
+
+    assert(stats);
+
+    PTHREAD_CALL(pthread_mutex_lock(&pool_lock));
+    *stats = exited_stats;
+    for (cache = caches; cache; cache = cache->next)
+        _pool_add_stats(stats, &cache->stats);
+    stats->depot_free = depot_len;
+    PTHREAD_CALL(pthread_mutex_unlock(&pool_lock));
+}
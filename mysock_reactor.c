@@ -0,0 +1,449 @@
+/* mysock_reactor.c--run many connections' transports on a few threads.
+ *
+ * by default, each connection gets its own thread, which spends its life
+ * blocked in stcp_wait_for_event() inside transport_init().  in reactor
+ * mode, a fixed pool of worker threads runs the transport instead, through
+ * its event-driven interface (transport_open() and friends in transport.h).
+ * each connection is assigned to a worker by hashing its mysocket
+ * descriptor, and stays there for its lifetime, so its transport state is
+ * only ever touched by one thread.
+ *
+ * a worker sleeps until one of its connections becomes ready:  whoever
+ * queues data or a close request for a connection calls
+ * _mysock_reactor_notify(), which puts it on its worker's ready list.  the
+ * worker polls the connection's events without blocking and dispatches
+ * them, and also wakes for the earliest transport deadline (e.g. a delayed
+ * ACK) among its connections, which it keeps in a heap.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "stcp_api.h"
+#include "transport.h"
+
+
+#define REACTOR_MAX_WORKERS 64
+
+/* events dispatched to a connection before the worker moves on to the next
+ * ready one; a busy connection is put back at the end of the ready list.
+ */
+#define REACTOR_DISPATCH_BATCH 16
+
+struct reactor_worker;
+
+/* per-connection reactor state.  the list links, 'queued' and the timer
+ * fields are protected by the worker's lock; 'done' by the context's
+ * data_ready_lock.  the remaining fields belong to the worker thread.
+ */
+typedef struct reactor_conn
+{
+    mysock_context_t      *ctx;
+    struct reactor_worker *worker;
+    transport_conn_t      *transport;   /* NULL until the worker opens it */
+
+    struct reactor_conn   *prev, *next; /* all of the worker's connections */
+    struct reactor_conn   *next_ready;
+    bool_t                 queued;      /* on the ready list */
+    bool_t                 done;        /* transport has finished */
+
+    int                    timer_index; /* in the timer heap, or -1 */
+    struct timespec        deadline;
+} reactor_conn_t;
+
+typedef struct reactor_worker
+{
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+    bool_t           sleeping;
+
+    reactor_conn_t  *conns;
+    reactor_conn_t  *ready_head, *ready_tail;
+
+    /* connections with a deadline, as a binary min-heap on it */
+    reactor_conn_t **timers;
+    unsigned int     num_timers, max_timers;
+} reactor_worker_t;
+
+
+static reactor_worker_t *workers;
+static unsigned int      num_workers;   /* zero unless reactor mode is on */
+static pthread_mutex_t   reactor_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void *_mysock_reactor_worker_func(void *arg_ptr);
+
+
+static bool_t _reactor_deadline_passed(const struct timespec *ts)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec > ts->tv_sec ||
+            (now.tv_sec == ts->tv_sec &&
+             (long) now.tv_usec * 1000 >= ts->tv_nsec));
+}
+
+static bool_t _reactor_deadline_before(const struct timespec *a,
+                                       const struct timespec *b)
+{
+    return (a->tv_sec < b->tv_sec ||
+            (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec));
+}
+
+/* the deadline heap, as in mysock_fiber.c; the caller holds the worker's
+ * lock
+ */
+static void _reactor_timer_set(reactor_worker_t *w, unsigned int k,
+                               reactor_conn_t *conn)
+{
+    w->timers[k] = conn;
+    conn->timer_index = (int) k;
+}
+
+static void _reactor_timer_sift(reactor_worker_t *w, unsigned int k)
+{
+    reactor_conn_t *conn = w->timers[k];
+    unsigned int child;
+
+    /* up... */
+    while (k > 0 && _reactor_deadline_before(&conn->deadline,
+                                             &w->timers[(k - 1) / 2]->deadline))
+    {
+        _reactor_timer_set(w, k, w->timers[(k - 1) / 2]);
+        k = (k - 1) / 2;
+    }
+
+    /* ...or down */
+    while ((child = 2 * k + 1) < w->num_timers)
+    {
+        if (child + 1 < w->num_timers &&
+            _reactor_deadline_before(&w->timers[child + 1]->deadline,
+                                     &w->timers[child]->deadline))
+            ++child;
+        if (!_reactor_deadline_before(&w->timers[child]->deadline,
+                                      &conn->deadline))
+            break;
+        _reactor_timer_set(w, k, w->timers[child]);
+        k = child;
+    }
+    _reactor_timer_set(w, k, conn);
+}
+
+static void _reactor_timer_add(reactor_worker_t *w, reactor_conn_t *conn)
+{
+    if (w->num_timers == w->max_timers)
+    {
+        w->max_timers = MAX(2 * w->max_timers, 16);
+        w->timers = (reactor_conn_t **)
+            realloc(w->timers, w->max_timers * sizeof(reactor_conn_t *));
+        assert(w->timers);
+    }
+
+    w->timers[w->num_timers] = conn;
+    _reactor_timer_sift(w, w->num_timers++);
+}
+
+static void _reactor_timer_remove(reactor_worker_t *w, reactor_conn_t *conn)
+{
+    unsigned int k = (unsigned int) conn->timer_index;
+
+    if (conn->timer_index < 0)
+        return;
+
+    conn->timer_index = -1;
+    if (k != --w->num_timers)
+    {
+        w->timers[k] = w->timers[w->num_timers];
+        _reactor_timer_sift(w, k);
+    }
+}
+
+/* put conn on its worker's ready list; the caller holds the worker's lock */
+static void _reactor_make_ready(reactor_worker_t *w, reactor_conn_t *conn)
+{
+    if (conn->queued)
+        return;
+
+    conn->queued = TRUE;
+    conn->next_ready = NULL;
+    if (w->ready_tail)
+        w->ready_tail->next_ready = conn;
+    else
+        w->ready_head = conn;
+    w->ready_tail = conn;
+
+    if (w->sleeping)
+        PTHREAD_CALL(pthread_cond_signal(&w->cond));
+}
+
+/* start the worker pool.  num_workers of zero picks one per online CPU.
+ * fails with EBUSY if the pool is already running with a different size.
+ */
+int _mysock_reactor_start(unsigned int count)
+{
+    unsigned int k;
+    int rc = 0;
+
+    if (count == 0)
+    {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        count = (ncpu > 0) ? (unsigned int) ncpu : 1;
+    }
+    count = MIN(count, REACTOR_MAX_WORKERS);
+
+    PTHREAD_CALL(pthread_mutex_lock(&reactor_lock));
+    if (num_workers)
+    {
+        if (num_workers != count)
+        {
+            errno = EBUSY;
+            rc = -1;
+        }
+        goto done;
+    }
+
+    workers = (reactor_worker_t *) calloc(count, sizeof(reactor_worker_t));
+    assert(workers);
+
+    for (k = 0; k < count; ++k)
+    {
+        PTHREAD_CALL(pthread_mutex_init(&workers[k].lock, NULL));
+        PTHREAD_CALL(pthread_cond_init(&workers[k].cond, NULL));
+        (void) _mysock_create_thread(_mysock_reactor_worker_func,
+                                     &workers[k], TRUE);
+    }
+
+    /* published last; connections only look at the pool once this is set */
+    num_workers = count;
+
+done:
+    PTHREAD_CALL(pthread_mutex_unlock(&reactor_lock));
+    return rc;
+}
+
+bool_t _mysock_reactor_enabled(void)
+{
+    return num_workers != 0;
+}
+
+/* hand a new connection's transport to a worker */
+void _mysock_reactor_add(mysock_context_t *ctx)
+{
+    reactor_conn_t   *conn;
+    reactor_worker_t *w;
+
+    assert(ctx && !ctx->reactor && num_workers);
+
+    conn = (reactor_conn_t *) calloc(1, sizeof(reactor_conn_t));
+    assert(conn);
+
+    /* Fibonacci hashing, as descriptors are allocated densely:  the high
+     * bits of the product are scaled to the number of workers
+     */
+    w = &workers[(((uint64_t) ((unsigned int) ctx->my_sd * 2654435769U)) *
+                  num_workers) >> 32];
+    conn->ctx         = ctx;
+    conn->worker      = w;
+    conn->timer_index = -1;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->reactor = conn;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    PTHREAD_CALL(pthread_mutex_lock(&w->lock));
+    if ((conn->next = w->conns) != NULL)
+        conn->next->prev = conn;
+    w->conns = conn;
+    _reactor_make_ready(w, conn);   /* the worker opens the connection */
+    PTHREAD_CALL(pthread_mutex_unlock(&w->lock));
+}
+
+/* something the connection's transport waits for has happened.  the caller
+ * holds ctx->data_ready_lock.
+ */
+void _mysock_reactor_notify(mysock_context_t *ctx)
+{
+    reactor_conn_t *conn;
+
+    assert(ctx);
+    if (!(conn = ctx->reactor) || conn->done)
+        return;
+
+    PTHREAD_CALL(pthread_mutex_lock(&conn->worker->lock));
+    _reactor_make_ready(conn->worker, conn);
+    PTHREAD_CALL(pthread_mutex_unlock(&conn->worker->lock));
+}
+
+/* release reactor state when the context is freed */
+void _mysock_reactor_free(mysock_context_t *ctx)
+{
+    assert(ctx);
+    assert(!ctx->reactor || ctx->reactor->done);
+
+    free(ctx->reactor);
+    ctx->reactor = NULL;
+}
+
+/* the transport is over:  take the connection off its worker, and do the
+ * same final cleanup as a transport thread would.
+ */
+static void _reactor_finish(reactor_conn_t *conn)
+{
+    mysock_context_t *ctx = conn->ctx;
+    reactor_worker_t *w = conn->worker;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    conn->done = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    PTHREAD_CALL(pthread_mutex_lock(&w->lock));
+    if (conn->queued)
+    {
+        reactor_conn_t **pp = &w->ready_head, *last = NULL;
+
+        while (*pp != conn)
+        {
+            last = *pp;
+            pp = &(*pp)->next_ready;
+        }
+        *pp = conn->next_ready;
+        if (w->ready_tail == conn)
+            w->ready_tail = last;
+        conn->queued = FALSE;
+    }
+    _reactor_timer_remove(w, conn);
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        w->conns = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    PTHREAD_CALL(pthread_mutex_unlock(&w->lock));
+
+    /* sets errno for _mysock_transport_finished() */
+    transport_close(conn->transport);
+    conn->transport = NULL;
+
+    /* this may free ctx, and conn with it */
+    _mysock_transport_finished(ctx);
+}
+
+/* run a ready connection for up to REACTOR_DISPATCH_BATCH events.  returns
+ * TRUE if it may have more to do straight away.
+ */
+static bool_t _reactor_run_conn(reactor_conn_t *conn)
+{
+    static const struct timespec already_expired = { 0, 0 };
+    const struct timespec *deadline;
+    unsigned int events, k;
+
+    if (!conn->transport)
+        conn->transport = transport_open(conn->ctx->my_sd,
+                                         conn->ctx->is_active);
+
+    for (k = 0; k < REACTOR_DISPATCH_BATCH; ++k)
+    {
+        events = stcp_wait_for_event(conn->ctx->my_sd,
+                                     transport_wait_flags(conn->transport),
+                                     &already_expired);
+        deadline = transport_deadline(conn->transport);
+
+        if (!events && !(deadline && _reactor_deadline_passed(deadline)))
+            break;
+
+        if (!transport_dispatch(conn->transport, events))
+        {
+            _reactor_finish(conn);
+            return FALSE;
+        }
+    }
+
+    deadline = transport_deadline(conn->transport);
+
+    PTHREAD_CALL(pthread_mutex_lock(&conn->worker->lock));
+    if (!deadline)
+    {
+        _reactor_timer_remove(conn->worker, conn);
+    }
+    else
+    {
+        conn->deadline = *deadline;
+        if (conn->timer_index < 0)
+            _reactor_timer_add(conn->worker, conn);
+        else
+            _reactor_timer_sift(conn->worker, (unsigned int) conn->timer_index);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&conn->worker->lock));
+
+    return k == REACTOR_DISPATCH_BATCH;
+}
+
+static void *_mysock_reactor_worker_func(void *arg_ptr)
+{
+    reactor_worker_t *w = (reactor_worker_t *) arg_ptr;
+    reactor_conn_t *conn;
+
+    assert(w);
+
+    PTHREAD_CALL(pthread_mutex_lock(&w->lock));
+    for (;;)
+    {
+        const struct timespec *earliest = NULL;
+        bool_t more;
+
+        if ((conn = w->ready_head) != NULL)
+        {
+            if (!(w->ready_head = conn->next_ready))
+                w->ready_tail = NULL;
+            conn->queued = FALSE;
+            PTHREAD_CALL(pthread_mutex_unlock(&w->lock));
+
+            more = _reactor_run_conn(conn);
+
+            PTHREAD_CALL(pthread_mutex_lock(&w->lock));
+            if (more)
+                _reactor_make_ready(w, conn);
+            continue;
+        }
+
+        /* nothing ready; run the connections whose deadlines have passed
+         * (they go back in the heap once they've run), else sleep until
+         * the earliest one
+         */
+        while (w->num_timers > 0 &&
+               _reactor_deadline_passed(&w->timers[0]->deadline))
+        {
+            conn = w->timers[0];
+            _reactor_timer_remove(w, conn);
+            _reactor_make_ready(w, conn);
+        }
+
+        if (w->ready_head)
+            continue;
+        if (w->num_timers > 0)
+            earliest = &w->timers[0]->deadline;
+
+        w->sleeping = TRUE;
+        if (earliest)
+        {
+            struct timespec abstime = *earliest;
+            int rc = pthread_cond_timedwait(&w->cond, &w->lock, &abstime);
+            assert(rc == 0 || rc == ETIMEDOUT || rc == EINTR);
+        }
+        else
+        {
+            PTHREAD_CALL(pthread_cond_wait(&w->cond, &w->lock));
+        }
+        w->sleeping = FALSE;
+    }
+
+    /*NOTREACHED*/
+    return NULL;
+}
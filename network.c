@@ -19,15 +19,15 @@
 
 
 /* helper function for stcp_network_send(); */
-int _network_send(mysocket_t sd, const void *buf, size_t len)
+int _network_send(mysocket_t sd, const struct iovec *iov, int iovcnt)
 {
     mysock_context_t *sock_ctx = _mysock_get_context(sd);
     network_context_t *ctx;
 
-    assert(sock_ctx && buf);
+    assert(sock_ctx && iov);
     ctx = &sock_ctx->network_state;
 
-    return _network_send_packet(ctx, buf, len);
+    return _network_send_packet(ctx, iov, iovcnt);
 }
 
 /* helper function for stcp_network_recv() */
@@ -43,3 +43,11 @@ int _network_recv(mysocket_t sd, void *dst, size_t max_len)
     return len;
 }
 
+/* helper function for stcp_network_recv_buf() */
+packet_queue_node_t *_network_recv_node(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    return _mysock_dequeue_node(ctx, &ctx->network_recv_queue);
+}
@@ -7,8 +7,9 @@
 
 #include "mysock.h"
 
-int _network_send(mysocket_t sd, const void *buf, size_t len);
+int _network_send(mysocket_t sd, const struct iovec *iov, int iovcnt);
 int _network_recv(mysocket_t sd, void *dst, size_t max_len);
+struct packet_queue_node *_network_recv_node(mysocket_t sd);
 
 #endif  /* __NETWORK_H__ */
 
@@ -13,6 +13,9 @@
 
 #define MAX_IP_PAYLOAD_LEN 1500
 
+/* most buffers a packet may be gathered from (see _network_send_packet()) */
+#define MAX_PACKET_IOV     16
+
 
 struct mysock_context;
 
@@ -48,6 +51,11 @@ int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen);
 /* specify backlog for passive socket */
 int _network_listen(network_context_t *ctx, int backlog);
 
+/* pass the mysocket's MYSO_NODELAY and MYSO_KEEPALIVE options on to the
+ * underlying connection
+ */
+int _network_apply_opts(struct mysock_context *ctx);
+
 /* returns local port associated with mysocket, in network byte order */
 int _network_get_port(network_context_t *ctx);
 
@@ -61,15 +69,28 @@ uint32_t _network_get_local_addr(network_context_t *ctx);
  */
 uint32_t _network_get_interface_ip(uint32_t peer_addr);
 
-/* send an STCP packet to our peer */
-ssize_t _network_send_packet(network_context_t *ctx,
-                             const void *src, size_t len);
+/* send an STCP packet, gathered from the iovcnt buffers in iov, to our
+ * peer
+ */
+ssize_t _network_send_packet(network_context_t  *ctx,
+                             const struct iovec *iov, int iovcnt);
+
+/* start/stop receiving network packets for a mysocket.  packets are read
+ * by a small pool of poller threads shared by all mysockets.  the stop()
+ * interface must not return until no poller thread is using the mysocket.
+ */
+int _network_start_recv(struct mysock_context *ctx);
+void _network_stop_recv(struct mysock_context *ctx);
+
+/* receiving stops while the mysocket's network receive queue is full; this
+ * is called once the transport has made room again.
+ */
+void _network_resume_recv(struct mysock_context *ctx);
 
-/* start/stop per-mysocket network receive thread.  the stop() interface
- * must not return until the network receive thread has exited.
+/* send and receive through io_uring on connections set up from now on,
+ * if the kernel supports it (see myuring())
  */
-int _network_start_recv_thread(struct mysock_context *ctx);
-void _network_stop_recv_thread(struct mysock_context *ctx);
+int _network_enable_uring(void);
 
 /* called when a SYN packet is dequeued on a passive socket, to update any
  * state in the network layer.
@@ -7,8 +7,9 @@
 #include <sys/socket.h>
 #include <errno.h>
 #include <unistd.h>
-#include <poll.h>
 #include <assert.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "network_io_socket.h"
@@ -21,8 +22,16 @@
 
 
 
-#define EXIT_PIPE_READ_INDEX  0
-#define EXIT_PIPE_WRITE_INDEX 1
+/* number of network poller threads, each with its own epoll instance.
+ * sockets are spread across them by descriptor.
+ */
+#define NETWORK_NUM_POLLERS 2
+
+/* epoll events fetched at once, and packets read from one socket before
+ * moving on to the next ready one
+ */
+#define NETWORK_POLL_BATCH      64
+#define NETWORK_POLL_MAX_READS  32
 
 #ifndef MAXHOSTNAMELEN
 #ifdef HOST_NAME_MAX
@@ -36,7 +45,37 @@
 static network_context_socket_t *
     _network_alloc_context_socket(int socket_type, size_t ctx_len);
 static void _network_destroy_context_socket(network_context_socket_t *ctx);
-static void *network_recv_thread_func(void *arg_ptr);
+static void _network_recv_ready(void *arg);
+static void _network_recv_removed(void *arg);
+static void _network_poller_init(void);
+static void _network_poller_atfork_child(void);
+static void *network_poller_thread_func(void *arg_ptr);
+
+
+/* a network poller thread.  sources are removed by the poller itself, at
+ * the end of a batch of events (see _network_poll_remove()), so that a
+ * source is never freed while an event for it is still pending.
+ */
+typedef struct network_poller
+{
+    int                    epoll_fd;
+    int                    wake_fd;     /* eventfd; wakes for removals */
+    pthread_t              thread;
+
+    pthread_mutex_t        lock;
+    pthread_cond_t         removed_cond;
+    network_poll_source_t *removals;    /* sources waiting to be removed */
+
+    /* while any registered source wants busy-polling, the poller spins for
+     * the largest budget asked for since the count was last zero
+     */
+    unsigned int           num_busy;
+    unsigned int           busy_poll_usec;
+} network_poller_t;
+
+static network_poller_t network_pollers[NETWORK_NUM_POLLERS];
+static pthread_once_t   network_pollers_once = PTHREAD_ONCE_INIT;
+static bool_t           network_atfork_registered;
 
 
 
@@ -111,51 +150,257 @@ uint32_t _network_get_interface_ip(uint32_t peer_addr)
     return ((struct in_addr *) *h->h_addr_list)->s_addr;
 }
 
-int _network_start_recv_thread(mysock_context_t *ctx)
+/* start watching the mysocket's socket for incoming packets */
+int _network_start_recv(mysock_context_t *ctx)
 {
     network_context_socket_t *net_ctx =
         (network_context_socket_t *) ctx->network_state.impl_data;
 
     assert(net_ctx);
 
-    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
-    {
-        perror("signal(SIGPIPE)");
-        assert(0);
+    if (_network_prepare_recv(&ctx->network_state) < 0)
         return -1;
+
+    if (!ctx->listening && _network_uring_enabled())
+    {
+        net_ctx->uring = _network_uring_start(ctx, net_ctx->socket);
+        return 0;
     }
 
-    net_ctx->recv_thread = _mysock_create_thread(network_recv_thread_func,
-                                                 ctx, FALSE);
-    net_ctx->recv_thread_started = TRUE;
+    net_ctx->recv_source.socket = net_ctx->socket;
+    net_ctx->recv_source.busy_poll_usec = ctx->busy_poll_usec;
+    _network_poll_add(&net_ctx->recv_source, NULL,
+                      _network_recv_ready, _network_recv_removed, ctx);
     return 0;
 }
 
-/* block until the network receive thread completes */
-void _network_stop_recv_thread(mysock_context_t *ctx)
+/* stop receiving; returns once no poller thread is using the mysocket */
+void _network_stop_recv(mysock_context_t *ctx)
 {
     network_context_socket_t *net_ctx =
         (network_context_socket_t *) ctx->network_state.impl_data;
 
-    DEBUG_LOG(("stopping receive thread\n"));
+    DEBUG_LOG(("stopping network receive\n"));
     assert(net_ctx);
 
+    if (net_ctx->uring)
+    {
+        _network_uring_stop(net_ctx->uring);
+        net_ctx->uring = NULL;
+        DEBUG_LOG(("stopped network receive\n"));
+        return;
+    }
+
+    _network_poll_remove(&net_ctx->recv_source);
+    DEBUG_LOG(("stopped network receive\n"));
+}
+
+void _network_poll_add(network_poll_source_t       *src,
+                       const network_poll_source_t *sibling,
+                       void (*ready)(void *arg),
+                       void (*removed)(void *arg),
+                       void *arg)
+{
+    network_poller_t *poller;
+    struct epoll_event event;
+
+    assert(src && ready && src->socket >= 0 && !src->poller);
+    assert(!sibling || sibling->poller);
 
-    if (net_ctx->recv_thread_started)
+    PTHREAD_CALL(pthread_once(&network_pollers_once, _network_poller_init));
+
+    poller = (sibling) ? sibling->poller :
+        &network_pollers[(unsigned int) src->socket % NETWORK_NUM_POLLERS];
+
+    PTHREAD_CALL(pthread_mutex_lock(&poller->lock));
+    src->ready      = ready;
+    src->removed    = removed;
+    src->arg        = arg;
+    src->poller     = poller;
+    src->registered = TRUE;
+    src->closing    = FALSE;
+
+    if (src->busy_poll_usec)
+    {
+        ++poller->num_busy;
+        poller->busy_poll_usec = MAX(poller->busy_poll_usec,
+                                     src->busy_poll_usec);
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events   = EPOLLIN;
+    event.data.ptr = src;
+    if (epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD, src->socket, &event) < 0)
+    {
+        perror("epoll_ctl");
+        assert(0);
+        abort();
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&poller->lock));
+}
+
+void _network_poll_enable(network_poll_source_t *src, bool_t enable)
+{
+    network_poller_t *poller = src->poller;
+    struct epoll_event event;
+
+    if (!poller)
+        return;     /* already removed */
+
+    PTHREAD_CALL(pthread_mutex_lock(&poller->lock));
+    if (src->registered)
     {
-        char dummy = 'X';
-        if (write(net_ctx->exit_pipe[EXIT_PIPE_WRITE_INDEX],
-                  &dummy, sizeof(dummy)) < 0)
+        memset(&event, 0, sizeof(event));
+        event.events   = (enable) ? (uint32_t) EPOLLIN : 0;
+        event.data.ptr = src;
+        if (epoll_ctl(poller->epoll_fd, EPOLL_CTL_MOD,
+                      src->socket, &event) < 0)
         {
+            perror("epoll_ctl");
             assert(0);
-            abort();
         }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&poller->lock));
+}
+
+/* take src out of the epoll set; the caller holds the poller's lock */
+static void _network_poll_unregister(network_poller_t      *poller,
+                                     network_poll_source_t *src)
+{
+    if (src->registered)
+    {
+        (void) epoll_ctl(poller->epoll_fd, EPOLL_CTL_DEL, src->socket, NULL);
+        src->registered = FALSE;
+
+        if (src->busy_poll_usec && --poller->num_busy == 0)
+            poller->busy_poll_usec = 0;
+    }
+    src->closing = TRUE;
+}
+
+void _network_poll_remove(network_poll_source_t *src)
+{
+    network_poller_t *poller;
+
+    assert(src);
+    if (!(poller = src->poller))
+        return;
+
+    PTHREAD_CALL(pthread_mutex_lock(&poller->lock));
+    if (pthread_equal(pthread_self(), poller->thread))
+    {
+        /* from one of the poller's own callbacks.  any events for the
+         * source later in the current batch are suppressed by 'closing'.
+         * if another thread is also waiting to remove it, that's completed
+         * at the end of the batch as usual.
+         */
+        network_poll_source_t *r;
+        bool_t requested = FALSE;
+
+        _network_poll_unregister(poller, src);
+        for (r = poller->removals; r && !requested; r = r->next_removal)
+            requested = (r == src);
+        PTHREAD_CALL(pthread_mutex_unlock(&poller->lock));
+
+        if (!requested)
+        {
+            src->poller = NULL;
+            if (src->removed)
+                src->removed(src->arg);
+        }
+        return;
+    }
 
+    src->next_removal = poller->removals;
+    poller->removals  = src;
+    if (eventfd_write(poller->wake_fd, 1) < 0)
+    {
+        assert(0);
+        abort();
+    }
 
-        PTHREAD_CALL(pthread_join(net_ctx->recv_thread, NULL));
-        net_ctx->recv_thread_started = FALSE;
+    while (src->poller)
+    {
+        PTHREAD_CALL(pthread_cond_wait(&poller->removed_cond,
+                                       &poller->lock));
     }
-    DEBUG_LOG(("stopped receive thread\n"));
+    PTHREAD_CALL(pthread_mutex_unlock(&poller->lock));
+}
+
+/* pass a packet received for ctx up to the mysocket layer */
+void _network_deliver_packet(mysock_context_t *ctx,
+                             const void *packet, size_t packet_len)
+{
+    packet_queue_node_t *node;
+
+    assert(ctx && packet && packet_len <= MAX_IP_PAYLOAD_LEN);
+
+    node = _mysock_pool_alloc_node(packet_len);
+    memcpy(node->data, packet, packet_len);
+    node->data_len = packet_len;
+    _network_deliver_node(ctx, node);
+}
+
+/* as _network_deliver_packet(), but the packet is handed over in the node
+ * it was read into
+ */
+void _network_deliver_node(mysock_context_t *ctx, packet_queue_node_t *node)
+{
+    assert(ctx && node);
+
+    if (ctx->listening)
+    {
+        /* if the socket was accepting new connections, incoming
+         * packets need to be demultiplexed and dispatched to the
+         * appropriate mysocket context.
+         */
+        _mysock_enqueue_connection(ctx, node->data, node->data_len,
+                                   &ctx->network_state.peer_addr,
+                                   ctx->network_state.peer_addr_len, NULL);
+        _mysock_release_node(node);
+    }
+    else
+    {
+        /* enqueue the packet directly for this context */
+        _mysock_enqueue_node(ctx, &ctx->network_recv_queue, node);
+    }
+}
+
+char *_network_frame_data(tcp_frame_t *frame)
+{
+    assert(frame);
+
+    if (!frame->packet)
+        frame->packet = _mysock_pool_alloc_node(MAX_IP_PAYLOAD_LEN);
+    return frame->packet->data;
+}
+
+packet_queue_node_t *_network_frame_take(tcp_frame_t *frame)
+{
+    packet_queue_node_t *packet;
+
+    assert(frame && frame->len_read == sizeof(frame->packet_len));
+    assert(frame->data_read == ntohs(frame->packet_len));
+
+    /* an empty packet never needed its buffer */
+    (void) _network_frame_data(frame);
+
+    packet = frame->packet;
+    packet->data_len = MIN(frame->data_read, MAX_IP_PAYLOAD_LEN);
+
+    frame->packet   = NULL;
+    frame->len_read = frame->data_read = 0;
+    return packet;
+}
+
+void _network_frame_discard(tcp_frame_t *frame)
+{
+    assert(frame);
+
+    if (frame->packet)
+        _mysock_release_node(frame->packet);
+    frame->packet   = NULL;
+    frame->len_read = frame->data_read = 0;
 }
 
 
@@ -173,11 +418,9 @@ int _network_init_socket(mysock_context_t  *sock_ctx,
     memset(net_ctx, 0, sizeof(*net_ctx));
     net_ctx->random_seed = 0x632a;
 
+    /* running out of descriptors is the application's problem */
     if (!(net_ctx->impl_data = _network_alloc_context_socket(type, ctx_len)))
-    {
-        assert(0);
         return -1;
-    }
 
     return 0;
 }
@@ -193,102 +436,234 @@ int _network_bind_socket(network_context_t *ctx,
 }
 
 
-/* process network input.
- * this just loops around, waiting for data to arrive, and buffering it
- * for later consumption by network_recv().  (outgoing data is sent
- * immediately via network_send(), and so does not require its own thread).
- * 
- * this runs in its own thread, mostly because the transport layer needs to
- * wait with a timeout for incoming data from the peer.  [usual mechanisms
- * for I/O with timeouts such as poll(), select(), or asynchronous I/O
- * don't work with all underlying I/O mechanisms we might support (e.g.
- * VNS).  so we implement the timeout in a more generic (I/O-independent)
- * manner using the pthreads API instead].
+/* process network input for a mysocket.  this reads whatever complete
+ * packets are waiting, buffering them for later consumption by
+ * network_recv().  (outgoing data is sent immediately via network_send(),
+ * and so is not handled here).
+ *
+ * this runs on a network poller thread rather than the transport's, mostly
+ * because the transport layer needs to wait with a timeout for incoming
+ * data from the peer.  [usual mechanisms for I/O with timeouts such as
+ * poll(), select(), or asynchronous I/O don't work with all underlying I/O
+ * mechanisms we might support (e.g. VNS).  so we implement the timeout in
+ * a more generic (I/O-independent) manner using the pthreads API instead].
  */
-static void *network_recv_thread_func(void *arg_ptr)
+static void _network_recv_ready(void *arg)
 {
-    char packet_buf[MAX_IP_PAYLOAD_LEN];
-    mysock_context_t *ctx;
+    mysock_context_t *ctx = (mysock_context_t *) arg;
     network_context_socket_t *net_ctx;
+    int k;
 
-    DEBUG_LOG(("started receive thread\n"));
-    ctx = (mysock_context_t *) arg_ptr;
     assert(ctx);
-
     net_ctx = (network_context_socket_t *) ctx->network_state.impl_data;
     assert(net_ctx);
 
-    for (;;)
+    for (k = 0; k < NETWORK_POLL_MAX_READS; ++k)
     {
+        packet_queue_node_t *packet;
         ssize_t bytes_read;
-        bool_t packet_ready = FALSE;
-        bool_t done = FALSE;
-        struct pollfd fds[] =
-        {
-            { net_ctx->exit_pipe[EXIT_PIPE_READ_INDEX], POLLIN, 0 },
-            { net_ctx->socket, POLLIN, 0 }
-        };
-
 
-        while (!packet_ready && !done)
+        if (!ctx->listening &&
+            !_mysock_queue_has_room(&ctx->network_recv_queue, FALSE))
         {
-            switch (poll(fds, sizeof(fds) / sizeof(fds[0]), -1))
-            {
-            case -1:
-                assert(errno == EINTR);
+            /* leave further packets with the socket until the transport
+             * catches up; _network_resume_recv() starts reading again.
+             */
+            _network_poll_enable(&net_ctx->recv_source, FALSE);
+            if (_mysock_queue_wait_room(&ctx->network_recv_queue, FALSE))
                 break;
+            _network_poll_enable(&net_ctx->recv_source, TRUE);
+        }
 
-            case 0:
-                assert(0);
+        if ((bytes_read = _network_recv_packet(&ctx->network_state,
+                                               &packet)) <= 0)
+        {
+            if (bytes_read < 0 && (errno == EAGAIN || errno == EINTR))
                 break;
 
-            default:
-                assert(!(fds[0].revents & POLLERR));
-                assert(!(fds[1].revents & POLLERR));
+            DEBUG_LOG(("_network_recv_packet failed, errno=%d\n", errno));
+            //signal an error to the transport layer
+            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue, NULL, 0);
 
-                if (fds[0].revents)
-                    done = TRUE;
-                if (fds[1].revents)
-                    packet_ready = TRUE;
-                break;
-            }
+            /* ctx may be freed as soon as this returns */
+            _network_poll_remove(&net_ctx->recv_source);
+            break;
         }
 
-        if (done)
-            break;
+        assert(packet && bytes_read <= MAX_IP_PAYLOAD_LEN);
+        _network_deliver_node(ctx, packet);
+    }
+}
 
-        /* block, waiting for network input.  (the system call will be
-         * interrupted by the transport layer thread if we're to exit).
-         */
-        if ((bytes_read = _network_recv_packet(&ctx->network_state,
-                                               packet_buf,
-                                               sizeof(packet_buf))) <= 0)
+void _network_resume_recv(mysock_context_t *ctx)
+{
+    network_context_socket_t *net_ctx =
+        (network_context_socket_t *) ctx->network_state.impl_data;
+
+    assert(net_ctx);
+    if (net_ctx->uring)
+        _network_uring_resume(net_ctx->uring);
+    else
+        _network_poll_enable(&net_ctx->recv_source, TRUE);
+}
+
+static void _network_recv_removed(void *arg)
+{
+    mysock_context_t *ctx = (mysock_context_t *) arg;
+
+    assert(ctx);
+    _network_recv_stopped(&ctx->network_state);
+}
+
+static void _network_poller_init(void)
+{
+    int k;
+
+    if (!network_atfork_registered)
+    {
+        PTHREAD_CALL(pthread_atfork(NULL, NULL,
+                                    _network_poller_atfork_child));
+        network_atfork_registered = TRUE;
+    }
+
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    {
+        perror("signal(SIGPIPE)");
+        assert(0);
+    }
+
+    for (k = 0; k < NETWORK_NUM_POLLERS; ++k)
+    {
+        network_poller_t *poller = &network_pollers[k];
+        struct epoll_event event;
+
+        if ((poller->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+            (poller->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
         {
-            DEBUG_LOG(("_network_recv_packet interrupted, errno=%d\n", errno));
-            //signal an error to the transport layer
-            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue, NULL, 0);
-            break;
+            perror("epoll_create1/eventfd");
+            assert(0);
+            abort();
         }
 
-        assert(bytes_read <= (int)sizeof(packet_buf));
-        if (ctx->listening)
+        memset(&event, 0, sizeof(event));
+        event.events   = EPOLLIN;
+        event.data.ptr = NULL;  /* the wake-up eventfd */
+        if (epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD,
+                      poller->wake_fd, &event) < 0)
         {
-            /* if the socket was accepting new connections, incoming
-             * packets need to be demultiplexed and dispatched to the
-             * appropriate mysocket context.
-             */
-            _mysock_enqueue_connection(ctx, packet_buf, bytes_read,
-                                       &ctx->network_state.peer_addr,
-                                       ctx->network_state.peer_addr_len, NULL);
+            perror("epoll_ctl");
+            assert(0);
+            abort();
         }
-        else
+
+        PTHREAD_CALL(pthread_mutex_init(&poller->lock, NULL));
+        PTHREAD_CALL(pthread_cond_init(&poller->removed_cond, NULL));
+        poller->thread = _mysock_create_thread(network_poller_thread_func,
+                                               poller, TRUE);
+    }
+}
+
+/* the poller threads don't survive fork(), and the child would otherwise
+ * share the parent's epoll instances.  the child starts its own pollers
+ * when it first needs them; mysockets inherited from the parent are of no
+ * use to it anyway, their transports being gone.
+ */
+static void _network_poller_atfork_child(void)
+{
+    int k;
+
+    if (!network_pollers[0].thread)
+        return;     /* never started */
+
+    for (k = 0; k < NETWORK_NUM_POLLERS; ++k)
+    {
+        (void) close(network_pollers[k].epoll_fd);
+        (void) close(network_pollers[k].wake_fd);
+    }
+
+    memset(network_pollers, 0, sizeof(network_pollers));
+    network_pollers_once = PTHREAD_ONCE_INIT;
+}
+
+static void *network_poller_thread_func(void *arg_ptr)
+{
+    network_poller_t *poller = (network_poller_t *) arg_ptr;
+    struct epoll_event events[NETWORK_POLL_BATCH];
+    network_poll_source_t *src, *removals;
+
+    DEBUG_LOG(("started network poller\n"));
+    assert(poller);
+
+    for (;;)
+    {
+        unsigned int busy_poll_usec = BUSY_POLL_READ(poller->busy_poll_usec);
+        int num_events = 0, k;
+
+        if (busy_poll_usec)
+        {
+            busy_poll_t bp;
+
+            _mysock_busy_poll_start(&bp, busy_poll_usec, NULL);
+            while ((num_events = epoll_wait(poller->epoll_fd, events,
+                                            NETWORK_POLL_BATCH, 0)) == 0 &&
+                   _mysock_busy_poll_continue(&bp))
+                ;
+        }
+
+        if (num_events <= 0 &&
+            (num_events = epoll_wait(poller->epoll_fd, events,
+                                     NETWORK_POLL_BATCH, -1)) < 0)
         {
-            /* enqueue the packet directly for this context */
-            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue,
-                                   packet_buf, bytes_read);
+            assert(errno == EINTR);
+            continue;
+        }
+
+        /* sources whose removal was requested before this batch are
+         * skipped, though they stay registered until it's over
+         */
+        PTHREAD_CALL(pthread_mutex_lock(&poller->lock));
+        for (src = poller->removals; src; src = src->next_removal)
+            src->closing = TRUE;
+        PTHREAD_CALL(pthread_mutex_unlock(&poller->lock));
+
+        for (k = 0; k < num_events; ++k)
+        {
+            eventfd_t dummy;
+
+            if (!(src = (network_poll_source_t *) events[k].data.ptr))
+            {
+                (void) eventfd_read(poller->wake_fd, &dummy);
+                continue;
+            }
+
+            if (!src->closing)
+                src->ready(src->arg);
+        }
+
+        /* complete any removals requested so far.  each source may be
+         * freed as soon as its removal is signaled.
+         */
+        PTHREAD_CALL(pthread_mutex_lock(&poller->lock));
+        removals = poller->removals;
+        poller->removals = NULL;
+        for (src = removals; src; src = src->next_removal)
+            _network_poll_unregister(poller, src);
+        PTHREAD_CALL(pthread_mutex_unlock(&poller->lock));
+
+        while ((src = removals) != NULL)
+        {
+            removals = src->next_removal;
+            if (src->removed)
+                src->removed(src->arg);
+
+            PTHREAD_CALL(pthread_mutex_lock(&poller->lock));
+            src->poller = NULL;
+            PTHREAD_CALL(pthread_mutex_unlock(&poller->lock));
+            PTHREAD_CALL(pthread_cond_broadcast(&poller->removed_cond));
         }
     }
 
+    /*NOTREACHED*/
     return NULL;
 }
 
@@ -304,19 +679,12 @@ _network_alloc_context_socket(int socket_type, size_t ctx_len)
     /* create the actual socket used for communication to the peer */
     if ((ctx->socket = socket(AF_INET, socket_type, 0)) < 0)
     {
-        perror("socket");
-        assert(0);
-        _network_destroy_context_socket(ctx);
-        ctx = NULL;
-    }
+        int saved_errno = errno;
 
-    ctx->exit_pipe[0] = ctx->exit_pipe[1] = -1;
-    if (pipe(ctx->exit_pipe) < 0)
-    {
-        perror("pipe");
-        assert(0);
+        DEBUG_LOG(("socket: %s\n", strerror(errno)));
         _network_destroy_context_socket(ctx);
         ctx = NULL;
+        errno = saved_errno;
     }
 
     return ctx;
@@ -333,18 +701,6 @@ static void _network_destroy_context_socket(network_context_socket_t *ctx)
         ctx->socket = -1;
     }
 
-    if (ctx->exit_pipe[0] >= 0)
-    {
-        close(ctx->exit_pipe[0]);
-        ctx->exit_pipe[0] = -1;
-    }
-
-    if (ctx->exit_pipe[1] >= 0)
-    {
-        close(ctx->exit_pipe[1]);
-        ctx->exit_pipe[1] = -1;
-    }
-
     free(ctx);
 }
 
@@ -16,18 +16,82 @@
 
 typedef int socket_t;
 
+/* a socket watched by the network poller (see network_io_socket.c).
+ * ready() is called from the poller's thread whenever the socket is
+ * readable, and removed() (if not NULL), also from that thread, once the
+ * source has been removed.  a non-zero busy_poll_usec has the poller spin
+ * for that long before sleeping (see mysetbusypoll()).  'poller' is NULL
+ * while the source isn't registered; the remaining fields are protected by
+ * the poller's lock.
+ */
+struct network_poller;
+
+typedef struct network_poll_source
+{
+    socket_t                     socket;
+    void                       (*ready)(void *arg);
+    void                       (*removed)(void *arg);
+    void                        *arg;
+    unsigned int                 busy_poll_usec;
+
+    struct network_poller       *poller;
+    bool_t                       registered;    /* in the epoll set */
+    bool_t                       closing;       /* being removed */
+    struct network_poll_source  *next_removal;
+} network_poll_source_t;
+
 /* socket-based network layer additional state.
  * this is pointed to by impl_data in the network_context_t structure.
  */
+struct uring_conn;
+
 typedef struct
 {
-    pthread_t          recv_thread;
-    bool_t             recv_thread_started;
+    socket_t              socket;   /* socket used for communication to peer */
+    network_poll_source_t recv_source;
 
-    socket_t           socket;  /* socket used for communication to peer */
-    int                exit_pipe[2];    /* used to wake up read thread */
+    /* set while the connected socket is handled by io_uring instead of the
+     * poller (see network_io_uring.c)
+     */
+    struct uring_conn    *uring;
 } network_context_socket_t;
 
+/* reassembly of the length-prefixed packets carried over a TCP stream.
+ * each packet is read straight into a node from the packet buffer pool,
+ * which is passed up to the mysocket layer as it is once the packet is
+ * complete (see _network_frame_take()).
+ */
+typedef struct
+{
+    uint16_t             packet_len;    /* network byte order */
+    size_t               len_read;      /* bytes of packet_len read so far */
+    size_t               data_read;     /* bytes of the packet read so far */
+    packet_queue_node_t *packet;        /* NULL until the packet starts */
+} tcp_frame_t;
+
+/* _network_frame_data() returns the buffer the packet being reassembled
+ * in frame goes into, with room for MAX_IP_PAYLOAD_LEN bytes (anything
+ * more is thrown away).  _network_frame_take() hands the complete packet
+ * over to the caller, leaving frame ready for the next one, and
+ * _network_frame_discard() drops any partial packet when the stream goes
+ * away.
+ */
+char *_network_frame_data(tcp_frame_t *frame);
+packet_queue_node_t *_network_frame_take(tcp_frame_t *frame);
+void _network_frame_discard(tcp_frame_t *frame);
+
+/* a connection accepted on a passive socket, whose SYN hasn't yet arrived */
+typedef struct
+{
+    network_poll_source_t source;
+    struct mysock_context *listen_ctx;
+    struct sockaddr       peer_addr;
+    socklen_t             peer_addr_len;
+    tcp_frame_t           frame;
+} tcp_pending_connection_t;
+
+#define MAX_NUM_PENDING_CONNECTIONS 10
+
 typedef struct
 {
     network_context_socket_t base;
@@ -37,6 +101,15 @@ typedef struct
     socket_t          new_socket;   /* temporary result of accept() */
     pthread_mutex_t   connect_lock;
     bool_t            connected;
+    tcp_frame_t       frame;        /* packet being received */
+
+    /* passive sockets only.  accept_lock serialises hand-over of accepted
+     * sockets through new_socket.  accepting stops while all the pending
+     * slots are in use.
+     */
+    pthread_mutex_t          accept_lock;
+    bool_t                   accept_paused;
+    tcp_pending_connection_t pending[MAX_NUM_PENDING_CONNECTIONS];
 } network_context_socket_tcp_t;
 
 
@@ -67,11 +140,61 @@ int _network_bind_socket(network_context_t *ctx,
                          int                addrlen);
 
 
-/* this is not called directly.  use network_start_recv_thread() and
- * network_stop_recv_thread() instead.
+/* network poller.  _network_poll_add() starts watching src->socket, which
+ * must be set, on the same poller thread as 'sibling' if that's not NULL.
+ * _network_poll_remove() stops, and doesn't return until no poller thread
+ * is using the source, unless called from the poller's own thread (i.e.
+ * from a callback).  removing a source that isn't registered is harmless.
+ */
+void _network_poll_add(network_poll_source_t       *src,
+                       const network_poll_source_t *sibling,
+                       void (*ready)(void *arg),
+                       void (*removed)(void *arg),
+                       void *arg);
+void _network_poll_remove(network_poll_source_t *src);
+
+/* stop or resume calling src's ready() while it stays registered */
+void _network_poll_enable(network_poll_source_t *src, bool_t enable);
+
+/* pass a packet received for ctx up to the mysocket layer, either copying
+ * it or, with _network_deliver_node(), handing over the node it was read
+ * into
+ */
+void _network_deliver_packet(mysock_context_t *ctx,
+                             const void *packet, size_t packet_len);
+void _network_deliver_node(mysock_context_t *ctx, packet_queue_node_t *node);
+
+/* backend hooks for the poller; these are not called directly.  use
+ * network_start_recv() and network_stop_recv() instead.
+ *
+ * _network_prepare_recv() readies ctx's socket to be watched (e.g.
+ * connecting it).  _network_recv_packet() is called when the socket is
+ * readable; it must not block, returning -1 with errno set to EAGAIN once
+ * no complete packet is waiting.  otherwise it returns the packet's length
+ * and sets *packet to the node it was read into, which the caller takes
+ * over.  any other error, or a return of 0, means the connection to the
+ * peer has failed.  _network_recv_stopped() is called on the poller thread
+ * once the socket is no longer watched.
+ */
+int _network_prepare_recv(network_context_t *ctx);
+ssize_t _network_recv_packet(network_context_t    *ctx,
+                             packet_queue_node_t **packet);
+void _network_recv_stopped(network_context_t *ctx);
+
+
+/* io_uring data path for connected sockets (network_io_uring.c).  once
+ * _network_uring_enabled(), _network_uring_start() takes over receiving on
+ * sd for ctx, passing packets up to the mysocket layer as the poller
+ * would.  _network_uring_send() queues a frame (prefix included) to
+ * be sent.  _network_uring_stop() returns once no io_uring thread is using
+ * the connection, and frees it.
  */
-ssize_t _network_recv_packet(network_context_t *ctx,
-                             void *dst, size_t max_len);
+bool_t _network_uring_enabled(void);
+struct uring_conn *_network_uring_start(mysock_context_t *ctx, socket_t sd);
+void _network_uring_stop(struct uring_conn *conn);
+void _network_uring_resume(struct uring_conn *conn);
+ssize_t _network_uring_send(struct uring_conn *conn,
+                            const struct iovec *iov, int iovcnt);
 
 
 #endif  /* __NETWORK_IO_SOCKET_H__ */
@@ -5,20 +5,26 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include <alloca.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "network_io_socket.h"
 
 
-#define MAX_NUM_PENDING_CONNECTIONS 10
 
-typedef ssize_t (*io_func_t)(socket_t sd, void *buf, size_t count);
-
-static int _tcp_io(socket_t, void *, size_t, io_func_t);
+static int _tcp_writev(socket_t, struct iovec *, int);
 static int _tcp_connect(network_context_t *ctx);
+static void _tcp_accept(network_context_t *ctx);
+static void _tcp_pending_ready(void *arg);
+static ssize_t _tcp_read_frame(socket_t, tcp_frame_t *,
+                               packet_queue_node_t **);
 
 
 /* a few words about using TCP to emulate the underlying datagram
@@ -42,7 +48,7 @@ static int _tcp_connect(network_context_t *ctx);
 int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
-    int rc;
+    int rc, k;
 
     assert(sock_ctx && net_ctx);
     if ((rc = _network_init_socket(sock_ctx,
@@ -57,9 +63,13 @@ int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
     tcp_io_ctx->sock_ctx = sock_ctx;
     tcp_io_ctx->new_socket = -1;
     tcp_io_ctx->connected = FALSE;
+    for (k = 0; k < MAX_NUM_PENDING_CONNECTIONS; ++k)
+        tcp_io_ctx->pending[k].source.socket = -1;
 
     PTHREAD_CALL(pthread_mutex_init(&tcp_io_ctx->connect_lock, NULL));
+    PTHREAD_CALL(pthread_mutex_init(&tcp_io_ctx->accept_lock, NULL));
 
+    (void) _network_apply_opts(sock_ctx);
     return 0;
 }
 
@@ -69,8 +79,9 @@ void _network_close(network_context_t *ctx)
 
     assert(ctx);
 
-    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
-    assert(tcp_io_ctx);
+    /* nothing to do if _network_init() failed */
+    if ((tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data) == NULL)
+        return;
 
     if (tcp_io_ctx->new_socket != -1)
     {
@@ -80,6 +91,8 @@ void _network_close(network_context_t *ctx)
     }
 
     PTHREAD_CALL(pthread_mutex_destroy(&tcp_io_ctx->connect_lock));
+    PTHREAD_CALL(pthread_mutex_destroy(&tcp_io_ctx->accept_lock));
+    _network_frame_discard(&tcp_io_ctx->frame);
 
     _network_close_socket(ctx);
 }
@@ -95,9 +108,16 @@ int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
 
 int _network_listen(network_context_t *ctx, int backlog)
 {
+    int flags;
+
     assert(ctx);
     VERIFY_SOCKET(ctx);
 
+    /* the poller accepts until there's nothing left, so mustn't block */
+    if ((flags = fcntl(GET_SOCKET(ctx), F_GETFL, 0)) < 0 ||
+        fcntl(GET_SOCKET(ctx), F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+
     return listen(GET_SOCKET(ctx), backlog);
 }
 
@@ -128,17 +148,53 @@ void _network_update_passive_state(network_context_t *new_ctx,
     accept_tcp_ctx->new_socket = -1;
     DEBUG_LOG(("passed accepted socket %d on to new context...\n",
                new_tcp_ctx->base.socket));
+
+    (void) _network_apply_opts(new_tcp_ctx->sock_ctx);
 }
 
+/* the underlying connection carries whole STCP segments, so with
+ * MYSO_NODELAY on (the default), it sends each straight away too, rather
+ * than waiting on the kernel's Nagle algorithm.  keepalive is left to it
+ * as well, since (unlike STCP) it retransmits its probes.
+ */
+int _network_apply_opts(mysock_context_t *sock_ctx)
+{
+    network_context_t *ctx;
+    int nodelay, keepalive, idle;
+
+    assert(sock_ctx);
+    ctx = &sock_ctx->network_state;
+    VERIFY_SOCKET(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&sock_ctx->data_ready_lock));
+    nodelay   = sock_ctx->opts.nodelay;
+    keepalive = (sock_ctx->opts.keepalive > 0);
+    idle      = (int) sock_ctx->opts.keepalive;
+    PTHREAD_CALL(pthread_mutex_unlock(&sock_ctx->data_ready_lock));
+
+    if (setsockopt(GET_SOCKET(ctx), IPPROTO_TCP, TCP_NODELAY,
+                   &nodelay, sizeof(nodelay)) < 0 ||
+        setsockopt(GET_SOCKET(ctx), SOL_SOCKET, SO_KEEPALIVE,
+                   &keepalive, sizeof(keepalive)) < 0)
+        return -1;
+    if (keepalive && setsockopt(GET_SOCKET(ctx), IPPROTO_TCP, TCP_KEEPIDLE,
+                                &idle, sizeof(idle)) < 0)
+        return -1;
+    return 0;
+}
 
 /* send the given packet to the peer */
-ssize_t _network_send_packet(network_context_t *ctx,
-                             const void *src, size_t len)
+ssize_t _network_send_packet(network_context_t  *ctx,
+                             const struct iovec *iov, int iovcnt)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
     uint16_t packet_len;    /* network byte order */
+    struct iovec frame[MAX_PACKET_IOV + 1];
+    size_t len = 0;
+    int k;
 
-    assert(ctx && src);
+    assert(ctx && iov);
+    assert(iovcnt > 0 && iovcnt <= MAX_PACKET_IOV);
     assert(ctx->peer_addr_len > 0);
 
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
@@ -150,115 +206,315 @@ ssize_t _network_send_packet(network_context_t *ctx,
     if (_tcp_connect(ctx) < 0)
         return -1;
 
+    for (k = 0; k < iovcnt; ++k)
+    {
+        frame[k + 1] = iov[k];
+        len += iov[k].iov_len;
+    }
+    assert(len <= MAX_IP_PAYLOAD_LEN);
+
+    /* the length prefix and the packet go out together, so the peer isn't
+     * left holding a lone prefix while Nagle's algorithm delays the rest
+     */
     packet_len = htons(len);
-    if (_tcp_io(GET_SOCKET(ctx), &packet_len, sizeof(packet_len),
-                (io_func_t) write) < 0 ||
-        _tcp_io(GET_SOCKET(ctx), (void *) src, len, (io_func_t) write) < 0)
+    frame[0].iov_base = &packet_len;
+    frame[0].iov_len  = sizeof(packet_len);
+
+    if (tcp_io_ctx->base.uring)
+    {
+        /* batched with whatever else is going out */
+        if (_network_uring_send(tcp_io_ctx->base.uring, frame, iovcnt + 1) < 0)
+            return -1;
+    }
+    else if (_tcp_writev(GET_SOCKET(ctx), frame, iovcnt + 1) < 0)
+    {
         return -1;
+    }
 
     return len;
 }
 
-/* read a packet from the peer */
-ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
+/* read the peer's packets on whichever socket is being watched */
+int _network_prepare_recv(network_context_t *ctx)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
-    uint16_t packet_len;
-    socket_t io_socket;
-    int rc;
 
-    assert(ctx && dst);
+    assert(ctx);
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx && tcp_io_ctx->sock_ctx);
+
+    if (tcp_io_ctx->sock_ctx->is_active && _tcp_connect(ctx) < 0)
+        return -1;
+    return 0;
+}
+
+/* read a packet from the peer, or accept new connections on a passive
+ * socket.  this never blocks.
+ */
+ssize_t _network_recv_packet(network_context_t    *ctx,
+                             packet_queue_node_t **packet)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+
+    assert(ctx && packet);
 
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
     assert(tcp_io_ctx);
     assert(tcp_io_ctx->sock_ctx);
 
     VERIFY_SOCKET(ctx);
-    io_socket = tcp_io_ctx->base.socket;
 
-    if (tcp_io_ctx->sock_ctx->is_active && _tcp_connect(ctx) < 0)
+    if (tcp_io_ctx->sock_ctx->listening)
+    {
+        _tcp_accept(ctx);
+        errno = EAGAIN;
         return -1;
+    }
 
-    if (tcp_io_ctx->sock_ctx->listening/* ||
-        (tcp_io_ctx->sock_ctx->is_active && !tcp_io_ctx->connected)*/)
+    DEBUG_PEER(ctx);
+    return _tcp_read_frame(GET_SOCKET(ctx), &tcp_io_ctx->frame, packet);
+}
+
+/* the passive socket is no longer watched; drop any connections whose SYN
+ * hasn't arrived.  this runs on the poller thread that was watching them.
+ */
+void _network_recv_stopped(network_context_t *ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+    int k;
+
+    assert(ctx);
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx);
+
+    for (k = 0; k < MAX_NUM_PENDING_CONNECTIONS; ++k)
     {
+        tcp_pending_connection_t *pending = &tcp_io_ctx->pending[k];
+
+        if (pending->source.socket < 0)
+            continue;
+
+        _network_poll_remove(&pending->source);
+        closesocket(pending->source.socket);
+        pending->source.socket = -1;
+        _network_frame_discard(&pending->frame);
+    }
+}
+
+
+/* accept whatever connections are waiting on the passive socket.  each is
+ * watched (on the listener's poller thread) until its SYN packet arrives.
+ */
+static void _tcp_accept(network_context_t *ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx =
+        (network_context_socket_tcp_t *) ctx->impl_data;
+
+    for (;;)
+    {
+        tcp_pending_connection_t *pending = NULL;
+        struct sockaddr peer_addr;
+        socklen_t peer_addr_len = sizeof(peer_addr);
         socket_t tmp_sd;
+        int k;
+
+        for (k = 0; k < MAX_NUM_PENDING_CONNECTIONS && !pending; ++k)
+        {
+            if (tcp_io_ctx->pending[k].source.socket < 0)
+                pending = &tcp_io_ctx->pending[k];
+        }
+
+        if (!pending)
+        {
+            /* leave further connections in the kernel's backlog until a
+             * pending one is dispatched
+             */
+            DEBUG_LOG(("too many pending connections, pausing accept\n"));
+            tcp_io_ctx->accept_paused = TRUE;
+            _network_poll_enable(&tcp_io_ctx->base.recv_source, FALSE);
+            return;
+        }
 
-        ctx->peer_addr_len = sizeof(ctx->peer_addr);
-        if ((tmp_sd = accept(GET_SOCKET(ctx),
-                             &ctx->peer_addr,
-                             &ctx->peer_addr_len)) < 0)
+        if ((tmp_sd = accept(GET_SOCKET(ctx), &peer_addr,
+                             &peer_addr_len)) < 0)
         {
-            perror("accept (network_io_tcp)");
-            return tmp_sd;
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept (network_io_tcp)");
+            return;
         }
 
         DEBUG_LOG(("accepted from peer, tmp_sd=%d...\n", (int) tmp_sd));
 
-        /* keep listening socket open for futher connection requests */
-        /* we will not reenter this function until this SYN packet has
-         * been dispatched to the right context, and that context's
-         * socket updated to be 'new_socket'
-         */
-        assert(tcp_io_ctx->new_socket == -1);
-        tcp_io_ctx->new_socket = tmp_sd;
-        io_socket = tmp_sd;
+        memset(pending, 0, sizeof(*pending));
+        pending->listen_ctx    = tcp_io_ctx->sock_ctx;
+        pending->peer_addr     = peer_addr;
+        pending->peer_addr_len = peer_addr_len;
+        pending->source.socket = tmp_sd;
+        pending->source.busy_poll_usec =
+            tcp_io_ctx->base.recv_source.busy_poll_usec;
+        _network_poll_add(&pending->source, &tcp_io_ctx->base.recv_source,
+                          _tcp_pending_ready, NULL, pending);
     }
+}
 
-    DEBUG_PEER(ctx);
+/* an accepted connection has data.  once its SYN packet is complete, it's
+ * dispatched to the right context, whose socket is updated to be the
+ * accepted one (see _network_update_passive_state()).
+ */
+static void _tcp_pending_ready(void *arg)
+{
+    packet_queue_node_t *packet = NULL;
+    tcp_pending_connection_t *pending = (tcp_pending_connection_t *) arg;
+    network_context_socket_tcp_t *tcp_io_ctx;
+    mysock_context_t *listen_ctx;
+    socket_t tmp_sd;
+    ssize_t rc;
+
+    assert(pending && pending->listen_ctx);
+    listen_ctx = pending->listen_ctx;
+    tcp_io_ctx = (network_context_socket_tcp_t *)
+        listen_ctx->network_state.impl_data;
+    tmp_sd = pending->source.socket;
+
+    if ((rc = _tcp_read_frame(tmp_sd, &pending->frame, &packet)) < 0 &&
+        (errno == EAGAIN || errno == EINTR))
+        return;
 
-#ifdef DEBUG
-    if (getpeername(io_socket, &ctx->peer_addr, &ctx->peer_addr_len) < 0)
+    /* the accepted socket is the new context's from here on, or closed */
+    _network_poll_remove(&pending->source);
+    pending->source.socket = -1;
+
+    if (tcp_io_ctx->accept_paused)
     {
-        DEBUG_LOG(("getpeername failed (errno=%d)\n", errno));
-        return -1;
+        tcp_io_ctx->accept_paused = FALSE;
+        _network_poll_enable(&tcp_io_ctx->base.recv_source, TRUE);
     }
-#endif
 
-    if ((rc = _tcp_io(io_socket, &packet_len, sizeof(packet_len), read)) <= 0)
+    if (rc <= 0)
     {
-        DEBUG_LOG(("couldn't read packet len: %d\n", rc));
-        return rc;
+        DEBUG_LOG(("couldn't read SYN packet: %d\n", (int) rc));
+        closesocket(tmp_sd);
+        _network_frame_discard(&pending->frame);
+        return;
+    }
+
+    /* we will not reenter this until the SYN packet has been dispatched to
+     * the right context, and that context's socket updated to be
+     * 'new_socket'
+     */
+    PTHREAD_CALL(pthread_mutex_lock(&tcp_io_ctx->accept_lock));
+    assert(tcp_io_ctx->new_socket == -1);
+    tcp_io_ctx->new_socket = tmp_sd;
+    listen_ctx->network_state.peer_addr     = pending->peer_addr;
+    listen_ctx->network_state.peer_addr_len = pending->peer_addr_len;
+
+    _network_deliver_node(listen_ctx, packet);
+
+    if (tcp_io_ctx->new_socket != -1)
+    {
+        /* the SYN was dropped */
+        closesocket(tcp_io_ctx->new_socket);
+        tcp_io_ctx->new_socket = -1;
     }
+    PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->accept_lock));
+}
+
+/* read as much of the next length-prefixed packet as is waiting on tcp_sd,
+ * without blocking, straight into the frame's packet buffer.  once the
+ * packet is complete, returns its length (truncated to MAX_IP_PAYLOAD_LEN),
+ * with *packet set to the buffer; otherwise -1 with errno set to EAGAIN.
+ */
+static ssize_t _tcp_read_frame(socket_t tcp_sd, tcp_frame_t *frame,
+                               packet_queue_node_t **packet)
+{
+    size_t packet_len, len;
+    ssize_t rc;
+
+    assert(frame && packet);
 
-    packet_len = ntohs(packet_len);
-    if ((rc = _tcp_io(io_socket, dst, MIN(packet_len, max_len), read)) <= 0)
+    while (frame->len_read < sizeof(frame->packet_len))
     {
-        DEBUG_LOG(("couldn't read packet: %d\n", rc));
-        return rc;
+        if ((rc = recv(tcp_sd, (char *) &frame->packet_len + frame->len_read,
+                       sizeof(frame->packet_len) - frame->len_read,
+                       MSG_DONTWAIT)) <= 0)
+        {
+            DEBUG_LOG(("couldn't read packet len: %d\n", (int) rc));
+            return rc;
+        }
+        frame->len_read += rc;
     }
 
-    if (packet_len > max_len)
+    packet_len = ntohs(frame->packet_len);
+    while (frame->data_read < packet_len)
     {
-        /* discard unread remainder of packet */
-        char *dummy = (char *) alloca(packet_len - max_len);
-        (void) _tcp_io(io_socket, dummy, packet_len - max_len, read);
+        char discard[256];
+        char *buf;
+
+        /* anything beyond the buffer is read and thrown away */
+        if (frame->data_read < MAX_IP_PAYLOAD_LEN)
+        {
+            buf = _network_frame_data(frame) + frame->data_read;
+            len = MIN(packet_len, MAX_IP_PAYLOAD_LEN) - frame->data_read;
+        }
+        else
+        {
+            buf = discard;
+            len = MIN(packet_len - frame->data_read, sizeof(discard));
+        }
+
+        if ((rc = recv(tcp_sd, buf, len, MSG_DONTWAIT)) <= 0)
+        {
+            DEBUG_LOG(("couldn't read packet: %d\n", (int) rc));
+            return rc;
+        }
+        frame->data_read += rc;
     }
 
-    return packet_len;
+    *packet = _network_frame_take(frame);
+    return (*packet)->data_len;
 }
 
 
-/* read/write count bytes into/from buf */
-static int _tcp_io(socket_t tcp_sd, void *buf, size_t count, io_func_t io_func)
+/* write out the iovcnt buffers in iov, in a single system call if the
+ * socket will take it all at once.  iov is updated as it's written.
+ */
+static int _tcp_writev(socket_t tcp_sd, struct iovec *iov, int iovcnt)
 {
-    char *cbuf = (char *) buf;
-    size_t bytes_remaining;
+    size_t count = 0;
+    int k;
 
-    assert(buf && io_func);
-    for (bytes_remaining = count; bytes_remaining > 0; )
+    assert(iov && iovcnt > 0);
+    for (k = 0; k < iovcnt; ++k)
+        count += iov[k].iov_len;
+
+    while (iovcnt > 0)
     {
-        int rc;
+        ssize_t rc;
 
-        if ((rc = io_func(tcp_sd, cbuf, bytes_remaining)) <= 0)
+        if ((rc = writev(tcp_sd, iov, iovcnt)) <= 0)
         {
-            DEBUG_LOG(("_tcp_io rc: %d\n", rc));
+            if (rc < 0 && errno == EINTR)
+                continue;
+            DEBUG_LOG(("_tcp_writev rc: %d\n", (int) rc));
             return rc;
         }
 
-        assert(rc <= (int)bytes_remaining);
-        bytes_remaining -= rc;
-        cbuf += rc;
+        /* skip past whatever was written */
+        while (iovcnt > 0 && (size_t) rc >= iov->iov_len)
+        {
+            rc -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
     }
 
     return count;
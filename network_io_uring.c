@@ -0,0 +1,1185 @@
+/* network_io_uring.c--io_uring data path for the TCP network layer.
+ *
+ * with the network poller (network_io_socket.c), every packet received
+ * costs an epoll wakeup plus a recv() each for its length prefix and its
+ * body, and every packet sent costs a writev().  after myuring(), the
+ * sockets of connected mysockets bypass both:
+ *   - each keeps a multishot receive posted, which the kernel completes
+ *     into buffers it takes from a ring of buffers provided up front and
+ *     shared by all the sockets on an io_uring thread.  that thread
+ *     reassembles packets straight out of the buffers, handing each back
+ *     to the ring once it has been consumed.
+ *   - packets to send are appended to the connection's output buffer.  if
+ *     no send is in flight, one is started for the whole buffer; otherwise
+ *     the packet waits to go out with the next send, which the io_uring
+ *     thread submits as soon as the current one completes.  the output
+ *     buffers come from a slab registered with the kernel (while it lasts),
+ *     so sending from them doesn't pin and unpin pages each time.
+ * under load, each io_uring_enter() on an io_uring thread reaps receives
+ * and sends for many packets and submits the follow-on sends, and a packet
+ * sent while another is in flight costs no system call at all.
+ *
+ * each ring is only ever submitted to by its own thread, so the kernel can
+ * leave completion work for that thread to run when it next asks for
+ * completions, rather than interrupting whichever thread submitted the
+ * request.  other threads post requests (start, send, resume, stop) on the
+ * ring's list, and wake its thread through an eventfd it keeps a read
+ * posted on.
+ *
+ * listening sockets, and accepted ones until their SYN arrives, stay with
+ * the network poller.  this talks to the kernel with raw system calls
+ * rather than needing liburing, and needs Linux 6.0 or later (for
+ * multishot receives into provided buffers).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "network_io_socket.h"
+
+
+/* number of io_uring threads, each with its own ring.  sockets are spread
+ * across them by descriptor.
+ */
+#define URING_NUM_RINGS     2
+
+#define URING_SQ_ENTRIES    1024
+#define URING_CQ_ENTRIES    8192
+
+/* provided receive buffers, per ring (a power of two) */
+#define URING_RECV_BUFS     512
+#define URING_RECV_BUF_SIZE (16 * 1024)
+#define URING_BGID          0
+
+/* each connection has two output buffers:  one being sent, and one
+ * collecting packets for the next send.  the first URING_SEND_CHUNKS of
+ * them (per ring) come from the registered slab.
+ */
+#define URING_SEND_CHUNK    (16 * 1024)
+#define URING_SEND_CHUNKS   128
+
+/* what a completion is for, in the low bits of its user_data; the rest is
+ * the connection (if any)
+ */
+#define URING_TAG_WAKE      0
+#define URING_TAG_RECV      1
+#define URING_TAG_SEND      2
+#define URING_TAG_CANCEL    3
+#define URING_TAG_MASK      3
+
+#define URING_NO_BUF        (-1)
+
+
+struct uring_ring;
+
+typedef struct
+{
+    char        *data;
+    size_t       len;
+    bool_t       fixed;         /* from the registered slab */
+} uring_chunk_t;
+
+typedef struct uring_conn
+{
+    struct uring_ring *ring;
+    mysock_context_t  *ctx;
+    socket_t           socket;
+
+    /* receiving.  these are only touched by the ring's thread. */
+    tcp_frame_t        frame;           /* packet being reassembled */
+    bool_t             frame_ready;     /* ...and complete */
+    int                held_head;       /* buffers not yet consumed */
+    int                held_tail;
+    bool_t             armed;           /* multishot receive posted */
+    bool_t             cancelling;
+    bool_t             paused;          /* network_recv_queue is full */
+    bool_t             starved;         /* ran out of provided buffers */
+    bool_t             eof, eof_delivered;
+    bool_t             dead;            /* being stopped */
+    struct uring_conn *next_starved;
+
+    /* requests to the ring's thread, protected by the ring's lock */
+    bool_t             queued;
+    bool_t             start, send, resume, stopping, stopped;
+    struct uring_conn *next_request;
+
+    /* sending, protected by send_lock.  out[fill] collects packets, while
+     * out[1 - fill] is being sent if 'sending' is set.
+     */
+    pthread_mutex_t    send_lock;
+    pthread_cond_t     send_cond;       /* an output buffer was sent */
+    uring_chunk_t      out[2];
+    int                fill;
+    bool_t             sending;
+    bool_t             send_posted;     /* ring's thread has been asked */
+    size_t             sent;            /* bytes of out[1 - fill] sent */
+    int                send_error;
+} uring_conn_t;
+
+typedef struct uring_ring
+{
+    int                 fd;
+    void               *ring_ptr;
+    size_t              ring_len;
+
+    /* submission and completion queues, only used by the ring's thread */
+    unsigned int       *sq_head, *sq_tail, sq_mask, sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned int       *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* provided receive buffers.  held_* chain the buffers a connection
+     * hasn't consumed yet, and where it's up to in each.
+     */
+    struct io_uring_buf_ring *br;
+    char               *bufs;
+    unsigned int        br_tail;
+    unsigned int        recycled, starved_mark;
+    uring_conn_t       *starved;
+    int                 held_next[URING_RECV_BUFS];
+    size_t              held_off[URING_RECV_BUFS];
+    size_t              held_len[URING_RECV_BUFS];
+
+    /* registered output buffers; free_chunks is protected by lock */
+    char               *slab;
+    bool_t              slab_registered;
+    int                 free_chunks[URING_SEND_CHUNKS];
+    int                 num_free_chunks;
+
+    /* requests from other threads.  wake_pending is set once wake_fd has
+     * been written to, until the ring's thread next looks at the list.
+     */
+    pthread_mutex_t     lock;
+    pthread_cond_t      stopped_cond;
+    uring_conn_t       *requests;
+    int                 wake_fd;
+    int                 wake_pending;
+    eventfd_t           wake_count;     /* read into by the kernel */
+    pthread_t           thread;
+} uring_ring_t;
+
+
+static uring_ring_t    rings[URING_NUM_RINGS];
+static bool_t          uring_wanted;    /* myuring() was called */
+static bool_t          uring_ready;     /* ...and the rings are running */
+static int             uring_errno;
+static pthread_once_t  uring_once = PTHREAD_ONCE_INIT;
+static bool_t          uring_atfork_registered;
+
+
+static void _uring_init(void);
+static void _uring_atfork_child(void);
+static void *_uring_thread_func(void *arg);
+static void _uring_arm_recv(uring_conn_t *conn);
+static void _uring_maybe_finish(uring_conn_t *conn);
+
+
+static int _uring_enter(uring_ring_t *r, unsigned int to_submit,
+                        unsigned int min_complete, unsigned int flags)
+{
+    return (int) syscall(__NR_io_uring_enter, r->fd, to_submit,
+                         min_complete, flags, NULL, 0);
+}
+
+/* the number of entries queued but not yet taken by the kernel */
+static unsigned int _uring_sq_pending(uring_ring_t *r)
+{
+    return *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* the next free submission queue entry, cleared.  it's submitted with
+ * everything else on the ring thread's next trip into the kernel.
+ */
+static struct io_uring_sqe *_uring_get_sqe(uring_ring_t *r)
+{
+    struct io_uring_sqe *sqe;
+
+    while (_uring_sq_pending(r) >= r->sq_entries)
+    {
+        /* full; hand what's there to the kernel first */
+        if (_uring_enter(r, r->sq_entries, 0, 0) < 0)
+            assert(errno == EINTR || errno == EAGAIN || errno == EBUSY);
+    }
+
+    sqe = &r->sqes[*r->sq_tail & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void _uring_push(uring_ring_t *r)
+{
+    __atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+/* keep a read posted on the eventfd other threads wake us with */
+static void _uring_arm_wake(uring_ring_t *r)
+{
+    struct io_uring_sqe *sqe = _uring_get_sqe(r);
+
+    sqe->opcode    = IORING_OP_READ;
+    sqe->fd        = r->wake_fd;
+    sqe->addr      = (uintptr_t) &r->wake_count;
+    sqe->len       = sizeof(r->wake_count);
+    sqe->user_data = URING_TAG_WAKE;
+    _uring_push(r);
+}
+
+/* have the ring's thread look at its requests.  only the first of several
+ * wakeups before it does costs a system call.
+ */
+static void _uring_wake(uring_ring_t *r)
+{
+    if (!__atomic_exchange_n(&r->wake_pending, TRUE, __ATOMIC_ACQ_REL) &&
+        eventfd_write(r->wake_fd, 1) < 0)
+    {
+        perror("eventfd_write");
+        assert(0);
+        abort();
+    }
+}
+
+
+/* give buffer bid back to the kernel */
+static void _uring_recycle(uring_ring_t *r, int bid)
+{
+    struct io_uring_buf *buf;
+
+    assert(bid >= 0 && bid < URING_RECV_BUFS);
+
+    /* not br->bufs[], which C++ places after an empty struct (of size 1)
+     * in the header's flexible array
+     */
+    buf = (struct io_uring_buf *) r->br + (r->br_tail & (URING_RECV_BUFS - 1));
+    buf->addr = (uintptr_t) (r->bufs + (size_t) bid * URING_RECV_BUF_SIZE);
+    buf->len  = URING_RECV_BUF_SIZE;
+    buf->bid  = (uint16_t) bid;
+    ++r->br_tail;
+    __atomic_store_n(&r->br->tail, (uint16_t) r->br_tail, __ATOMIC_RELEASE);
+    ++r->recycled;
+}
+
+static void _uring_hold(uring_conn_t *conn, int bid, size_t off, size_t len)
+{
+    uring_ring_t *r = conn->ring;
+
+    r->held_next[bid] = URING_NO_BUF;
+    r->held_off[bid]  = off;
+    r->held_len[bid]  = len;
+    if (conn->held_tail != URING_NO_BUF)
+        r->held_next[conn->held_tail] = bid;
+    else
+        conn->held_head = bid;
+    conn->held_tail = bid;
+}
+
+static void _uring_release_held(uring_conn_t *conn)
+{
+    uring_ring_t *r = conn->ring;
+    int bid;
+
+    while ((bid = conn->held_head) != URING_NO_BUF)
+    {
+        conn->held_head = r->held_next[bid];
+        _uring_recycle(r, bid);
+    }
+    conn->held_tail = URING_NO_BUF;
+}
+
+
+/* post a multishot receive on the connection's socket */
+static void _uring_arm_recv(uring_conn_t *conn)
+{
+    struct io_uring_sqe *sqe = _uring_get_sqe(conn->ring);
+
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = conn->socket;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = (uintptr_t) conn | URING_TAG_RECV;
+    _uring_push(conn->ring);
+
+    conn->armed = TRUE;
+    conn->cancelling = FALSE;
+}
+
+/* withdraw the connection's multishot receive */
+static void _uring_cancel_recv(uring_conn_t *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!conn->armed || conn->cancelling)
+        return;
+
+    sqe = _uring_get_sqe(conn->ring);
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->addr      = (uintptr_t) conn | URING_TAG_RECV;
+    sqe->user_data = URING_TAG_CANCEL;
+    _uring_push(conn->ring);
+    conn->cancelling = TRUE;
+}
+
+/* can another packet be queued for the transport?  if not, receiving stops
+ * until _network_resume_recv() is called.
+ */
+static bool_t _uring_has_room(uring_conn_t *conn)
+{
+    packet_queue_t *pq = &conn->ctx->network_recv_queue;
+
+    if (_mysock_queue_has_room(pq, FALSE) ||
+        !_mysock_queue_wait_room(pq, FALSE))
+        return TRUE;
+
+    /* anything already on its way is held until then */
+    conn->paused = TRUE;
+    _uring_cancel_recv(conn);
+    return FALSE;
+}
+
+/* add up to len bytes of the stream to the packet being reassembled,
+ * returning the number used
+ */
+static size_t _uring_frame_feed(tcp_frame_t *frame, bool_t *complete,
+                                const char *data, size_t len)
+{
+    size_t used = 0, packet_len, n;
+
+    if (frame->len_read < sizeof(frame->packet_len))
+    {
+        n = MIN(len, sizeof(frame->packet_len) - frame->len_read);
+        memcpy((char *) &frame->packet_len + frame->len_read, data, n);
+        frame->len_read += n;
+        used += n;
+        if (frame->len_read < sizeof(frame->packet_len))
+            return used;
+    }
+
+    /* anything beyond the buffer is thrown away */
+    packet_len = ntohs(frame->packet_len);
+    n = MIN(len - used, packet_len - frame->data_read);
+    if (frame->data_read < MAX_IP_PAYLOAD_LEN)
+    {
+        memcpy(_network_frame_data(frame) + frame->data_read, data + used,
+               MIN(n, MAX_IP_PAYLOAD_LEN - frame->data_read));
+    }
+    frame->data_read += n;
+    used += n;
+
+    *complete = (frame->data_read == packet_len);
+    return used;
+}
+
+/* pass the packets in len bytes of the stream up to the mysocket layer,
+ * stopping early if the transport's queue fills.  returns the number of
+ * bytes consumed.
+ */
+static size_t _uring_consume(uring_conn_t *conn, const char *data, size_t len)
+{
+    tcp_frame_t *frame = &conn->frame;
+    size_t used = 0;
+
+    for (;;)
+    {
+        if (conn->frame_ready)
+        {
+            if (!_uring_has_room(conn))
+                break;
+
+            _network_deliver_node(conn->ctx, _network_frame_take(frame));
+            conn->frame_ready = FALSE;
+        }
+
+        if (used == len)
+            break;
+
+        /* usually the whole packet is in the buffer, and is passed on
+         * from there
+         */
+        if (frame->len_read == 0 && len - used >= sizeof(uint16_t))
+        {
+            uint16_t packet_len;
+
+            memcpy(&packet_len, data + used, sizeof(packet_len));
+            packet_len = ntohs(packet_len);
+            if (packet_len <= MAX_IP_PAYLOAD_LEN &&
+                len - used - sizeof(packet_len) >= packet_len)
+            {
+                if (!_uring_has_room(conn))
+                    break;
+
+                _network_deliver_packet(conn->ctx,
+                                        data + used + sizeof(packet_len),
+                                        packet_len);
+                used += sizeof(packet_len) + packet_len;
+                continue;
+            }
+        }
+
+        used += _uring_frame_feed(frame, &conn->frame_ready,
+                                  data + used, len - used);
+    }
+
+    return used;
+}
+
+/* once everything before it has been passed on, tell the transport the
+ * connection to the peer is gone
+ */
+static void _uring_check_eof(uring_conn_t *conn)
+{
+    if (conn->eof && !conn->eof_delivered && !conn->dead &&
+        !conn->paused && conn->held_head == URING_NO_BUF &&
+        !conn->frame_ready)
+    {
+        _mysock_enqueue_buffer(conn->ctx, &conn->ctx->network_recv_queue,
+                               NULL, 0);
+        conn->eof_delivered = TRUE;
+    }
+}
+
+/* pass on as much of what's been held as the transport will take */
+static void _uring_drain(uring_conn_t *conn)
+{
+    uring_ring_t *r = conn->ring;
+
+    conn->paused = FALSE;
+    (void) _uring_consume(conn, NULL, 0);
+
+    while (!conn->paused && conn->held_head != URING_NO_BUF)
+    {
+        int bid = conn->held_head;
+
+        r->held_off[bid] += _uring_consume(
+            conn,
+            r->bufs + (size_t) bid * URING_RECV_BUF_SIZE + r->held_off[bid],
+            r->held_len[bid] - r->held_off[bid]);
+
+        if (r->held_off[bid] == r->held_len[bid])
+        {
+            if ((conn->held_head = r->held_next[bid]) == URING_NO_BUF)
+                conn->held_tail = URING_NO_BUF;
+            _uring_recycle(r, bid);
+        }
+    }
+
+    if (!conn->paused && !conn->armed && !conn->starved && !conn->eof)
+        _uring_arm_recv(conn);
+    _uring_check_eof(conn);
+}
+
+static void _uring_recv_done(uring_ring_t *r, uring_conn_t *conn,
+                             int res, unsigned int flags)
+{
+    if (res > 0)
+    {
+        int bid = (int) (flags >> IORING_CQE_BUFFER_SHIFT);
+        size_t used = 0;
+
+        assert(flags & IORING_CQE_F_BUFFER);
+        if (!conn->dead && !conn->paused && conn->held_head == URING_NO_BUF)
+        {
+            used = _uring_consume(conn, r->bufs +
+                                  (size_t) bid * URING_RECV_BUF_SIZE, res);
+        }
+
+        if (conn->dead || used == (size_t) res)
+            _uring_recycle(r, bid);
+        else
+            _uring_hold(conn, bid, used, res);
+    }
+    else if (res == -ENOBUFS)
+    {
+        /* re-armed once some buffers come back */
+        if (!(flags & IORING_CQE_F_MORE) && !conn->dead)
+        {
+            conn->starved      = TRUE;
+            conn->next_starved = r->starved;
+            r->starved         = conn;
+            r->starved_mark    = r->recycled;
+        }
+    }
+    else if (res != -ECANCELED)
+    {
+        /* end of stream (res == 0), or the connection failed */
+        DEBUG_LOG(("multishot recv finished: %d\n", res));
+        conn->eof = TRUE;
+    }
+
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        conn->armed = conn->cancelling = FALSE;
+        if (!conn->dead && !conn->paused && !conn->starved && !conn->eof)
+            _uring_arm_recv(conn);
+    }
+
+    _uring_check_eof(conn);
+    if (!conn->armed)
+        _uring_maybe_finish(conn);
+}
+
+/* re-arm the connections that ran out of buffers, once there are some */
+static void _uring_rearm_starved(uring_ring_t *r)
+{
+    uring_conn_t *conn;
+
+    if (!r->starved || r->recycled == r->starved_mark)
+        return;
+
+    while ((conn = r->starved) != NULL)
+    {
+        r->starved = conn->next_starved;
+        conn->starved = FALSE;
+        if (!conn->paused && !conn->armed && !conn->eof)
+            _uring_arm_recv(conn);
+    }
+}
+
+
+/* send whatever's left of the output buffer in flight.  the caller holds
+ * send_lock.
+ */
+static void _uring_queue_send(uring_conn_t *conn)
+{
+    uring_chunk_t *chunk = &conn->out[1 - conn->fill];
+    struct io_uring_sqe *sqe = _uring_get_sqe(conn->ring);
+
+    assert(conn->sending && conn->sent < chunk->len);
+
+    if (chunk->fixed)
+    {
+        sqe->opcode    = IORING_OP_WRITE_FIXED;
+        sqe->off       = (uint64_t) -1;     /* no file position */
+        sqe->buf_index = 0;
+    }
+    else
+    {
+        sqe->opcode    = IORING_OP_SEND;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    sqe->fd        = conn->socket;
+    sqe->addr      = (uintptr_t) (chunk->data + conn->sent);
+    sqe->len       = (uint32_t) (chunk->len - conn->sent);
+    sqe->user_data = (uintptr_t) conn | URING_TAG_SEND;
+    _uring_push(conn->ring);
+}
+
+/* start sending the packets collected so far, if there are any and nothing
+ * is in flight.  the caller holds send_lock.
+ */
+static void _uring_send_next(uring_conn_t *conn)
+{
+    if (conn->sending || conn->send_error || !conn->out[conn->fill].len)
+        return;
+
+    assert(conn->out[1 - conn->fill].len == 0);
+    conn->fill    = 1 - conn->fill;
+    conn->sending = TRUE;
+    conn->sent    = 0;
+    _uring_queue_send(conn);
+}
+
+static void _uring_send_done(uring_conn_t *conn, int res)
+{
+    uring_chunk_t *chunk;
+
+    PTHREAD_CALL(pthread_mutex_lock(&conn->send_lock));
+    chunk = &conn->out[1 - conn->fill];
+    if (res < 0)
+    {
+        DEBUG_LOG(("io_uring send failed: %d\n", res));
+        conn->send_error = -res;
+        conn->sending = FALSE;
+        chunk->len = conn->out[conn->fill].len = 0;
+        PTHREAD_CALL(pthread_cond_broadcast(&conn->send_cond));
+    }
+    else if ((conn->sent += res) < chunk->len)
+    {
+        _uring_queue_send(conn);    /* a short write */
+    }
+    else
+    {
+        chunk->len = 0;
+        conn->sending = FALSE;
+        _uring_send_next(conn);
+        PTHREAD_CALL(pthread_cond_broadcast(&conn->send_cond));
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&conn->send_lock));
+
+    _uring_maybe_finish(conn);
+}
+
+
+/* a stopping connection is finished with once nothing is in flight for
+ * it.  the stopper may free it as soon as this says so, so this must be
+ * the last thing the ring's thread does with it.
+ */
+static void _uring_maybe_finish(uring_conn_t *conn)
+{
+    uring_ring_t *r = conn->ring;
+    bool_t sending;
+
+    if (!conn->dead || conn->armed)
+        return;
+
+    PTHREAD_CALL(pthread_mutex_lock(&conn->send_lock));
+    sending = conn->sending;
+    PTHREAD_CALL(pthread_mutex_unlock(&conn->send_lock));
+    if (sending)
+        return;
+
+    PTHREAD_CALL(pthread_mutex_lock(&r->lock));
+    conn->stopped = TRUE;
+    PTHREAD_CALL(pthread_cond_broadcast(&r->stopped_cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&r->lock));
+}
+
+static void _uring_kill(uring_conn_t *conn)
+{
+    uring_ring_t *r = conn->ring;
+    uring_conn_t **p;
+
+    conn->dead = TRUE;
+    conn->frame_ready = FALSE;
+    _uring_release_held(conn);
+
+    for (p = &r->starved; *p; p = &(*p)->next_starved)
+    {
+        if (*p == conn)
+        {
+            *p = conn->next_starved;
+            break;
+        }
+    }
+
+    _uring_cancel_recv(conn);
+    _uring_maybe_finish(conn);
+}
+
+/* act on the requests other threads have posted */
+static void _uring_run_requests(uring_ring_t *r)
+{
+    uring_conn_t *conn, *next;
+
+    /* anything posted from here on needs another wakeup */
+    __atomic_store_n(&r->wake_pending, FALSE, __ATOMIC_SEQ_CST);
+
+    PTHREAD_CALL(pthread_mutex_lock(&r->lock));
+    conn = r->requests;
+    r->requests = NULL;
+    PTHREAD_CALL(pthread_mutex_unlock(&r->lock));
+
+    for (; conn; conn = next)
+    {
+        bool_t start, send, resume, stopping;
+
+        PTHREAD_CALL(pthread_mutex_lock(&r->lock));
+        next     = conn->next_request;
+        start    = conn->start;
+        send     = conn->send;
+        resume   = conn->resume;
+        stopping = conn->stopping;
+        conn->queued = conn->start = conn->send = conn->resume = FALSE;
+        PTHREAD_CALL(pthread_mutex_unlock(&r->lock));
+
+        if (conn->dead)
+            continue;
+
+        if (start)
+            _uring_arm_recv(conn);
+
+        /* anything sent before the stop still goes out */
+        if (send)
+        {
+            PTHREAD_CALL(pthread_mutex_lock(&conn->send_lock));
+            conn->send_posted = FALSE;
+            _uring_send_next(conn);
+            PTHREAD_CALL(pthread_mutex_unlock(&conn->send_lock));
+        }
+
+        if (stopping)
+            _uring_kill(conn);
+        else if (resume && conn->paused)
+            _uring_drain(conn);
+    }
+}
+
+/* ask the ring's thread to look at conn.  the caller holds the ring's
+ * lock, and wakes the thread once it has let go of it.
+ */
+static void _uring_post(uring_conn_t *conn)
+{
+    uring_ring_t *r = conn->ring;
+
+    if (!conn->queued)
+    {
+        conn->queued       = TRUE;
+        conn->next_request = r->requests;
+        r->requests        = conn;
+    }
+}
+
+static void *_uring_thread_func(void *arg)
+{
+    uring_ring_t *r = (uring_ring_t *) arg;
+
+    assert(r);
+
+    /* this makes the thread the ring's only submitter */
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_ENABLE_RINGS,
+                NULL, 0) < 0)
+    {
+        perror("io_uring_register");
+        assert(0);
+        abort();
+    }
+    _uring_arm_wake(r);
+
+    for (;;)
+    {
+        unsigned int head, tail;
+
+        /* submit whatever's queued, and wait for something to finish if
+         * nothing has yet
+         */
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        if (_uring_enter(r, _uring_sq_pending(r), (head == tail) ? 1 : 0,
+                         IORING_ENTER_GETEVENTS) < 0)
+        {
+            assert(errno == EINTR || errno == EAGAIN || errno == EBUSY);
+        }
+
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+            uring_conn_t *conn = (uring_conn_t *)
+                (uintptr_t) (cqe->user_data & ~(uint64_t) URING_TAG_MASK);
+
+            switch (cqe->user_data & URING_TAG_MASK)
+            {
+            case URING_TAG_RECV:
+                _uring_recv_done(r, conn, cqe->res, cqe->flags);
+                break;
+
+            case URING_TAG_SEND:
+                _uring_send_done(conn, cqe->res);
+                break;
+
+            case URING_TAG_WAKE:
+                _uring_arm_wake(r);
+                break;
+
+            default:
+                break;
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+        _uring_run_requests(r);
+        _uring_rearm_starved(r);
+    }
+
+    /*NOTREACHED*/
+    return NULL;
+}
+
+
+/* set up one ring, with its buffers; returns -1 with errno set if the
+ * kernel can't do what's needed
+ */
+static int _uring_setup(uring_ring_t *r)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    struct iovec slab_iov;
+    char *ptr;
+    int k;
+
+    /* the ring starts disabled, and its thread enables it.  from 6.1, that
+     * makes the thread its only submitter, and it runs the completion work
+     * itself when it next waits; older kernels do without.
+     */
+    memset(&p, 0, sizeof(p));
+    p.flags      = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP |
+                   IORING_SETUP_R_DISABLED | IORING_SETUP_SINGLE_ISSUER |
+                   IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = URING_CQ_ENTRIES;
+    r->fd = (int) syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+    if (r->fd < 0 && errno == EINVAL)
+    {
+        p.flags &= ~(IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+        r->fd = (int) syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+    }
+    if (r->fd < 0)
+        return -1;
+    r->sq_entries = p.sq_entries;
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP) ||
+        !(p.features & IORING_FEAT_RW_CUR_POS))
+    {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    r->ring_len = MAX(p.sq_off.array + p.sq_entries * sizeof(unsigned int),
+                      p.cq_off.cqes +
+                      p.cq_entries * sizeof(struct io_uring_cqe));
+    r->ring_ptr = mmap(NULL, r->ring_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->sqes = (struct io_uring_sqe *)
+        mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+             r->fd, IORING_OFF_SQES);
+    if (r->ring_ptr == MAP_FAILED || r->sqes == MAP_FAILED)
+        return -1;
+
+    ptr = (char *) r->ring_ptr;
+    r->sq_head = (unsigned int *) (ptr + p.sq_off.head);
+    r->sq_tail = (unsigned int *) (ptr + p.sq_off.tail);
+    r->sq_mask = *(unsigned int *) (ptr + p.sq_off.ring_mask);
+    r->cq_head = (unsigned int *) (ptr + p.cq_off.head);
+    r->cq_tail = (unsigned int *) (ptr + p.cq_off.tail);
+    r->cq_mask = *(unsigned int *) (ptr + p.cq_off.ring_mask);
+    r->cqes    = (struct io_uring_cqe *) (ptr + p.cq_off.cqes);
+
+    /* submission queue entries are used in order */
+    for (k = 0; k < (int) p.sq_entries; ++k)
+        ((unsigned int *) (ptr + p.sq_off.array))[k] = k;
+
+    /* provided buffers for receiving */
+    r->br = (struct io_uring_buf_ring *)
+        mmap(NULL, URING_RECV_BUFS * sizeof(struct io_uring_buf),
+             PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    r->bufs = (char *) malloc((size_t) URING_RECV_BUFS * URING_RECV_BUF_SIZE);
+    if (r->br == MAP_FAILED || !r->bufs)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uintptr_t) r->br;
+    reg.ring_entries = URING_RECV_BUFS;
+    reg.bgid         = URING_BGID;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0)
+    {
+        errno = ENOSYS;     /* older than 5.19 */
+        return -1;
+    }
+    for (k = 0; k < URING_RECV_BUFS; ++k)
+        _uring_recycle(r, k);
+
+    /* the output buffer slab.  sends from elsewhere still work if it
+     * can't be registered (e.g. because of RLIMIT_MEMLOCK).
+     */
+    r->slab = (char *) mmap(NULL,
+                            (size_t) URING_SEND_CHUNKS * URING_SEND_CHUNK,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->slab != MAP_FAILED)
+    {
+        slab_iov.iov_base = r->slab;
+        slab_iov.iov_len  = (size_t) URING_SEND_CHUNKS * URING_SEND_CHUNK;
+        r->slab_registered =
+            (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+                     &slab_iov, 1) == 0);
+    }
+    if (r->slab_registered)
+    {
+        for (k = 0; k < URING_SEND_CHUNKS; ++k)
+            r->free_chunks[k] = URING_SEND_CHUNKS - 1 - k;
+        r->num_free_chunks = URING_SEND_CHUNKS;
+    }
+    else
+    {
+        DEBUG_LOG(("couldn't register io_uring send buffers\n"));
+    }
+
+    if ((r->wake_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+        return -1;
+
+    PTHREAD_CALL(pthread_mutex_init(&r->lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&r->stopped_cond, NULL));
+    return 0;
+}
+
+static void _uring_teardown(uring_ring_t *r)
+{
+    if (r->fd >= 0)
+        (void) close(r->fd);
+    if (r->wake_fd >= 0)
+        (void) close(r->wake_fd);
+    if (r->ring_ptr && r->ring_ptr != MAP_FAILED)
+        (void) munmap(r->ring_ptr, r->ring_len);
+    if (r->sqes && r->sqes != MAP_FAILED)
+        (void) munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+    if (r->br && r->br != MAP_FAILED)
+        (void) munmap(r->br, URING_RECV_BUFS * sizeof(struct io_uring_buf));
+    if (r->slab && r->slab != MAP_FAILED)
+        (void) munmap(r->slab, (size_t) URING_SEND_CHUNKS * URING_SEND_CHUNK);
+    free(r->bufs);
+    memset(r, 0, sizeof(*r));
+    r->fd = r->wake_fd = -1;
+}
+
+static void _uring_init(void)
+{
+    int k;
+
+    if (!uring_atfork_registered)
+    {
+        PTHREAD_CALL(pthread_atfork(NULL, NULL, _uring_atfork_child));
+        uring_atfork_registered = TRUE;
+    }
+
+    /* a peer going away shows up as a failed send, not a signal */
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    {
+        perror("signal(SIGPIPE)");
+        assert(0);
+    }
+
+    for (k = 0; k < URING_NUM_RINGS; ++k)
+        rings[k].fd = rings[k].wake_fd = -1;
+
+    for (k = 0; k < URING_NUM_RINGS; ++k)
+    {
+        if (_uring_setup(&rings[k]) < 0)
+        {
+            uring_errno = errno;
+            DEBUG_LOG(("io_uring unavailable: %s\n", strerror(errno)));
+            for (k = 0; k < URING_NUM_RINGS; ++k)
+                _uring_teardown(&rings[k]);
+            return;
+        }
+    }
+
+    for (k = 0; k < URING_NUM_RINGS; ++k)
+    {
+        rings[k].thread = _mysock_create_thread(_uring_thread_func,
+                                                &rings[k], TRUE);
+    }
+    uring_ready = TRUE;
+}
+
+/* the io_uring threads don't survive fork(), and the child would otherwise
+ * share the parent's rings.  as with the network poller, the child sets up
+ * its own once it needs them.
+ */
+static void _uring_atfork_child(void)
+{
+    int k;
+
+    if (!uring_ready)
+        return;
+
+    for (k = 0; k < URING_NUM_RINGS; ++k)
+        _uring_teardown(&rings[k]);
+    uring_ready = FALSE;
+    uring_once = PTHREAD_ONCE_INIT;
+}
+
+
+/* switch to io_uring for connections set up from now on (see myuring()) */
+int _network_enable_uring(void)
+{
+    PTHREAD_CALL(pthread_once(&uring_once, _uring_init));
+    if (!uring_ready)
+    {
+        errno = uring_errno;
+        return -1;
+    }
+
+    uring_wanted = TRUE;
+    return 0;
+}
+
+bool_t _network_uring_enabled(void)
+{
+    if (!uring_wanted)
+        return FALSE;
+
+    /* e.g. in a child process, which sets up its own rings */
+    PTHREAD_CALL(pthread_once(&uring_once, _uring_init));
+    return uring_ready;
+}
+
+static void _uring_alloc_chunk(uring_ring_t *r, uring_chunk_t *chunk)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&r->lock));
+    if (r->num_free_chunks > 0)
+    {
+        chunk->data  = r->slab +
+            (size_t) r->free_chunks[--r->num_free_chunks] * URING_SEND_CHUNK;
+        chunk->fixed = TRUE;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&r->lock));
+
+    if (!chunk->fixed)
+    {
+        chunk->data = (char *) malloc(URING_SEND_CHUNK);
+        assert(chunk->data);
+    }
+    chunk->len = 0;
+}
+
+static void _uring_free_chunk(uring_ring_t *r, uring_chunk_t *chunk)
+{
+    if (!chunk->fixed)
+    {
+        free(chunk->data);
+        return;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&r->lock));
+    assert(r->num_free_chunks < URING_SEND_CHUNKS);
+    r->free_chunks[r->num_free_chunks++] =
+        (int) ((chunk->data - r->slab) / URING_SEND_CHUNK);
+    PTHREAD_CALL(pthread_mutex_unlock(&r->lock));
+}
+
+/* start receiving on ctx's (connected) socket through io_uring */
+uring_conn_t *_network_uring_start(mysock_context_t *ctx, socket_t sd)
+{
+    uring_conn_t *conn;
+    uring_ring_t *r;
+
+    assert(ctx && sd >= 0 && uring_ready);
+
+    conn = (uring_conn_t *) calloc(1, sizeof(uring_conn_t));
+    assert(conn);
+
+    r = conn->ring  = &rings[(unsigned int) sd % URING_NUM_RINGS];
+    conn->ctx       = ctx;
+    conn->socket    = sd;
+    conn->held_head = conn->held_tail = URING_NO_BUF;
+    PTHREAD_CALL(pthread_mutex_init(&conn->send_lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&conn->send_cond, NULL));
+    _uring_alloc_chunk(r, &conn->out[0]);
+    _uring_alloc_chunk(r, &conn->out[1]);
+
+    PTHREAD_CALL(pthread_mutex_lock(&r->lock));
+    conn->start = TRUE;
+    _uring_post(conn);
+    PTHREAD_CALL(pthread_mutex_unlock(&r->lock));
+    _uring_wake(r);
+
+    return conn;
+}
+
+/* stop receiving, and wait for anything still being sent to go out.  the
+ * connection is freed once the ring's thread is done with it.
+ */
+void _network_uring_stop(uring_conn_t *conn)
+{
+    uring_ring_t *r;
+
+    assert(conn);
+    r = conn->ring;
+    assert(!pthread_equal(pthread_self(), r->thread));
+
+    PTHREAD_CALL(pthread_mutex_lock(&r->lock));
+    conn->stopping = TRUE;
+    _uring_post(conn);
+    PTHREAD_CALL(pthread_mutex_unlock(&r->lock));
+    _uring_wake(r);
+
+    PTHREAD_CALL(pthread_mutex_lock(&r->lock));
+    while (!conn->stopped)
+        PTHREAD_CALL(pthread_cond_wait(&r->stopped_cond, &r->lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&r->lock));
+
+    _uring_free_chunk(r, &conn->out[0]);
+    _uring_free_chunk(r, &conn->out[1]);
+    _network_frame_discard(&conn->frame);
+    PTHREAD_CALL(pthread_mutex_destroy(&conn->send_lock));
+    PTHREAD_CALL(pthread_cond_destroy(&conn->send_cond));
+    free(conn);
+}
+
+/* the transport has made room in its queue again */
+void _network_uring_resume(uring_conn_t *conn)
+{
+    uring_ring_t *r;
+
+    assert(conn);
+    r = conn->ring;
+
+    PTHREAD_CALL(pthread_mutex_lock(&r->lock));
+    conn->resume = TRUE;
+    _uring_post(conn);
+    PTHREAD_CALL(pthread_mutex_unlock(&r->lock));
+    _uring_wake(r);
+}
+
+/* queue a frame, gathered from the iovcnt buffers in iov, to be sent.
+ * this only waits if both output buffers are full.
+ */
+ssize_t _network_uring_send(uring_conn_t *conn,
+                            const struct iovec *iov, int iovcnt)
+{
+    uring_ring_t *r;
+    uring_chunk_t *chunk;
+    bool_t post = FALSE;
+    size_t len = 0;
+    int k;
+
+    assert(conn && iov && iovcnt > 0);
+    r = conn->ring;
+    for (k = 0; k < iovcnt; ++k)
+        len += iov[k].iov_len;
+    assert(len <= URING_SEND_CHUNK);
+
+    PTHREAD_CALL(pthread_mutex_lock(&conn->send_lock));
+    for (;;)
+    {
+        if (conn->send_error)
+        {
+            errno = conn->send_error;
+            PTHREAD_CALL(pthread_mutex_unlock(&conn->send_lock));
+            return -1;
+        }
+
+        chunk = &conn->out[conn->fill];
+        if (chunk->len + len <= URING_SEND_CHUNK)
+            break;
+
+        /* the other buffer must still be going out */
+        assert(conn->sending || conn->send_posted);
+        PTHREAD_CALL(pthread_cond_wait(&conn->send_cond, &conn->send_lock));
+    }
+
+    for (k = 0; k < iovcnt; ++k)
+    {
+        memcpy(chunk->data + chunk->len, iov[k].iov_base, iov[k].iov_len);
+        chunk->len += iov[k].iov_len;
+    }
+
+    /* if a send is in flight, this goes out once it completes */
+    if (!conn->sending && !conn->send_posted)
+        post = conn->send_posted = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&conn->send_lock));
+
+    if (post)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&r->lock));
+        conn->send = TRUE;
+        _uring_post(conn);
+        PTHREAD_CALL(pthread_mutex_unlock(&r->lock));
+        _uring_wake(r);
+    }
+    return len;
+}
@@ -26,7 +26,7 @@
 
 
 
-static char usage[] = "usage: %s \n";
+static char usage[] = "usage: %s [-r workers] [-F carriers] [-u] [-b busy_poll_usec]\n";
 
 static void do_connection(mysocket_t bindsd);
 static int get_nvt_line(int sd, char *);
@@ -40,14 +40,47 @@ main(int argc, char *argv[])
     struct sockaddr_in sin;
     mysocket_t bindsd;
     int len, opt, errflg = 0;
+    unsigned int busy_poll_usec = 0;
     char localname[256];
 
 
     /* Parse the command line */
-    while ((opt = getopt(argc, argv, "")) != EOF)
+    while ((opt = getopt(argc, argv, "r:F:ub:")) != EOF)
     {
         switch (opt)
         {
+        case 'r':
+            /* run connections on a reactor pool (0: one thread per CPU) */
+            if (myreactor((unsigned int) atoi(optarg)) < 0)
+            {
+                perror("myreactor");
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'F':
+            /* run transports as fibers (0: one carrier thread per CPU) */
+            if (myfibers((unsigned int) atoi(optarg)) < 0)
+            {
+                perror("myfibers");
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'u':
+            /* send and receive through io_uring */
+            if (myuring() < 0)
+            {
+                perror("myuring");
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'b':
+            /* spin this long before blocking, for lower latency */
+            busy_poll_usec = (unsigned int) atoi(optarg);
+            break;
+
         case '?':
             ++errflg;
             break;
@@ -67,6 +100,12 @@ main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    if (busy_poll_usec && mysetbusypoll(bindsd, busy_poll_usec) < 0)
+    {
+        perror("mysetbusypoll");
+        exit(EXIT_FAILURE);
+    }
+
     memset(&sin, 0, sizeof(sin));
     sin.sin_family = AF_INET;
     sin.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -209,6 +248,7 @@ process_line(int sd, char *line)
 {
     char resp[5000];
     int fd = -1, length;
+    off_t file_len = 0, offset;
 
     if (!*line || access(line, R_OK) < 0)
     {
@@ -222,12 +262,14 @@ process_line(int sd, char *line)
         }
         else
         {
-            sprintf(resp, "%s,%lu,Ok\r\n", line, lseek(fd, 0, SEEK_END));
-            lseek(fd, 0, SEEK_SET);
+            file_len = lseek(fd, 0, SEEK_END);
+            sprintf(resp, "%s,%lu,Ok\r\n", line, (unsigned long) file_len);
         }
     }
+
   /** fprintf(stderr, "sending to client: %s of length %d bytes\n", resp, strlen(resp)); **/
-    /* Return the response to the client */
+    /* Return the response to the client, followed by the content of the
+     * file (if any), which mysendfile() takes from the page cache */
     if (mywrite(sd, resp, strlen(resp)) < 0)
     {
         if (fd != -1)
@@ -235,32 +277,19 @@ process_line(int sd, char *line)
         return -1;
     }
 
-    if (fd == -1)
-        return 0;
-
-    for (;;)
+    for (offset = 0; offset < file_len; offset += length)
     {
-        length = read(fd, resp, sizeof(resp));
-        if (length == 0)
-            break;
-
-        if (length == -1)
-        {
-            perror("read");
-            close(fd);
-            return -1;
-        }
-
-        /* fwrite(resp, length, 1, stdout); */
-
-        if (mywrite(sd, resp, length) < 0)
+        if ((length = mysendfile(sd, fd, offset, file_len - offset)) <= 0)
         {
+            if (length == 0)
+                fprintf(stderr, "%s: file truncated\n", line);
             close(fd);
             return -1;
         }
     }
 
-    close(fd);
+    if (fd != -1)
+        close(fd);
     return 0;
 }
 
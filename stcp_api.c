@@ -40,6 +40,10 @@ void stcp_unblock_application(mysocket_t sd)
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
     PTHREAD_CALL(pthread_cond_signal(&ctx->blocking_cond));
 
+    /* a non-blocking myconnect() may be polling for this */
+    __sync_synchronize();
+    _mysock_poll_notify(ctx);
+
     if (!ctx->is_active)
     {
         /* move from incomplete to completed connection queue */
@@ -48,6 +52,35 @@ void stcp_unblock_application(mysocket_t sd)
 }
 
 
+/* see stcp_app_window_lowat().  if the application hasn't read enough
+ * yet, myread() wakes us once it reads some more.
+ */
+static bool_t _app_window_ready(mysock_context_t *ctx)
+{
+    packet_queue_t *pq = &ctx->app_send_queue;
+
+#define WINDOW_READY() \
+    (_mysock_queue_bytes(pq) <= ctx->app_window_unread && \
+     _mysock_queue_has_room(pq, FALSE))
+
+    if (ctx->app_closed || WINDOW_READY())
+        return TRUE;
+
+    pq->producer_waiting = TRUE;
+    __sync_synchronize();
+    return WINDOW_READY();
+#undef WINDOW_READY
+}
+
+
+/* see stcp_app_data_ready() */
+static bool_t _app_data_ready(mysock_context_t *ctx, size_t min_len)
+{
+    return BUSY_POLL_READ(ctx->close_requested) ||
+        _mysock_stream_ready(&ctx->app_recv_queue, min_len);
+}
+
+
 /* called by the transport layer to wait for new data, either from the network
  * or from the application, or for the application to request that the
  * mysocket be closed, depending on the value of flags.  abstime is the
@@ -66,17 +99,44 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
     unsigned int rc = 0;
     mysock_context_t *ctx = _mysock_get_context(sd);
 
+    if (ctx->busy_poll_usec)
+    {
+        busy_poll_t bp;
+
+        /* spin until something looks ready; it's all rechecked below */
+        _mysock_busy_poll_start(&bp, ctx->busy_poll_usec, abstime);
+        while (!((flags & APP_DATA) &&
+                 !_mysock_queue_empty(&ctx->app_recv_queue)) &&
+               !((flags & NETWORK_DATA) &&
+                 !_mysock_queue_empty(&ctx->network_recv_queue)) &&
+               !BUSY_POLL_READ(ctx->close_requested) &&
+               _mysock_busy_poll_continue(&bp))
+            ;
+    }
+
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
     for (;;)
     {
-        if ((flags & APP_DATA) && (ctx->app_recv_queue.head != NULL))
+        /* producers check this after queueing, so anything queued from
+         * here on either shows up below or wakes us
+         */
+        ctx->transport_sleeping = TRUE;
+        __sync_synchronize();
+
+        if ((flags & APP_DATA) && !_mysock_queue_empty(&ctx->app_recv_queue) &&
+            (ctx->app_data_lowat <= 1 ||
+             _app_data_ready(ctx, ctx->app_data_lowat)))
             rc |= APP_DATA;
 
-        if ((flags & NETWORK_DATA) && (ctx->network_recv_queue.head != NULL))
+        if ((flags & NETWORK_DATA) &&
+            !_mysock_queue_empty(&ctx->network_recv_queue))
             rc |= NETWORK_DATA;
 
+        if ((flags & APP_WINDOW) && _app_window_ready(ctx))
+            rc |= APP_WINDOW;
+
         if (/*(flags & APP_CLOSE_REQUESTED) &&*/
-            ctx->close_requested && (ctx->app_recv_queue.head == NULL))
+            ctx->close_requested && _mysock_queue_empty(&ctx->app_recv_queue))
         {
             /* we should only wake up on this event once.  also, we don't
              * pass the close event down to STCP until we've already passed
@@ -89,38 +149,12 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
         if (rc)
             break;
 
-        if (abstime)
-        {
-            /* wait with timeout */
-            switch (pthread_cond_timedwait(&ctx->data_ready_cond,
-                                           &ctx->data_ready_lock,
-                                           abstime))
-            {
-            case 0: /* some data might be available */
-            case EINTR:
-                break;
-
-            case ETIMEDOUT: /* no data arrived in the specified time */
-                goto done;
-
-            case EINVAL:
-                assert(0);
-                break;
-
-            default:
-                assert(0);
-                break;
-            }
-        }
-        else
-        {
-            /* block indefinitely */
-            PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
-                                           &ctx->data_ready_lock));
-        }
+        /* wait, with a timeout if one was given */
+        if (!_mysock_transport_sleep(ctx, abstime))
+            break;  /* no data arrived in the specified time */
     }
 
-done:
+    ctx->transport_sleeping = FALSE;
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
 
     return rc;
@@ -167,6 +201,34 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
     return len;
 }
 
+/* stcp_network_recv_buf
+ *
+ * As stcp_network_recv(), but the datagram is left where the network layer
+ * read it, and *data pointed at it; see stcp_api.h.
+ */
+ssize_t stcp_network_recv_buf(mysocket_t sd, const void **data,
+                              stcp_network_buf_t *buf)
+{
+    packet_queue_node_t *node;
+
+    assert(data && buf);
+
+    node  = _network_recv_node(sd);
+    *data = node->data;
+    *buf  = node;
+
+    assert(node->data_len == 0 ||
+           _mysock_verify_checksum(_mysock_get_context(sd), node->data,
+                                   node->data_len));
+    return node->data_len;
+}
+
+void stcp_network_buf_release(mysocket_t sd, stcp_network_buf_t buf)
+{
+    assert(buf);
+    _mysock_release_node(buf);
+}
+
 /* stcp_network_send()
  *
  * Send data to the peer.
@@ -188,50 +250,66 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
 ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
-    char              packet[MAX_IP_PAYLOAD_LEN];
-    size_t            packet_len;
+    struct iovec      iov[MAX_PACKET_IOV];
+    struct tcphdr     header;
+    size_t            packet_len, header_len, len;
     const void       *next_buf;
     va_list           argptr;
-    struct tcphdr    *header;
+    int               iovcnt, k;
 
     assert(ctx && src);
 
-    assert(src_len <= sizeof(packet));
-    memcpy(packet, src, src_len);
+    /* the buffers are sent from where they lie.  only the TCP header is
+     * copied (into iov[0]), to fill in the fields below.
+     */
+    iov[1].iov_base = (void *) src;
+    iov[1].iov_len  = src_len;
     packet_len = src_len;
+    iovcnt = 2;
 
     va_start(argptr, src_len);
     while ((next_buf = va_arg(argptr, const void *)))
     {
         size_t next_len = va_arg(argptr, size_t);
 
-        assert(packet_len + next_len <= sizeof(packet));
-        memcpy(packet + packet_len, next_buf, next_len);
+        assert(iovcnt < MAX_PACKET_IOV);
+        iov[iovcnt].iov_base = (void *) next_buf;
+        iov[iovcnt].iov_len  = next_len;
         packet_len += next_len;
+        ++iovcnt;
     }
     va_end(argptr);
 
-    /* fill in fields in the TCP header that aren't handled by students */
-    assert(packet_len >= sizeof(struct tcphdr));
-    header = (struct tcphdr *) packet;
+    assert(packet_len >= sizeof(header) && packet_len <= MAX_IP_PAYLOAD_LEN);
+    for (k = 1, header_len = 0; header_len < sizeof(header); ++k)
+    {
+        len = MIN(iov[k].iov_len, sizeof(header) - header_len);
+        memcpy((char *) &header + header_len, iov[k].iov_base, len);
+        iov[k].iov_base = (char *) iov[k].iov_base + len;
+        iov[k].iov_len -= len;
+        header_len += len;
+    }
+    iov[0].iov_base = &header;
+    iov[0].iov_len  = sizeof(header);
 
-    header->th_sport = _network_get_port(&ctx->network_state);
-    /* N.B. assert(header->th_sport > 0) fires in the UDP SYN-ACK case */
+    /* fill in fields in the TCP header that aren't handled by students */
+    header.th_sport = _network_get_port(&ctx->network_state);
+    /* N.B. assert(header.th_sport > 0) fires in the UDP SYN-ACK case */
 
     assert(ctx->network_state.peer_addr.sa_family == AF_INET);
-    header->th_dport =
+    header.th_dport =
         ((struct sockaddr_in *) &ctx->network_state.peer_addr)->sin_port;
-    assert(header->th_dport > 0);
+    assert(header.th_dport > 0);
 
-    header->th_sum = 0; /* set below */
-    header->th_urp = 0; /* ignored */
+    header.th_sum = 0; /* set below */
+    header.th_urp = 0; /* ignored */
 
-    _mysock_set_checksum(ctx, packet, packet_len);
-    return _network_send(sd, packet, packet_len);
+    _mysock_set_checksum(ctx, iov, iovcnt);
+    return _network_send(sd, iov, iovcnt);
 }
 
-/* receive data from the application (sent to us using mywrite()).
- * the call blocks until data is available.
+/* receive data from the application (sent to us using mywrite() or
+ * mywritev()).  the call blocks until data is available.
  */
 size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len)
 {
@@ -241,24 +319,109 @@ size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len)
     /* app may have passed in data of arbitrary length; all of it must be
      * passed down to the transport layer.  if it doesn't fit in the specified
      * buffer, any left over is kept for the next call to app_recv().
+     * conversely, several small writes queued up by now are gathered into
+     * dst together, rather than costing a segment each.
      */
     return _mysock_dequeue_buffer(ctx, &ctx->app_recv_queue,
                                   dst, max_len, TRUE);
 }
 
+bool_t stcp_app_data_ready(mysocket_t sd, size_t min_len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    assert(ctx);
+    return _app_data_ready(ctx, min_len);
+}
+
+void stcp_app_data_lowat(mysocket_t sd, size_t min_len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->app_data_lowat = MAX(min_len, 1);
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+}
+
+size_t stcp_app_send_room(mysocket_t sd, size_t max_room)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    packet_queue_t *pq;
+    size_t unread;
+
+    assert(ctx);
+    pq = &ctx->app_send_queue;
+
+    /* data is discarded once the application has closed the mysocket */
+    if (ctx->app_closed)
+        return max_room;
+    if (!_mysock_queue_has_room(pq, FALSE))
+        return 0;
+
+    unread = _mysock_queue_bytes(pq);
+    return (unread < pq->limit) ? MIN(pq->limit - unread, max_room) : 0;
+}
+
+void stcp_app_window_lowat(mysocket_t sd, size_t min_room)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    size_t limit;
+
+    assert(ctx);
+    limit = ctx->app_send_queue.limit;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->app_window_unread = (min_room < limit) ? limit - min_room : 0;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+}
+
 /* pass data up to the application for consumption by myread() */
 void stcp_app_send(mysocket_t sd, const void *src, size_t src_len)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
     assert(ctx && src);
-    if (src_len > 0)
+    if (src_len > 0 && !ctx->app_closed)
     {
+        size_t placed;
+
         DEBUG_LOG(("stcp_app_send(%d):  sending %u bytes up to app\n",
                    sd, src_len));
-        _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, src, src_len);
+
+        /* straight into the buffer of a myread() that's waiting for it,
+         * if there is one
+         */
+        placed = _mysock_place_direct(ctx, &ctx->app_send_queue, src,
+                                      src_len);
+        if (placed < src_len)
+            _mysock_enqueue_buffer(ctx, &ctx->app_send_queue,
+                                   (const char *) src + placed,
+                                   src_len - placed);
     }
 }
 
+/* the peer has acknowledged more of the application's data */
+void stcp_app_data_acked(mysocket_t sd, size_t len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    assert(ctx);
+    _mysock_data_acked(ctx, len);
+}
+
+void stcp_get_options(mysocket_t sd, stcp_options_t *opts)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    assert(ctx && opts);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    opts->profile    = ctx->opts.profile;
+    opts->window     = ctx->opts.rcv_buf;
+    opts->mss        = ctx->opts.maxseg;
+    opts->congestion = ctx->opts.congestion;
+    opts->nodelay    = ctx->opts.nodelay;
+    opts->cork       = ctx->opts.cork;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+}
+
 void stcp_fin_received(mysocket_t sd)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
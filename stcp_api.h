@@ -17,7 +17,10 @@ typedef enum
     APP_DATA            = 1,
     NETWORK_DATA        = 2,
     APP_CLOSE_REQUESTED = 4,
-    ANY_EVENT           = APP_DATA | NETWORK_DATA | APP_CLOSE_REQUESTED
+    ANY_EVENT           = APP_DATA | NETWORK_DATA | APP_CLOSE_REQUESTED,
+
+    /* only reported if asked for explicitly; see stcp_app_window_lowat() */
+    APP_WINDOW          = 8
 } stcp_event_type_t;
 
 
@@ -81,6 +84,25 @@ void *stcp_get_context(mysocket_t my_sd);
  */
 ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len);
 
+/* Receive a datagram from the peer without copying it.
+ *
+ * sd       Mysocket descriptor.
+ * data     Set to point at the datagram, where it sits in the receive
+ *          buffer it was read into.
+ * buf      Set to a handle for that buffer.
+ *
+ * This blocks as stcp_network_recv() does, and returns the length of the
+ * datagram.  The data is read-only, and stays valid until the buffer is
+ * handed back with stcp_network_buf_release(), which must be done for
+ * every buffer received, including the empty one that signals a broken
+ * connection.
+ */
+typedef struct packet_queue_node *stcp_network_buf_t;
+
+ssize_t stcp_network_recv_buf(mysocket_t sd, const void **data,
+                              stcp_network_buf_t *buf);
+void stcp_network_buf_release(mysocket_t sd, stcp_network_buf_t buf);
+
 /* Send data to the peer.
  *
  * sd           Mysocket descriptor
@@ -98,12 +120,62 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len);
  */
 ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...);
 
-/* receive data from the application (sent to us using mywrite()) */
+/* receive up to max_len bytes of data from the application (sent to us
+ * using mywrite() or mywritev()), gathered from as many writes as needed
+ */
 size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len);
 
+/* has the application queued at least min_len bytes of data to send, or
+ * can it not queue any more before some is sent (because it has closed
+ * the mysocket, or its queue is full)?  for deciding whether to send a
+ * partial segment now or wait for more.
+ */
+bool_t stcp_app_data_ready(mysocket_t sd, size_t min_len);
+
+/* have stcp_wait_for_event() report APP_DATA only once
+ * stcp_app_data_ready(sd, min_len), while holding back a partial segment.
+ * this goes back to 1 (any data at all) whenever the application changes
+ * MYSO_NODELAY or MYSO_CORK.
+ */
+void stcp_app_data_lowat(mysocket_t sd, size_t min_len);
+
+/* how many more bytes of the peer's data the application's queue will
+ * take, up to max_room (none if it's out of room altogether).  the
+ * transport advertises this as its receive window, so the peer can never
+ * overrun the queue.
+ */
+size_t stcp_app_send_room(mysocket_t sd, size_t max_room);
+
+/* have stcp_wait_for_event() report APP_WINDOW, if asked for, once the
+ * application has read enough that its queue has room for min_room more
+ * bytes of the peer's data; for sending a window update.
+ */
+void stcp_app_window_lowat(mysocket_t sd, size_t min_room);
+
 /* pass data up to the application for consumption by myread() */
 void stcp_app_send(mysocket_t sd, const void *src, size_t src_len);
 
+/* let the mysocket layer know that the peer has acknowledged a further
+ * len bytes of application data (not counting the SYN or FIN), so that
+ * buffers handed over with mywrite_zerocopy() can be returned to the app.
+ */
+void stcp_app_data_acked(mysocket_t sd, size_t len);
+
+/* the connection's tuning options (see mysetsockopt()).  zero for window
+ * or mss, and MYCC_DEFAULT, mean the transport profile's own defaults.
+ */
+typedef struct
+{
+    int          profile;       /* MYPROFILE_* */
+    unsigned int window;        /* receive window to advertise */
+    unsigned int mss;
+    int          congestion;    /* MYCC_* */
+    bool_t       nodelay;
+    bool_t       cork;
+} stcp_options_t;
+
+void stcp_get_options(mysocket_t sd, stcp_options_t *opts);
+
 /* once you receive a FIN segment from the peer, we need to let the
  * application know there's no more data arriving (by returning 0 bytes for
  * subsequent myread() calls).  call stcp_fin_received() to indicate the
@@ -1,20 +1,41 @@
 /* TCP checksum support--this is not used directly by students */
 
-#include <stddef.h>
 #include <assert.h>
+#include <string.h>
 #include <netinet/in.h>
 #include "mysock_impl.h"
 #include "transport.h"
 #include "tcp_sum.h"
 
 
-/* computes checksum for TCP segment, based on description in RFCs 793 and
- * 1071, and Berkeley in_cksum().
+/* one's complement sum of the 16-bit words in buf, as laid out in memory;
+ * an odd trailing byte is padded with zero.  buf needn't be aligned.
  */
-uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
-                              uint32_t dst_addr /*network byte order*/,
-                              const void *packet,
-                              size_t len /*host byte order*/)
+static uint32_t _mysock_sum_words(const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+    uint32_t sum = 0;
+    uint16_t word;
+
+    for (; len > 1; p += 2, len -= 2)
+    {
+        memcpy(&word, p, sizeof(word));
+        sum += word;
+    }
+    if (len)
+    {
+        word = 0;
+        *(uint8_t *) &word = *p;
+        sum += word;
+    }
+    return sum;
+}
+
+/* update checksum in the given STCP segment, which is gathered from the
+ * iovcnt buffers in iov.  the TCP header must be the first buffer.
+ */
+void _mysock_set_checksum(const mysock_context_t *ctx,
+                          const struct iovec *iov, int iovcnt)
 {
     struct
     {
@@ -23,64 +44,57 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
         uint8_t  zero;
         uint8_t  protocol;
         uint16_t len;
-    } __attribute__ ((packed)) pseudo_header =
-    {
-        src_addr, dst_addr, 0, IPPROTO_TCP, htons(len)
-    };
+    } __attribute__ ((packed)) pseudo_header;
 
-    unsigned int k;
-    int32_t sum = 0;
+    struct tcphdr *header;
+    uint32_t sum, piece;
+    size_t len = 0;
+    int k;
 
-    assert(packet && len >= sizeof(struct tcphdr));
-    assert(sizeof(pseudo_header) == 12);
+    assert(ctx && iov && iovcnt > 0);
+    assert(iov[0].iov_len >= sizeof(struct tcphdr));
 
+    assert(ctx->network_state.peer_addr.sa_family == AF_INET);
 
-    assert(src_addr > 0);
-    assert(dst_addr > 0);
+    for (k = 0; k < iovcnt; ++k)
+        len += iov[k].iov_len;
 
-    /* process 96-bit pseudo header */
-    for (k = 0; k < sizeof(pseudo_header) / sizeof(uint16_t); ++k)
-        sum += ((uint16_t *) &pseudo_header)[k];
+    pseudo_header.src_addr =
+        _network_get_local_addr((network_context_t *) &ctx->network_state);
+    pseudo_header.dst_addr =
+        ((struct sockaddr_in *) &ctx->network_state.peer_addr)->
+            sin_addr.s_addr;
+    pseudo_header.zero     = 0;
+    pseudo_header.protocol = IPPROTO_TCP;
+    pseudo_header.len      = htons(len);
 
-    /* process TCP header and payload */
-    assert(((long)packet & 2) == 0);
-    assert((offsetof(struct tcphdr, th_sum) & 2) == 0);
-    for (k = 0; k < (len >> 1); ++k)
-    {
-        if (k == (offsetof(struct tcphdr, th_sum) >> 1))
-            continue;   /* th_sum == 0 during checksum computation */
-        sum += ((uint16_t *) packet)[k];
-    }
+    assert(pseudo_header.src_addr > 0);
+    assert(pseudo_header.dst_addr > 0);
 
-    if (len & 1)
+    header = (struct tcphdr *) iov[0].iov_base;
+    header->th_sum = 0;
+
+    sum = _mysock_sum_words(&pseudo_header, sizeof(pseudo_header));
+    for (k = 0, len = 0; k < iovcnt; len += iov[k].iov_len, ++k)
     {
-        uint16_t tmp = 0;
-        *(uint8_t *) &tmp = ((uint8_t *) packet)[len - 1];
-        sum += tmp;
+        piece = _mysock_sum_words(iov[k].iov_base, iov[k].iov_len);
+        piece = (piece >> 16) + (piece & 0xffff);
+        piece = (piece + (piece >> 16)) & 0xffff;
+
+        /* a buffer starting at an odd offset was summed a byte out of
+         * step with the segment's words; swapping its sum makes up for it
+         * (RFC 1071).
+         */
+        if (len & 1)
+            piece = ((piece & 0xff) << 8) | (piece >> 8);
+        sum += piece;
     }
 
     /* fold 32-bit sum to 16 bits */
     sum = (sum >> 16) + (sum & 0xffff);
     sum += (sum >> 16);
 
-    return (uint16_t) ~sum;
-}
-
-/* update checksum in the given STCP segment */
-void _mysock_set_checksum(const mysock_context_t *ctx,
-                          void *packet, size_t len)
-{
-    assert(ctx && packet);
-    assert(len >= sizeof(struct tcphdr));
-
-    assert(ctx->network_state.peer_addr.sa_family == AF_INET);
-
-    ((struct tcphdr *) packet)->th_sum = _mysock_tcp_checksum(
-        _network_get_local_addr((network_context_t *)
-                                &ctx->network_state), /*src*/
-        ((struct sockaddr_in *) &ctx->network_state.peer_addr)-> /*dst*/
-            sin_addr.s_addr,
-        packet, len);
+    header->th_sum = (uint16_t) ~sum;
 }
 
 /* returns TRUE if checksum is correct, FALSE otherwise */
@@ -3,20 +3,79 @@
 #ifndef __TCP_CHECKSUM_H__
 #define __TCP_CHECKSUM_H__
 
+#include <stddef.h>
+#include <assert.h>
+#include <netinet/in.h>
 #include "mysock.h"
+#include "transport.h"
 
 struct mysock_context;
 
-uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
-                              uint32_t dst_addr /*network byte order*/,
-                              const void *packet,
-                              size_t len /*host byte order*/);
+/* computes checksum for TCP segment, based on description in RFCs 793 and
+ * 1071, and Berkeley in_cksum().  this is defined here rather than in
+ * tcp_sum.c so that it can be inlined into the per-segment paths of both
+ * the network layer and the transport core.
+ */
+static __inline__ uint16_t
+_mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
+                     uint32_t dst_addr /*network byte order*/,
+                     const void *packet,
+                     size_t len /*host byte order*/)
+{
+    struct
+    {
+        uint32_t src_addr;
+        uint32_t dst_addr;
+        uint8_t  zero;
+        uint8_t  protocol;
+        uint16_t len;
+    } __attribute__ ((packed)) pseudo_header =
+    {
+        src_addr, dst_addr, 0, IPPROTO_TCP, htons(len)
+    };
+
+    unsigned int k;
+    int32_t sum = 0;
+
+    assert(packet && len >= sizeof(struct tcphdr));
+    assert(sizeof(pseudo_header) == 12);
+
+
+    assert(src_addr > 0);
+    assert(dst_addr > 0);
+
+    /* process 96-bit pseudo header */
+    for (k = 0; k < sizeof(pseudo_header) / sizeof(uint16_t); ++k)
+        sum += ((uint16_t *) &pseudo_header)[k];
+
+    /* process TCP header and payload */
+    assert(((long)packet & 2) == 0);
+    assert((offsetof(struct tcphdr, th_sum) & 2) == 0);
+    for (k = 0; k < (len >> 1); ++k)
+    {
+        if (k == (offsetof(struct tcphdr, th_sum) >> 1))
+            continue;   /* th_sum == 0 during checksum computation */
+        sum += ((uint16_t *) packet)[k];
+    }
+
+    if (len & 1)
+    {
+        uint16_t tmp = 0;
+        *(uint8_t *) &tmp = ((uint8_t *) packet)[len - 1];
+        sum += tmp;
+    }
+
+    /* fold 32-bit sum to 16 bits */
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+
+    return (uint16_t) ~sum;
+}
 
 void _mysock_set_checksum(const struct mysock_context *ctx,
-                          void *packet, size_t len);
+                          const struct iovec *iov, int iovcnt);
 
-bool_t _mysock_verify_checksum(const mysock_context_t *ctx,
+bool_t _mysock_verify_checksum(const struct mysock_context *ctx,
                                const void *packet, size_t len);
 
 #endif  /* __TCP_CHECKSUM_H__ */
-
@@ -1,11 +1,13 @@
 /*
- * transport.c 
+ * transport.c
  *
  * CPSC4510: Project 3 (STCP)
  *
  * This file implements the STCP layer that sits between the
- * mysocket and network layers. You are required to fill in the STCP
- * functionality in this file. 
+ * mysocket and network layers.  The state machine itself lives in
+ * transport_core.h as a template over its window, ACK, congestion control
+ * and checksum policies; this file instantiates the supported
+ * configurations and selects one for each new connection.
  *
  */
 
@@ -15,302 +17,226 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
-#include <arpa/inet.h>
 #include "mysock.h"
 #include "stcp_api.h"
 #include "transport.h"
-#include <sys/time.h>
+#include "transport_core.h"
 
-// globals
-static const unsigned int WINDOW_SIZE = 3072;
-static const unsigned int MSS = 536;
 
-// states
-enum { 
-    CSTATE_ESTABLISHED,
-    SENT_FIN,
-    CLOSED
-};   
-
-/* this structure is global to a mysocket descriptor */
-typedef struct context_t
-{
-    bool_t done;    /* TRUE once connection is closed */
-    int connection_state;   /* state of the connection (established, etc.) */
-    tcp_seq initial_sequence_num;
-	unsigned int seq_num;
-	unsigned int rec_seq_num;
-	unsigned int rec_win;
-} ctx;
-
-static void generate_initial_seq_num(context_t *ctx);
-static void control_loop(mysocket_t sd, context_t *ctx);
-// added funtions
-bool send_packet(mysocket_t sd, context_t *ctx, uint8_t flags, char* data, ssize_t length);
-bool get_packet(mysocket_t sd, context_t *ctx, uint8_t flags);
-bool app_close_event(mysocket_t sd, context_t* ctx);
-bool network_data_event(mysocket_t sd, context_t* ctx);
-bool app_data_event(mysocket_t sd, context_t *ctx);
+/* initial congestion window, in segments, wherever slow start is used */
+#define SLOW_START_INITIAL_SEGMENTS 4
 
+typedef slow_start_congestion_control<SLOW_START_INITIAL_SEGMENTS>
+    slow_start_t;
 
-/* initialise the transport layer, and start the main loop, handling
- * any data from the peer or the application.  this function should not
- * return until the connection is closed.
+/* the profiles.  each is a window policy (whose window and MSS the
+ * mysocket's options may override), an ACK strategy, a default congestion
+ * control policy (used unless MYSO_CONGESTION asks for another) and a
+ * checksum policy.
  */
-void transport_init(mysocket_t sd, bool_t is_active)
-{
-    context_t *ctx;
 
-    ctx = (context_t *) calloc(1, sizeof(context_t));
-    assert(ctx);
-    generate_initial_seq_num(ctx);
+/* MYPROFILE_DEFAULT:  the historical STCP configuration */
+struct default_profile
+{
+    typedef fixed_window<3072, STCP_MSS> window_policy;
+    typedef immediate_ack                ack_policy;
+    typedef no_congestion_control        congestion_policy;
+    typedef trust_network_checksum       checksum_policy;
+};
+
+/* MYPROFILE_BULK:  for large transfers */
+struct bulk_profile
+{
+    typedef fixed_window<49152, 1460>    window_policy;
+    typedef delayed_ack<2, 40>           ack_policy;
+    typedef slow_start_t                 congestion_policy;
+    typedef trust_network_checksum       checksum_policy;
+};
+
+/* MYPROFILE_CHECKED:  as the default, verifying inbound checksums */
+struct checked_profile
+{
+    typedef fixed_window<3072, STCP_MSS> window_policy;
+    typedef immediate_ack                ack_policy;
+    typedef no_congestion_control        congestion_policy;
+    typedef verify_checksum              checksum_policy;
+};
+
+/* the profile's transport, with congestion control policy CC */
+template <class Profile, class CC>
+struct profile_transport
+{
+    typedef stcp_transport<typename Profile::window_policy,
+                           typename Profile::ack_policy,
+                           CC,
+                           typename Profile::checksum_policy> type;
+};
 
-    if(is_active) {
-        // send SYN packet
-        if(!send_packet(sd, ctx, TH_SYN, NULL, 0))
-            return; // unable to send so exit out
 
-        // then we need to wait for the ack
-        if(!get_packet(sd, ctx, (TH_SYN | TH_ACK)))
-            return; // did not get syn ack        
+/* what to do with the transport chosen for a new connection:  run it to
+ * completion (transport_init()), or set it up for the reactor
+ * (transport_open())
+ */
+struct run_op
+{
+    typedef void result_type;
 
-        // finally ack the syn ack
-        if(!send_packet(sd, ctx, TH_ACK, NULL, 0))
-            return;
+    template <class Transport>
+    static void apply(mysocket_t sd, bool_t is_active)
+    {
+        Transport transport(sd, is_active);
+        transport.run();
+    }
+};
 
-    } else {
-        // wait for SYN packet
-        if(!get_packet(sd, ctx, TH_SYN))
-            return;
+struct open_op
+{
+    typedef transport_conn_t *result_type;
 
-        // send a syn ack
-        if(!send_packet(sd, ctx, (TH_SYN | TH_ACK), NULL, 0))
-            return;
+    template <class Transport>
+    static transport_conn_t *apply(mysocket_t sd, bool_t is_active);
+};
 
-        // wait for ack
-        if(!get_packet(sd, ctx, TH_ACK))
-            return;
+template <class Op, class Profile>
+static typename Op::result_type with_profile(mysocket_t sd, bool_t is_active,
+                                             int congestion)
+{
+    switch (congestion)
+    {
+    case MYCC_NONE:
+        return Op::template apply<typename profile_transport<
+            Profile, no_congestion_control>::type>(sd, is_active);
+
+    case MYCC_SLOW_START:
+        return Op::template apply<typename profile_transport<
+            Profile, slow_start_t>::type>(sd, is_active);
+
+    case MYCC_DEFAULT:
+    default:
+        return Op::template apply<typename profile_transport<
+            Profile, typename Profile::congestion_policy>::type>(sd,
+                                                                 is_active);
     }
+}
 
-    ctx->connection_state = CSTATE_ESTABLISHED;
-    stcp_unblock_application(sd);
+/* pick the instantiation for the mysocket's profile and congestion
+ * control options
+ */
+template <class Op>
+static typename Op::result_type select_transport(mysocket_t sd,
+                                                 bool_t is_active)
+{
+    stcp_options_t opts;
 
-    control_loop(sd, ctx);
+    stcp_get_options(sd, &opts);
+    switch (opts.profile)
+    {
+    case MYPROFILE_BULK:
+        return with_profile<Op, bulk_profile>(sd, is_active, opts.congestion);
 
-    /* do any cleanup here */
-    free(ctx);
-}
+    case MYPROFILE_CHECKED:
+        return with_profile<Op, checked_profile>(sd, is_active,
+                                                 opts.congestion);
 
-// send a packet
-bool send_packet(mysocket_t sd, context_t *ctx, uint8_t flags, char* data, ssize_t length) {
-    // create the packet
-    STCPHeader* packet = (STCPHeader*) malloc(sizeof(STCPHeader) + length);
-    packet->th_seq = htonl(ctx->seq_num++);
-    packet->th_ack = htonl(ctx->rec_seq_num+1);
-    packet->th_flags = flags;
-    packet->th_win = htons(WINDOW_SIZE);
-    packet->th_off = htonl(5); // not using optional field
-
-    if(length > 0) 
-        memcpy((char*)packet + sizeof(STCPHeader), data, length);
-
-    // send the packet    
-    if(stcp_network_send(sd, packet, sizeof(STCPHeader)+length, NULL) == (signed)sizeof(STCPHeader)+length) {
-        // free the memory
-        free(packet);
-        return true;
-    } else {
-        // there was an error sending
-        errno = ECONNREFUSED;
-        // free memory
-        free(packet);
-        free(ctx);
-        stcp_unblock_application(sd);
-        return false;
-    }    
+    case MYPROFILE_DEFAULT:
+    default:
+        return with_profile<Op, default_profile>(sd, is_active,
+                                                 opts.congestion);
+    }
 }
 
-// funtion to wait for a packet
-bool get_packet(mysocket_t sd, context_t *ctx, uint8_t flags) {
-    // create the buffer to receive header
-    char buffer[sizeof(STCPHeader)];
-
-    // wait for an event in our socket
-    stcp_wait_for_event(sd, NETWORK_DATA, NULL);
-    // then recv the bytes
-    if(stcp_network_recv(sd, buffer, MSS) < (signed)sizeof(STCPHeader)) {
-        // we did not recieve all the bytes that we should have gotten
-        errno = ECONNREFUSED;        
-        // free memory we dont need anymore
-        free(ctx);
-        //stcp_unblock_application(sd);
-        return false;
-    }
 
-    // get packet info from buffer
-    STCPHeader *packet = (STCPHeader*)buffer;
-
-    // make sure it is correct packet
-    if(packet->th_flags != flags) {
-        // we did not recieve the right flags
-        errno = ECONNREFUSED;
-        // free memory we dont need anymore
-        free(ctx);
-        //stcp_unblock_application(sd);
-        return false;
+/* reactor-mode connection state.  the profile is resolved by one virtual
+ * call per event, leaving the per-segment path as specialised as
+ * transport_init()'s.
+ */
+struct transport_conn
+{
+    virtual ~transport_conn() { }
+    virtual unsigned int wait_flags() const = 0;
+    virtual const struct timespec *deadline() const = 0;
+    virtual bool_t dispatch(unsigned int events) = 0;
+    virtual void finish() = 0;
+};
+
+template <class Transport>
+class transport_conn_impl : public transport_conn
+{
+public:
+    transport_conn_impl(mysocket_t sd, bool_t is_active)
+        : transport_(sd, is_active)
+    {
+        transport_.start();
     }
 
-    // get the rec window size and seq num from receiver
-    ctx->rec_win = ntohs(packet->th_win);
-    if(ctx->rec_win == 0)
-        ctx->rec_win = 1; // for flow control - if 0 try sending 1 byte
-    ctx->rec_seq_num = ntohl(packet->th_seq);
+    unsigned int wait_flags() const { return transport_.wait_flags(); }
+    const struct timespec *deadline() const { return transport_.deadline(); }
+    bool_t dispatch(unsigned int events)
+    {
+        return transport_.dispatch(events);
+    }
+    void finish() { transport_.finish(); }
 
-    return true;
-}
+private:
+    Transport transport_;
+};
 
-/* generate random initial sequence number for an STCP connection */
-static void generate_initial_seq_num(context_t *ctx)
+template <class Transport>
+transport_conn_t *open_op::apply(mysocket_t sd, bool_t is_active)
 {
-    assert(ctx);
-    ctx->rec_seq_num = 0;
-
-#ifdef FIXED_INITNUM
-    /* please don't change this! */
-    ctx->initial_sequence_num = 1;
-#else
-    // set to rand
-    srand(time(0));
-    ctx->initial_sequence_num = rand() % 500;
-#endif
+    return new transport_conn_impl<Transport>(sd, is_active);
 }
 
 
-/* control_loop() is the main STCP loop; it repeatedly waits for one of the
- * following to happen:
- *   - incoming data from the peer
- *   - new data from the application (via mywrite())
- *   - the socket to be closed (via myclose())
- *   - a timeout
+/* initialise the transport layer, and start the main loop, handling
+ * any data from the peer or the application.  this function should not
+ * return until the connection is closed.
  */
-static void control_loop(mysocket_t sd, context_t *ctx)
+void transport_init(mysocket_t sd, bool_t is_active)
 {
-    assert(ctx);
-    assert(!ctx->done);
+    select_transport<run_op>(sd, is_active);
+}
 
-    // loop to run until connection is closed
-    while (true)
-    {
-        // if connetion is closed, break out of loop
-		if(ctx->connection_state == CLOSED){
-			ctx->done = true;
-			break;
-		}
-		
-        // we need to wait for an event to know what to do
-        unsigned int event = stcp_wait_for_event(sd, ANY_EVENT, NULL);		
-        
-        // if we get data from the application, send it over network
-		if(event == APP_DATA){
-			if(!app_data_event(sd, ctx))
-                return;
-		}
-		
-        // if we get data from network, send it to application
-		else if(event == NETWORK_DATA) {
-			if(!network_data_event(sd, ctx))
-                return;
-		}
-		
-        // if we need to close the connection
-		else if(event == APP_CLOSE_REQUESTED){
-			if(!app_close_event(sd, ctx))
-                return;
-		}		
-    }
+transport_conn_t *transport_open(mysocket_t sd, bool_t is_active)
+{
+    return select_transport<open_op>(sd, is_active);
 }
 
-// function for handling data received from application
-bool app_data_event(mysocket_t sd, context_t *ctx){
-	// figure out length
-    ssize_t length = MIN(ctx->rec_win, MSS);
-    length -= sizeof(STCPHeader);  // also need to account for header length
-
-    char buffer[length];
-    // now read and update the actual data length
-    length = stcp_app_recv(sd, buffer, length);
-    if(length == 0) {
-        // could not send if here
-        errno = ECONNREFUSED;
-        // free unneeded memory
-        free(ctx);
-        return false;
-    }
+unsigned int transport_wait_flags(const transport_conn_t *conn)
+{
+    assert(conn);
+    return conn->wait_flags();
+}
 
-    // send packet
-    if(!send_packet(sd, ctx, NETWORK_DATA, buffer, length))
-        return false;
-    
-    // get ack
-    if(!get_packet(sd, ctx, TH_ACK))
-        return false;
+const struct timespec *transport_deadline(const transport_conn_t *conn)
+{
+    assert(conn);
+    return conn->deadline();
+}
 
-    return true;
+bool_t transport_dispatch(transport_conn_t *conn, unsigned int events)
+{
+    assert(conn);
+    return conn->dispatch(events);
 }
 
-// when receiving network data
-bool network_data_event(mysocket_t sd, context_t* ctx) {
-    char buffer[MSS]; //payload
-    
-    // read data from network
-    ssize_t bytes = stcp_network_recv(sd, buffer, MSS);
-    if (bytes < (signed)sizeof(STCPHeader)) {
-        free(ctx);
-        errno = ECONNREFUSED;
-        return false;
-    }
+void transport_close(transport_conn_t *conn)
+{
+    int error;
 
-    // get headers from the read data
-    STCPHeader* bufferHeader = (STCPHeader*)buffer;
-    ctx->rec_seq_num = ntohl(bufferHeader->th_seq);
-    ctx->rec_win = ntohs(bufferHeader->th_win);
-
-    // if it has fin flag then connection will close
-    if (bufferHeader->th_flags == TH_FIN) {
-        send_packet(sd, ctx, TH_ACK, NULL, 0);
-        stcp_fin_received(sd);
-        ctx->connection_state = CLOSED;
-    }    
-    // otherwise read the data from the packet and send it to application
-    else {  
-        stcp_app_send(sd, buffer + sizeof(STCPHeader), bytes - sizeof(STCPHeader));
-        // finally send an ack
-        send_packet(sd, ctx, TH_ACK, NULL, 0);
-    }
-    return true;
+    assert(conn);
+    conn->finish();
+    error = errno;
+    delete conn;
+    errno = error;
 }
 
-// when closing the app
-bool app_close_event(mysocket_t sd, context_t* ctx){
-	if(ctx->connection_state == CSTATE_ESTABLISHED) {
-        if(!send_packet(sd, ctx, TH_FIN, NULL, 0)) {
-            // unable to send :(
-            free(ctx);
-            errno = ECONNREFUSED;            
-            return false;
-        }
-        ctx->connection_state = SENT_FIN;
-		get_packet(sd, ctx, TH_ACK);
-        ctx->connection_state = CLOSED;
-    }
-    return true;
-}
 
 /**********************************************************************/
 /* our_dprintf
  *
  * Send a formatted message to stdout.
- * 
+ *
  * format               A printf-style format string.
  *
  * This function is equivalent to a printf, but may be
@@ -319,7 +245,7 @@ bool app_close_event(mysocket_t sd, context_t* ctx){
  * Calls to this function are generated by the dprintf amd
  * dperror macros in transport.h
  */
- 
+
 void our_dprintf(const char *format,...)
 {
     va_list argptr;
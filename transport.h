@@ -10,6 +10,7 @@
 
 #include <stdio.h>  /* for perror */
 #include <errno.h>
+#include <time.h>   /* timespec */
 #include "mysock.h"
 
 
@@ -76,6 +77,12 @@ typedef struct tcphdr
 /* STCP maximum segment size */
 #define STCP_MSS 536
 
+/* largest STCP segment (header, options and payload) that the network layer
+ * will deliver in one piece.  this matches MAX_IP_PAYLOAD_LEN in the
+ * mysocket layer's network_io.h.
+ */
+#define STCP_MAX_SEGMENT_LEN 1500
+
 
 #ifndef MIN
     #define MIN(x,y)  ((x) <= (y) ? (x) : (y))
@@ -118,4 +125,36 @@ typedef struct tcphdr
 
 extern void transport_init(mysocket_t sd, bool_t is_active);
 
+/* transport configurations compiled into the STCP layer (see
+ * transport_core.h) are selected with the mysocket's MYSO_PROFILE option
+ * (MYPROFILE_* in mysock.h).  each is a separate instantiation of the
+ * transport core, specialised at compile time for its window, ACK
+ * strategy, congestion control and checksum handling.  transport_init()
+ * uses the profile the mysocket has when the connection is set up for the
+ * lifetime of that connection, with the window, MSS and congestion control
+ * overridden by the mysocket's other options if it has any (see
+ * mysetsockopt()).
+ */
+
+/* event-driven interface to the same transport, for the mysocket layer's
+ * reactor mode, where a few threads each run many connections instead of
+ * every connection blocking in its own transport_init().
+ *
+ * transport_open() opens the connection (sending the SYN, if active) and
+ * returns its state.  the caller then repeatedly polls stcp_wait_for_event()
+ * for transport_wait_flags(), passing whatever it returns to
+ * transport_dispatch(); this must also be called, with no events, once the
+ * time returned by transport_deadline() (if not NULL) is reached.
+ * transport_dispatch() returns FALSE once the connection is over, after
+ * which transport_close() frees the state and sets errno as
+ * transport_init() does on return.
+ */
+typedef struct transport_conn transport_conn_t;
+
+extern transport_conn_t *transport_open(mysocket_t sd, bool_t is_active);
+extern unsigned int transport_wait_flags(const transport_conn_t *conn);
+extern const struct timespec *transport_deadline(const transport_conn_t *conn);
+extern bool_t transport_dispatch(transport_conn_t *conn, unsigned int events);
+extern void transport_close(transport_conn_t *conn);
+
 #endif  /* __TRANSPORT_H__ */
@@ -0,0 +1,963 @@
+/* transport_core.h--policy-parameterised STCP engine.
+ *
+ * the STCP state machine is written once, as a class template, and
+ * compiled separately for each configuration.  the acknowledgement
+ * strategy, congestion control and checksum handling are all template
+ * parameters rather than runtime globals, so that the per-segment path of
+ * each instantiation is fully specialised and inlined, with no indirect
+ * calls.  the window size and MSS come from a template parameter too, but
+ * only as defaults, which the mysocket's options (MYSO_RCVBUF and
+ * MYSO_MAXSEG) may override when the connection is set up.  transport.c
+ * instantiates the supported configurations and picks one per connection
+ * in transport_init(); nothing else should include this header.
+ *
+ * a policy is a small class exposing the members used below.  stateless
+ * policies are plain structs; stateful ones keep their per-connection
+ * working state in the policy object, which lives inside the transport.
+ */
+
+#ifndef __TRANSPORT_CORE_H__
+#define __TRANSPORT_CORE_H__
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "mysock.h"
+#include "stcp_api.h"
+#include "transport.h"
+#include "tcp_sum.h"
+#include "transport_metrics.h"
+
+
+/* compile-time assertion, usable at namespace and class scope */
+#define STCP_STATIC_ASSERT(cond, name) \
+    typedef char name[(cond) ? 1 : -1]
+
+/* connection states */
+enum
+{
+    CSTATE_CLOSED,
+    CSTATE_LISTEN,
+    CSTATE_SYN_SENT,
+    CSTATE_SYN_RCVD,
+    CSTATE_ESTABLISHED,
+    CSTATE_FIN_WAIT_1,
+    CSTATE_FIN_WAIT_2,
+    CSTATE_CLOSING,
+    CSTATE_CLOSE_WAIT,
+    CSTATE_LAST_ACK
+};
+
+
+/* sequence number comparisons, modulo 2^32 */
+#define SEQ_LT(a,b)     ((int32_t) ((a) - (b)) < 0)
+#define SEQ_LEQ(a,b)    ((int32_t) ((a) - (b)) <= 0)
+#define SEQ_GT(a,b)     ((int32_t) ((a) - (b)) > 0)
+
+
+/* absolute time 'msec' milliseconds from now, with the same origin as
+ * stcp_wait_for_event()'s abstime.
+ */
+static inline void stcp_deadline_after(struct timespec *ts, unsigned int msec)
+{
+    struct timeval now;
+
+    assert(ts);
+    gettimeofday(&now, NULL);
+    ts->tv_sec  = now.tv_sec + msec / 1000;
+    ts->tv_nsec = (now.tv_usec + (msec % 1000) * 1000) * 1000;
+    if (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec  += 1;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static inline bool_t stcp_deadline_passed(const struct timespec *ts)
+{
+    struct timeval now;
+
+    assert(ts);
+    gettimeofday(&now, NULL);
+    return (now.tv_sec > ts->tv_sec ||
+            (now.tv_sec == ts->tv_sec &&
+             (long) now.tv_usec * 1000 >= ts->tv_nsec));
+}
+
+/* current time in microseconds, for RTT measurement */
+static inline uint64_t stcp_now_usec(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+}
+
+
+/**********************************************************************/
+/* window policies.  Window is the receive window we advertise (and the
+ * most we ever expect to have outstanding), Mss the largest payload we
+ * place in a single segment, unless the mysocket's options say otherwise.
+ */
+
+STCP_STATIC_ASSERT(MYSO_MAX_MAXSEG > 0 &&
+                   sizeof(struct tcphdr) + MYSO_MAX_MAXSEG <=
+                       STCP_MAX_SEGMENT_LEN,
+                   max_maxseg_fits_segment);
+
+template <unsigned int Window, unsigned int Mss>
+struct fixed_window
+{
+    enum { window = Window, mss = Mss };
+
+    STCP_STATIC_ASSERT(Window > 0 && Window <= 0xffff, window_fits_th_win);
+    STCP_STATIC_ASSERT(Mss > 0 &&
+                       sizeof(struct tcphdr) + Mss <= STCP_MAX_SEGMENT_LEN,
+                       mss_fits_segment);
+};
+
+
+/**********************************************************************/
+/* acknowledgement policies.  on_segment() is called for each in-order
+ * data segment, and returns TRUE if an ACK should be sent right away;
+ * deadline() returns the time by which a deferred ACK must go out, or NULL
+ * if none is owed.  on_ack_sent() is called whenever a segment carrying an
+ * ACK leaves, whether a pure ACK or piggybacked on data.
+ */
+
+/* acknowledge every segment as it arrives */
+struct immediate_ack
+{
+    bool_t on_segment() { return TRUE; }
+    void on_ack_sent() { }
+    const struct timespec *deadline() const { return NULL; }
+};
+
+/* acknowledge every Segments'th segment, or DelayMs after the first
+ * unacknowledged one arrives, whichever comes first.
+ */
+template <unsigned int Segments, unsigned int DelayMs>
+class delayed_ack
+{
+public:
+    delayed_ack() : unacked_(0) { }
+
+    bool_t on_segment()
+    {
+        if (++unacked_ >= Segments)
+            return TRUE;
+        if (unacked_ == 1)
+            stcp_deadline_after(&deadline_, DelayMs);
+        return FALSE;
+    }
+
+    void on_ack_sent() { unacked_ = 0; }
+
+    const struct timespec *deadline() const
+    {
+        return unacked_ ? &deadline_ : NULL;
+    }
+
+private:
+    unsigned int    unacked_;   /* in-order segments not yet acknowledged */
+    struct timespec deadline_;
+
+    STCP_STATIC_ASSERT(Segments > 1, use_immediate_ack_instead);
+};
+
+
+/**********************************************************************/
+/* congestion control policies.  window() bounds the number of bytes in
+ * flight (in addition to the peer's advertised window); on_ack() is called
+ * with the number of newly acknowledged bytes.  seed() warm-starts the
+ * window from metrics cached by an earlier connection to the same peer,
+ * bounded by max_window; cwnd() and ssthresh() report the state to be
+ * cached at the end of the connection (zero if the policy has none).
+ */
+
+/* the network is assumed to be reliable; only the peer's window applies */
+struct no_congestion_control
+{
+    void init(unsigned int mss) { }
+    void seed(unsigned int cwnd, unsigned int ssthresh,
+              unsigned int max_window) { }
+    unsigned int window() const { return ~0U; }
+    void on_ack(unsigned int acked, unsigned int mss) { }
+
+    unsigned int cwnd() const { return 0; }
+    unsigned int ssthresh() const { return 0; }
+};
+
+/* slow start from InitialSegments segments, followed by congestion
+ * avoidance once ssthresh is reached (RFC 5681).  STCP does not retransmit,
+ * so there is no loss signal to shrink the window again.
+ */
+template <unsigned int InitialSegments>
+class slow_start_congestion_control
+{
+public:
+    slow_start_congestion_control() : cwnd_(0), ssthresh_(0xffff) { }
+
+    void init(unsigned int mss) { cwnd_ = InitialSegments * mss; }
+
+    void seed(unsigned int cwnd, unsigned int ssthresh,
+              unsigned int max_window)
+    {
+        if (ssthresh)
+            ssthresh_ = ssthresh;
+        if (cwnd > cwnd_)
+            cwnd_ = MIN(cwnd, max_window);
+    }
+
+    unsigned int window() const { return cwnd_; }
+
+    void on_ack(unsigned int acked, unsigned int mss)
+    {
+        if (cwnd_ < ssthresh_)
+            cwnd_ += MIN(acked, mss);
+        else
+            cwnd_ += MAX(1U, mss * mss / cwnd_);
+    }
+
+    unsigned int cwnd() const { return cwnd_; }
+    unsigned int ssthresh() const { return ssthresh_; }
+
+private:
+    unsigned int cwnd_;
+    unsigned int ssthresh_;
+
+    STCP_STATIC_ASSERT(InitialSegments > 0, initial_window_nonzero);
+};
+
+
+/**********************************************************************/
+/* checksum policies.  valid() is applied to every inbound segment before
+ * it's processed; invalid segments are silently dropped.  init() is given
+ * the peer's address (network byte order) once it's known.
+ */
+
+/* the underlying network already guarantees integrity */
+struct trust_network_checksum
+{
+    void init(uint32_t peer_addr) { }
+    bool_t valid(const void *segment, size_t len) const { return TRUE; }
+};
+
+/* recompute the checksum of each inbound segment.  the pseudo-header
+ * addresses are looked up once, when the connection is set up.
+ */
+class verify_checksum
+{
+public:
+    verify_checksum() : local_addr_(0), peer_addr_(0) { }
+
+    void init(uint32_t peer_addr)
+    {
+        if ((peer_addr_ = peer_addr) != 0)
+            local_addr_ = mylocalip(peer_addr_);
+    }
+
+    bool_t valid(const void *segment, size_t len) const
+    {
+        return !peer_addr_ ||
+               _mysock_tcp_checksum(peer_addr_, local_addr_, segment, len) ==
+                   ((const struct tcphdr *) segment)->th_sum;
+    }
+
+private:
+    uint32_t local_addr_;   /* network byte order */
+    uint32_t peer_addr_;    /* network byte order */
+};
+
+
+/**********************************************************************/
+/* round-trip time estimation (RFC 6298).  one segment at a time is timed;
+ * the sample is taken when an ACK covering its last byte arrives.
+ */
+class rtt_estimator
+{
+public:
+    rtt_estimator()
+        : srtt_(0), rttvar_(0), timing_(FALSE), timed_seq_(0), sent_at_(0)
+    {
+    }
+
+    /* start from an earlier connection's estimate */
+    void seed(uint32_t srtt_usec, uint32_t rttvar_usec)
+    {
+        srtt_   = srtt_usec;
+        rttvar_ = rttvar_usec;
+    }
+
+    /* a segment ending just before end_seq has been sent */
+    void on_send(tcp_seq end_seq)
+    {
+        if (!timing_)
+        {
+            timing_    = TRUE;
+            timed_seq_ = end_seq;
+            sent_at_   = stcp_now_usec();
+        }
+    }
+
+    /* everything before ack has been acknowledged */
+    void on_ack(tcp_seq ack)
+    {
+        if (timing_ && SEQ_LEQ(timed_seq_, ack))
+        {
+            uint32_t rtt = (uint32_t) (stcp_now_usec() - sent_at_);
+
+            if (!srtt_)
+            {
+                srtt_   = MAX(rtt, 1U);
+                rttvar_ = rtt / 2;
+            }
+            else
+            {
+                uint32_t delta = (rtt > srtt_) ? rtt - srtt_ : srtt_ - rtt;
+
+                rttvar_ = rttvar_ - rttvar_ / 4 + delta / 4;
+                srtt_   = MAX(srtt_ - srtt_ / 8 + rtt / 8, 1U);
+            }
+            timing_ = FALSE;
+        }
+    }
+
+    uint32_t srtt() const { return srtt_; }
+    uint32_t rttvar() const { return rttvar_; }
+
+private:
+    uint32_t srtt_;         /* microseconds; 0 until the first sample */
+    uint32_t rttvar_;       /* microseconds */
+    bool_t   timing_;       /* TRUE while a sample is outstanding */
+    tcp_seq  timed_seq_;    /* sequence number whose ACK ends the sample */
+    uint64_t sent_at_;      /* microseconds */
+};
+
+
+/**********************************************************************/
+/* the transport proper.  one instance exists per connection, for the
+ * lifetime of transport_init() (or from transport_open() until
+ * transport_close()).
+ */
+template <class WindowPolicy, class AckPolicy,
+          class CongestionPolicy, class ChecksumPolicy>
+class stcp_transport
+{
+public:
+    stcp_transport(mysocket_t sd, bool_t is_active)
+        : sd_(sd), is_active_(is_active), state_(CSTATE_CLOSED), error_(0),
+          peer_addr_(0), window_(WindowPolicy::window),
+          mss_(WindowPolicy::mss), iss_(0), snd_una_(0), snd_nxt_(0),
+          peer_win_(0), holding_(FALSE), hold_timed_(FALSE), rcv_nxt_(0),
+          adv_win_(0)
+    {
+    }
+
+    /* run the connection to completion.  on return, errno holds the reason
+     * the connection failed, or zero if it closed normally.
+     */
+    void run()
+    {
+        start();
+        while (state_ != CSTATE_CLOSED)
+            dispatch(stcp_wait_for_event(sd_, wait_flags(), deadline()));
+        finish();
+    }
+
+    /* the same, broken into steps for callers that multiplex many
+     * connections on one thread (see transport_open()).  start() opens the
+     * connection; dispatch() handles the events stcp_wait_for_event()
+     * returned for wait_flags(), or their absence once deadline() passes,
+     * and returns FALSE when the connection is over; finish() then sets
+     * errno as run() does.
+     */
+    void start()
+    {
+        open();
+    }
+
+    bool_t dispatch(unsigned int event)
+    {
+        const struct timespec *ack_deadline;
+
+        handle_events(event);
+
+        if (state_ != CSTATE_CLOSED &&
+            (ack_deadline = ack_.deadline()) &&
+            stcp_deadline_passed(ack_deadline))
+        {
+            send_segment(TH_ACK);
+        }
+        return state_ != CSTATE_CLOSED;
+    }
+
+    void finish()
+    {
+        if (!error_)
+            save_metrics();
+        errno = error_;
+    }
+
+    unsigned int wait_flags() const
+    {
+        unsigned int flags = NETWORK_DATA | APP_CLOSE_REQUESTED;
+
+        /* leave application data queued while the window is shut */
+        if ((state_ == CSTATE_ESTABLISHED || state_ == CSTATE_CLOSE_WAIT) &&
+            send_window() > 0)
+        {
+            flags |= APP_DATA;
+        }
+
+        /* hear about the application catching up on a window we've shrunk */
+        if (window_reduced())
+            flags |= APP_WINDOW;
+        return flags;
+    }
+
+    /* time by which dispatch() must run even if nothing arrives, or NULL */
+    const struct timespec *deadline() const
+    {
+        const struct timespec *ack_deadline = ack_.deadline();
+
+        if (!hold_timed_)
+            return ack_deadline;
+        if (!ack_deadline ||
+            hold_deadline_.tv_sec < ack_deadline->tv_sec ||
+            (hold_deadline_.tv_sec == ack_deadline->tv_sec &&
+             hold_deadline_.tv_nsec < ack_deadline->tv_nsec))
+            return &hold_deadline_;
+        return ack_deadline;
+    }
+
+private:
+
+    /* per-segment buffer, large enough for any segment the network layer
+     * delivers; uint32_t-aligned for the checksum code.
+     */
+    typedef uint32_t segment_buf_t[(STCP_MAX_SEGMENT_LEN + 3) / 4];
+
+    void open()
+    {
+        struct sockaddr_in sin;
+        socklen_t sin_len = sizeof(sin);
+        stcp_options_t opts;
+
+        /* these stay fixed for the life of the connection */
+        stcp_get_options(sd_, &opts);
+        if (opts.window)
+            window_ = MIN(opts.window, 0xffffU);
+        if (opts.mss)
+            mss_ = MIN(opts.mss, (unsigned int) MYSO_MAX_MAXSEG);
+
+        generate_initial_seq_num();
+        cc_.init(mss_);
+
+        /* the peer's address is already known on both sides:  myconnect()
+         * sets it before the SYN goes out, and passive connections are
+         * created from the peer's SYN.
+         */
+        if (mygetpeername(sd_, (struct sockaddr *) &sin, &sin_len) == 0)
+            peer_addr_ = sin.sin_addr.s_addr;
+        checksum_.init(peer_addr_);
+        load_metrics();
+
+        snd_una_ = snd_nxt_ = iss_;
+        if (is_active_)
+        {
+            state_ = CSTATE_SYN_SENT;
+            send_segment(TH_SYN);
+        }
+        else
+        {
+            /* the SYN that created this connection is already queued */
+            state_ = CSTATE_LISTEN;
+        }
+    }
+
+    void generate_initial_seq_num()
+    {
+#ifdef FIXED_INITNUM
+        /* please don't change this! */
+        iss_ = 1;
+#else
+        unsigned int seed = (unsigned int) time(NULL) ^
+                            ((unsigned int) sd_ << 16);
+        iss_ = rand_r(&seed) % 256;
+#endif
+    }
+
+    /* warm-start from an earlier connection to the same peer */
+    void load_metrics()
+    {
+        transport_metrics_t metrics;
+
+        if (transport_metrics_lookup(peer_addr_, &metrics))
+        {
+            rtt_.seed(metrics.srtt_usec, metrics.rttvar_usec);
+            cc_.seed(metrics.cwnd, metrics.ssthresh, window_);
+        }
+    }
+
+    void save_metrics()
+    {
+        transport_metrics_t metrics;
+
+        metrics.srtt_usec   = rtt_.srtt();
+        metrics.rttvar_usec = rtt_.rttvar();
+        metrics.ssthresh    = cc_.ssthresh();
+        metrics.cwnd        = cc_.cwnd();
+        transport_metrics_update(peer_addr_, &metrics);
+    }
+
+    bool_t synchronized() const
+    {
+        return state_ >= CSTATE_ESTABLISHED;
+    }
+
+    /* bytes we may still send before filling the peer's (or the
+     * congestion) window
+     */
+    unsigned int send_window() const
+    {
+        unsigned int in_flight = snd_nxt_ - snd_una_;
+        unsigned int limit = MIN(peer_win_, cc_.window());
+
+        return (limit > in_flight) ? limit - in_flight : 0;
+    }
+
+    /* is the peer still sending? */
+    bool_t receiving() const
+    {
+        return state_ == CSTATE_ESTABLISHED || state_ == CSTATE_FIN_WAIT_1 ||
+            state_ == CSTATE_FIN_WAIT_2;
+    }
+
+    /* the smallest opening of our receive window worth a window update of
+     * its own, so the peer isn't drawn into sending tiny segments
+     */
+    unsigned int window_update_step() const
+    {
+        return MIN(window_ / 2, mss_);
+    }
+
+    /* have we advertised a window enough smaller than window_, because the
+     * application hasn't read what's arrived, that the peer should be told
+     * when it opens up again?
+     */
+    bool_t window_reduced() const
+    {
+        return receiving() && adv_win_ + window_update_step() <= window_;
+    }
+
+    void handle_events(unsigned int event)
+    {
+        if ((event & APP_WINDOW) && window_reduced())
+            send_segment(TH_ACK);   /* window update */
+        if (event & NETWORK_DATA)
+            receive_segment();
+        if (((event & APP_DATA) || holding_) && state_ != CSTATE_CLOSED)
+            send_app_data();
+        if ((event & APP_CLOSE_REQUESTED) && state_ != CSTATE_CLOSED)
+            app_close();
+    }
+
+    /* fill in the header of 'segment', whose payload (if any) is already
+     * in place, and send it.  SYN and FIN each occupy one sequence number.
+     */
+    void transmit(segment_buf_t segment, uint8_t flags, size_t payload_len)
+    {
+        STCPHeader *header = (STCPHeader *) segment;
+        size_t      segment_len = sizeof(STCPHeader) + payload_len;
+
+        assert(payload_len <= mss_);
+        memset(header, 0, sizeof(*header));
+        header->th_seq   = htonl(snd_nxt_);
+        header->th_ack   = (flags & TH_ACK) ? htonl(rcv_nxt_) : 0;
+        header->th_off   = sizeof(STCPHeader) / sizeof(uint32_t);
+        header->th_flags = flags;
+
+        /* never more than the application's queue has room for, so data
+         * only arrives as fast as the application reads it
+         */
+        adv_win_ = stcp_app_send_room(sd_, window_);
+        header->th_win = htons(adv_win_);
+        if (window_reduced())
+            stcp_app_window_lowat(sd_, adv_win_ + window_update_step());
+
+        if (stcp_network_send(sd_, segment, segment_len, NULL) !=
+            (ssize_t) segment_len)
+        {
+            fail(synchronized() ? ECONNRESET : ECONNREFUSED);
+            return;
+        }
+
+        snd_nxt_ += payload_len;
+        if (flags & (TH_SYN | TH_FIN))
+            ++snd_nxt_;
+        if (payload_len > 0 || (flags & (TH_SYN | TH_FIN)))
+            rtt_.on_send(snd_nxt_);
+        if (flags & TH_ACK)
+            ack_.on_ack_sent();
+    }
+
+    /* send a segment with no payload */
+    void send_segment(uint8_t flags)
+    {
+        segment_buf_t segment;
+        transmit(segment, flags, 0);
+    }
+
+    /* send at most one segment's worth of data from the application.  the
+     * payload is read straight into place behind the header.
+     */
+    void send_app_data()
+    {
+        segment_buf_t segment;
+        size_t room = MIN(send_window(), mss_);
+        size_t len;
+
+        if (room == 0)
+            return;
+
+        if (!stcp_app_data_ready(sd_, room) && hold_partial(room))
+            return;
+        release_hold();
+
+        if ((len = stcp_app_recv(sd_, (STCPHeader *) segment + 1, room)) > 0)
+        {
+            /* a short read means we've reached the end of what the
+             * application has written so far.  if it has already asked to
+             * close, the FIN rides on this final data segment rather than
+             * following in a segment of its own.
+             */
+            if (len < room && app_close_pending())
+                send_fin(segment, len);
+            else
+                transmit(segment, TH_ACK, len);
+        }
+    }
+
+    /* should a partial segment wait for more data?  with MYSO_CORK, it
+     * waits up to MYSO_CORK_MSEC; without MYSO_NODELAY, until everything in
+     * flight has been acknowledged (Nagle's algorithm).  meanwhile,
+     * application data is only reported once there's room's worth of it.
+     */
+    bool_t hold_partial(size_t room)
+    {
+        stcp_options_t opts;
+        bool_t hold;
+
+        stcp_get_options(sd_, &opts);
+        if (opts.cork)
+        {
+            if (!hold_timed_)
+            {
+                stcp_deadline_after(&hold_deadline_, MYSO_CORK_MSEC);
+                hold_timed_ = TRUE;
+            }
+            hold = !stcp_deadline_passed(&hold_deadline_);
+        }
+        else
+        {
+            hold_timed_ = FALSE;
+            hold = !opts.nodelay && snd_nxt_ != snd_una_;
+        }
+
+        /* set every time, since changing the options resets it */
+        if (hold)
+            stcp_app_data_lowat(sd_, room);
+        holding_ = hold;
+        return hold;
+    }
+
+    void release_hold()
+    {
+        if (holding_)
+            stcp_app_data_lowat(sd_, 1);
+        holding_ = hold_timed_ = FALSE;
+    }
+
+    /* poll (without blocking) for a myclose() with nothing left to send.
+     * this consumes the close event.
+     */
+    bool_t app_close_pending()
+    {
+        static const struct timespec already_expired = { 0, 0 };
+
+        return (stcp_wait_for_event(sd_, APP_CLOSE_REQUESTED,
+                                    &already_expired) &
+                APP_CLOSE_REQUESTED) != 0;
+    }
+
+    /* send our FIN, along with any payload already in 'segment' */
+    void send_fin(segment_buf_t segment, size_t payload_len)
+    {
+        switch (state_)
+        {
+        case CSTATE_ESTABLISHED:
+            state_ = CSTATE_FIN_WAIT_1;
+            break;
+        case CSTATE_CLOSE_WAIT:
+            state_ = CSTATE_LAST_ACK;
+            break;
+        default:
+            assert(0);
+            break;
+        }
+
+        transmit(segment, TH_FIN | TH_ACK, payload_len);
+    }
+
+    /* the application has called myclose(), and every byte it wrote has
+     * been sent
+     */
+    void app_close()
+    {
+        segment_buf_t segment;
+
+        switch (state_)
+        {
+        case CSTATE_ESTABLISHED:
+        case CSTATE_CLOSE_WAIT:
+            send_fin(segment, 0);
+            break;
+
+        case CSTATE_LISTEN:
+        case CSTATE_SYN_SENT:
+        case CSTATE_SYN_RCVD:
+            /* closed before the connection was ever established */
+            fail(ECONNABORTED);
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    /* the segment is read in place from the network layer's buffer */
+    void receive_segment()
+    {
+        stcp_network_buf_t buf;
+        const void *segment;
+        ssize_t len;
+
+        len = stcp_network_recv_buf(sd_, &segment, &buf);
+        process_segment((const char *) segment, len);
+        stcp_network_buf_release(sd_, buf);
+    }
+
+    void process_segment(const char *segment, ssize_t len)
+    {
+        const STCPHeader *header = (const STCPHeader *) segment;
+        size_t header_len;
+
+        if (len <= 0)
+        {
+            /* the network layer signals a broken connection with an
+             * empty packet
+             */
+            fail(synchronized() ? ECONNRESET : ECONNREFUSED);
+            return;
+        }
+
+        if ((size_t) len < sizeof(STCPHeader) ||
+            (header_len = TCP_DATA_START(header)) < sizeof(STCPHeader) ||
+            header_len > (size_t) len ||
+            !checksum_.valid(segment, len))
+        {
+            dprintf("dropping malformed segment (%d bytes)\n", (int) len);
+            return;
+        }
+
+        switch (state_)
+        {
+        case CSTATE_LISTEN:
+            if (header->th_flags & TH_SYN)
+            {
+                rcv_nxt_  = ntohl(header->th_seq) + 1;
+                peer_win_ = ntohs(header->th_win);
+                state_    = CSTATE_SYN_RCVD;
+                send_segment(TH_SYN | TH_ACK);
+            }
+            return;
+
+        case CSTATE_SYN_SENT:
+            if ((header->th_flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK) &&
+                ntohl(header->th_ack) == snd_nxt_)
+            {
+                rcv_nxt_  = ntohl(header->th_seq) + 1;
+                snd_una_  = snd_nxt_;
+                rtt_.on_ack(snd_una_);
+                peer_win_ = ntohs(header->th_win);
+                state_    = CSTATE_ESTABLISHED;
+                send_segment(TH_ACK);
+                stcp_unblock_application(sd_);
+            }
+            return;
+
+        case CSTATE_SYN_RCVD:
+            if (!(header->th_flags & TH_ACK) ||
+                ntohl(header->th_ack) != snd_nxt_)
+                return;
+            snd_una_ = snd_nxt_;
+            rtt_.on_ack(snd_una_);
+            state_ = CSTATE_ESTABLISHED;
+            stcp_unblock_application(sd_);
+            break;
+
+        default:
+            break;
+        }
+
+        if (header->th_flags & TH_ACK)
+            process_ack(header);
+
+        receive_data(header, segment + header_len, len - header_len);
+    }
+
+    void process_ack(const STCPHeader *header)
+    {
+        tcp_seq ack = ntohl(header->th_ack);
+
+        if (SEQ_GT(ack, snd_una_) && SEQ_LEQ(ack, snd_nxt_))
+        {
+            unsigned int data_acked = ack - snd_una_;
+
+            /* our FIN takes up the last sequence number once it's been
+             * sent.  (the SYN's is taken care of by the handshake.)
+             */
+            if (ack == snd_nxt_ &&
+                (state_ == CSTATE_FIN_WAIT_1 || state_ == CSTATE_CLOSING ||
+                 state_ == CSTATE_LAST_ACK))
+            {
+                --data_acked;
+            }
+            if (data_acked > 0)
+                stcp_app_data_acked(sd_, data_acked);
+
+            cc_.on_ack(ack - snd_una_, mss_);
+            rtt_.on_ack(ack);
+            snd_una_ = ack;
+
+            if (snd_una_ == snd_nxt_)
+            {
+                /* everything we sent, including any FIN, is acknowledged */
+                switch (state_)
+                {
+                case CSTATE_FIN_WAIT_1:
+                    state_ = CSTATE_FIN_WAIT_2;
+                    break;
+                case CSTATE_CLOSING:
+                case CSTATE_LAST_ACK:
+                    state_ = CSTATE_CLOSED;
+                    break;
+                default:
+                    break;
+                }
+            }
+        }
+
+        if (SEQ_LEQ(snd_una_, ack))
+            peer_win_ = ntohs(header->th_win);
+    }
+
+    void receive_data(const STCPHeader *header,
+                      const char *payload, size_t payload_len)
+    {
+        bool_t fin = (header->th_flags & TH_FIN) != 0;
+
+        if (payload_len == 0 && !fin)
+            return;     /* pure ACK; never acknowledged itself */
+
+        if (ntohl(header->th_seq) != rcv_nxt_ ||
+            !(state_ == CSTATE_ESTABLISHED || state_ == CSTATE_FIN_WAIT_1 ||
+              state_ == CSTATE_FIN_WAIT_2))
+        {
+            /* duplicate or out of order; tell the peer where we are */
+            if (state_ != CSTATE_CLOSED)
+                send_segment(TH_ACK);
+            return;
+        }
+
+        if (payload_len > 0)
+        {
+            stcp_app_send(sd_, payload, payload_len);
+            rcv_nxt_ += payload_len;
+        }
+
+        if (!fin)
+        {
+            if (ack_.on_segment())
+                send_segment(TH_ACK);
+            return;
+        }
+
+        /* the peer has finished sending */
+        ++rcv_nxt_;
+        stcp_fin_received(sd_);
+        send_segment(TH_ACK);
+
+        switch (state_)
+        {
+        case CSTATE_ESTABLISHED:
+            state_ = CSTATE_CLOSE_WAIT;
+            break;
+        case CSTATE_FIN_WAIT_1:
+            state_ = CSTATE_CLOSING;
+            break;
+        case CSTATE_FIN_WAIT_2:
+            state_ = CSTATE_CLOSED;    /* STCP has no TIME_WAIT */
+            break;
+        default:
+            break;
+        }
+    }
+
+    void fail(int error)
+    {
+        error_ = error;
+        state_ = CSTATE_CLOSED;
+    }
+
+private:
+    mysocket_t sd_;
+    bool_t     is_active_;
+    int        state_;
+    int        error_;      /* errno reported once the connection is over */
+    uint32_t   peer_addr_;  /* network byte order; 0 if unknown */
+
+    /* from the window policy, or the mysocket's options */
+    unsigned int window_;   /* largest receive window we advertise */
+    unsigned int mss_;
+
+    /* send state */
+    tcp_seq      iss_;      /* initial send sequence number */
+    tcp_seq      snd_una_;  /* oldest unacknowledged sequence number */
+    tcp_seq      snd_nxt_;  /* next sequence number to send */
+    unsigned int peer_win_; /* peer's advertised receive window */
+
+    /* a partial segment held back for more data (see hold_partial()),
+     * until hold_deadline_ if hold_timed_ is set
+     */
+    bool_t          holding_;
+    bool_t          hold_timed_;
+    struct timespec hold_deadline_;
+
+    /* receive state */
+    tcp_seq      rcv_nxt_;  /* next sequence number expected from peer */
+    unsigned int adv_win_;  /* receive window we last advertised */
+
+    rtt_estimator    rtt_;
+    AckPolicy        ack_;
+    CongestionPolicy cc_;
+    ChecksumPolicy   checksum_;
+};
+
+#endif  /* __TRANSPORT_CORE_H__ */
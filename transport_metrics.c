@@ -0,0 +1,118 @@
+/* transport_metrics.c--per-destination metrics cache */
+
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+#include "mysock.h"
+#include "transport_metrics.h"
+
+
+/* the cache is a fixed-size, set-associative table:  each peer address
+ * hashes to one bucket, and within a bucket the least recently updated
+ * entry is replaced when a new destination needs room.
+ */
+#define METRICS_NUM_BUCKETS 256
+#define METRICS_BUCKET_WAYS 4
+
+#if (METRICS_NUM_BUCKETS & (METRICS_NUM_BUCKETS - 1)) != 0
+    #error METRICS_NUM_BUCKETS should be a power of two
+#endif
+
+typedef struct
+{
+    uint32_t            peer_addr;  /* network byte order; 0 if unused */
+    time_t              stamp;      /* time of last update */
+    transport_metrics_t metrics;
+} metrics_entry_t;
+
+static metrics_entry_t metrics_table[METRICS_NUM_BUCKETS][METRICS_BUCKET_WAYS];
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static metrics_entry_t *_metrics_bucket(uint32_t peer_addr)
+{
+    /* Fibonacci hashing spreads consecutive addresses across buckets */
+    uint32_t h = peer_addr * 2654435769U;
+    return metrics_table[h >> 24 & (METRICS_NUM_BUCKETS - 1)];
+}
+
+/* find the entry for peer_addr; assumes the caller holds metrics_lock */
+static metrics_entry_t *_metrics_find(uint32_t peer_addr)
+{
+    metrics_entry_t *bucket = _metrics_bucket(peer_addr);
+    int k;
+
+    for (k = 0; k < METRICS_BUCKET_WAYS; ++k)
+    {
+        if (bucket[k].peer_addr == peer_addr)
+            return &bucket[k];
+    }
+    return NULL;
+}
+
+bool_t transport_metrics_lookup(uint32_t peer_addr,
+                                transport_metrics_t *metrics)
+{
+    metrics_entry_t *e;
+    bool_t found = FALSE;
+
+    assert(metrics);
+    if (!peer_addr)
+        return FALSE;
+
+    pthread_mutex_lock(&metrics_lock);
+    if ((e = _metrics_find(peer_addr)) &&
+        time(NULL) - e->stamp < TRANSPORT_METRICS_TIMEOUT)
+    {
+        *metrics = e->metrics;
+        found = TRUE;
+    }
+    pthread_mutex_unlock(&metrics_lock);
+
+    return found;
+}
+
+void transport_metrics_update(uint32_t peer_addr,
+                              const transport_metrics_t *metrics)
+{
+    metrics_entry_t *e;
+    time_t now = time(NULL);
+
+    assert(metrics);
+    if (!peer_addr)
+        return;
+
+    pthread_mutex_lock(&metrics_lock);
+    if (!(e = _metrics_find(peer_addr)) ||
+        now - e->stamp >= TRANSPORT_METRICS_TIMEOUT)
+    {
+        if (!e)
+        {
+            /* take over the stalest entry in the bucket */
+            metrics_entry_t *bucket = _metrics_bucket(peer_addr);
+            int k;
+
+            for (e = &bucket[0], k = 1; k < METRICS_BUCKET_WAYS; ++k)
+            {
+                if (bucket[k].stamp < e->stamp)
+                    e = &bucket[k];
+            }
+        }
+
+        memset(e, 0, sizeof(*e));
+        e->peer_addr = peer_addr;
+    }
+
+    if (metrics->srtt_usec)
+    {
+        e->metrics.srtt_usec   = metrics->srtt_usec;
+        e->metrics.rttvar_usec = metrics->rttvar_usec;
+    }
+    if (metrics->ssthresh)
+        e->metrics.ssthresh = metrics->ssthresh;
+    if (metrics->cwnd)
+        e->metrics.cwnd = metrics->cwnd;
+    e->stamp = now;
+    pthread_mutex_unlock(&metrics_lock);
+}
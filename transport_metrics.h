@@ -0,0 +1,39 @@
+/* transport_metrics.h--per-destination metrics cache.
+ *
+ * a process-wide cache, keyed by the peer's IP address, of what the
+ * transport learned about the path during earlier connections (much like
+ * Linux's tcp_metrics).  new connections seed their RTT estimate and
+ * congestion state from it, so repeated short transfers to the same host
+ * don't start cold.
+ */
+
+#ifndef __TRANSPORT_METRICS_H__
+#define __TRANSPORT_METRICS_H__
+
+#include "mysock.h"
+
+/* entries not refreshed within this many seconds are ignored */
+#define TRANSPORT_METRICS_TIMEOUT   3600
+
+/* a zero field means the value is unknown */
+typedef struct
+{
+    uint32_t srtt_usec;     /* smoothed round-trip time */
+    uint32_t rttvar_usec;   /* round-trip time variation */
+    uint32_t ssthresh;      /* slow start threshold, in bytes */
+    uint32_t cwnd;          /* last congestion window, in bytes */
+} transport_metrics_t;
+
+/* look up the cached metrics for peer_addr (network byte order).  returns
+ * TRUE and fills in *metrics if a current entry exists.
+ */
+bool_t transport_metrics_lookup(uint32_t peer_addr,
+                                transport_metrics_t *metrics);
+
+/* record metrics for peer_addr at the end of a connection.  unknown (zero)
+ * fields leave the corresponding cached value alone.
+ */
+void transport_metrics_update(uint32_t peer_addr,
+                              const transport_metrics_t *metrics);
+
+#endif  /* __TRANSPORT_METRICS_H__ */